@@ -0,0 +1,41 @@
+#ifndef ACIA_H
+#define ACIA_H
+
+#include "serial.h"
+
+/* Serial port, two registers:
+ * +0 data    read takes the next input byte (0 if there isn't one), write sends a byte
+ * +1 status  bit 3 is set while an input byte is waiting, bit 7 while that raises IRQ
+ *    control (written) bit 7 turns the receive interrupt on
+ *
+ * Input comes from a SerialInput's ring buffer, so reading either register
+ * never makes a syscall. Status reads see input as soon as it's there, the
+ * IRQ line only changes when whoever owns the ACIA calls ACIA_poll (every so
+ * often) or on a register access.
+ */
+#define ACIA_DATA          0
+#define ACIA_STATUS        1
+#define ACIA_STATUS_RX_FULL 0x08
+#define ACIA_STATUS_IRQ     0x80
+#define ACIA_CONTROL_RX_IRQ 0x80
+
+typedef struct ACIA_s {
+    SerialInput*  input;  /* NULL when nothing is connected, reads then see no input */
+    SerialOutput* output; /* NULL drops everything written */
+    bool rx_full;         /* As of the last ACIA_poll */
+    u8   control;
+    u32  received;        /* Bytes data reads took, counts up, tells a 0 byte from no input */
+} ACIA;
+
+void ACIA_init(ACIA* acia, SerialInput* input, SerialOutput* output); /* Doesn't take ownership of either */
+u8   ACIA_read(ACIA* acia, u8 reg);
+void ACIA_write(ACIA* acia, u8 reg, u8 data);
+bool ACIA_poll(ACIA* acia); /* Looks for input, returns rx_full */
+u8   ACIA_read_replayed(ACIA* acia, u8 reg, bool rx_full, u8 data); /* A read of input that isn't the SerialInput's, see below */
+
+/* Whether the ACIA is holding its IRQ line */
+static inline bool ACIA_irq(const ACIA* acia) {
+    return (acia->control & ACIA_CONTROL_RX_IRQ) && acia->rx_full;
+}
+
+#endif /* ACIA_H */
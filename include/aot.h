@@ -0,0 +1,48 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "cpu.h"
+
+/* Ahead-of-time recompiled ROMs.
+ * tools/recompile.c translates a ROM image into C: one function per basic
+ * block reachable from the vectors, plus an AOTProgram listing them. A build
+ * with that file linked in (make AOT_ROM=rom.bin) runs those blocks straight
+ * from AOT_run, everything else (RAM code, JMP (ind) targets, BRK...) goes
+ * through CPU_step_instruction. The state after AOT_run is the same as after CPU_run.
+ */
+typedef void (*aot_block_fn_ptr)(CPU* cpu);
+
+typedef struct AOTBlock_s {
+    u16 pc;
+    u16 cycles;           /* Every instruction in a block takes a fixed number of cycles */
+    u16 instructions;
+    aot_block_fn_ptr run; /* Runs the whole block and leaves r.PC where it went */
+} AOTBlock;
+
+typedef struct AOTProgram_s {
+    u16 rom_base;
+    u32 rom_size;
+    u32 rom_checksum;     /* AOT_checksum of the ROM it was made from */
+    u32 block_count;
+    const AOTBlock* blocks;
+} AOTProgram;
+
+typedef struct AOT_s AOT;
+
+/* Defined by the generated file, only linked in builds with CPU_AOT */
+extern const AOTProgram aot_program;
+
+/* FNV-1a */
+static inline u32 AOT_checksum(const u8* data, u32 size) {
+    u32 hash = 2166136261u;
+    for (u32 i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+AOT* AOT_create(CPU* cpu, const AOTProgram* program); /* NULL unless cpu has the program's ROM mapped */
+void AOT_destroy(AOT* aot);
+RunResult AOT_run(AOT* aot, u64 cycle_budget);
+
+#endif /* AOT_H */
@@ -0,0 +1,90 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "cpu.h"
+
+/* Lockstep batches: BATCH_LANES copies of one ROM, stepped together.
+ * Every lane is a CPU with its own registers and 2KB of RAM, and they all
+ * share one ROM image (same memory map as Machine). The registers are kept as
+ * structure-of-arrays vectors, so an instruction that several lanes are
+ * about to run is done for all of them at once with SSE/AVX2 (or whatever
+ * the host has, through the compiler's vector extensions).
+ *
+ * Each step runs the instruction at the lowest PC any active lane is at, for
+ * every lane that's there. Lanes that took the other side of a branch simply
+ * wait, and join back in once the others catch up with them. Anything the
+ * vector kernels don't do (code in RAM, I/O accesses, JMP (ind), BRK...) is
+ * run for each of its lanes by an ordinary CPU, so every lane ends up in the
+ * same state as a Machine running the same ROM with the same inputs would.
+ *
+ * Needs GCC or Clang.
+ */
+#ifndef BATCH_LANES
+#define BATCH_LANES 16 /* 8, 16 or 32 (32 wants AVX-512, with AVX2 it's slower than 16) */
+#endif
+
+#define BATCH_RAM_SIZE 0x800
+#define BATCH_ROM_SIZE 0x8000
+
+typedef u8  BatchU8  __attribute__((vector_size(BATCH_LANES)));
+typedef u16 BatchU16 __attribute__((vector_size(BATCH_LANES * 2)));
+
+/* I/O, everything between the RAM and the ROM ($2000-$7FFF). lane says whose access it is */
+typedef u8   (*batch_read_fn_ptr)(void* context, u32 lane, u16 address);
+typedef void (*batch_write_fn_ptr)(void* context, u32 lane, u16 address, u8 data);
+
+typedef struct Batch_s {
+    /* Registers, lane by lane. P has stale N and Z, like CPU.r.P: use Batch_get_registers */
+    BatchU8  A;
+    BatchU8  X;
+    BatchU8  Y;
+    BatchU8  SP;
+    BatchU8  P;
+    BatchU8  flag_n_source;
+    BatchU8  flag_z_source;
+    BatchU16 PC;
+    BatchU8  running;       /* 0xFF while the lane's CPU runs */
+    BatchU8  waiting;       /* 0xFF while WAI has the lane parked, nothing raises interrupts in here so it stays until a reset */
+
+    u64  cycle_count[BATCH_LANES];
+    u64  instruction_count[BATCH_LANES];
+    STOP stop_reason[BATCH_LANES];
+
+    /* Interleaved, a lane's byte at address is ram[address][lane], so the lanes'
+     * bytes at one address are one vector. Use Batch_read_ram/Batch_write_ram
+     */
+    BatchU8 ram[BATCH_RAM_SIZE];
+    const u8* rom;          /* BATCH_ROM_SIZE bytes at $8000, not owned */
+
+    batch_read_fn_ptr  read_fn;
+    batch_write_fn_ptr write_fn;
+    void* context;
+
+    /* Stats */
+    u64 vector_steps;        /* Instructions run for a group of lanes at once */
+    u64 scalar_instructions; /* Lane instructions run on their own, the rest of instruction_count went in groups */
+
+    /* INTERNAL */
+    CPU scalar;             /* Runs the lanes that can't go with the others */
+    u32 scalar_lane;
+    BatchU16 pending_cycles;       /* Not in cycle_count/instruction_count yet, */
+    BatchU16 pending_instructions; /* 16 bits go a lot further in a vector than 64 */
+    u32 pending_steps;
+} Batch;
+
+/* address is mirrored like on the bus, $0000-$1FFF */
+static inline u8 Batch_read_ram(Batch* batch, u32 lane, u16 address) {
+    return batch->ram[address & (BATCH_RAM_SIZE - 1)][lane];
+}
+
+static inline void Batch_write_ram(Batch* batch, u32 lane, u16 address, u8 data) {
+    batch->ram[address & (BATCH_RAM_SIZE - 1)][lane] = data;
+}
+
+Batch* Batch_create(const u8* rom, batch_read_fn_ptr read_fn, batch_write_fn_ptr write_fn, void* context); /* NULL if out of memory */
+void Batch_destroy(Batch* batch);
+void Batch_reset(Batch* batch); /* Every lane through the reset sequence, RAM is left alone */
+u64  Batch_run(Batch* batch, u64 cycle_budget); /* Each lane like CPU_run(cycle_budget), returns all their cycles together */
+RegFile Batch_get_registers(Batch* batch, u32 lane);
+
+#endif /* BATCH_H */
@@ -14,6 +14,8 @@ typedef signed   char  i8 ;
 typedef unsigned short u16;
 typedef signed   short i16;
 typedef unsigned int   u32;
+typedef unsigned long long u64;
+typedef signed   long long i64;
 
 typedef struct RegFile_s {
     u8 A;
@@ -26,19 +28,94 @@ typedef struct RegFile_s {
     u8  SP;
 } RegFile;
 
-typedef u8   (*read_fn_ptr)(u16 address);
-typedef void (*write_fn_ptr)(u16 address, u8 data);
+/* context is whatever was given to CPU_reset, so one callback can serve many CPUs */
+typedef u8   (*read_fn_ptr)(void* context, u16 address);
+typedef void (*write_fn_ptr)(void* context, u16 address, u8 data);
+
+struct CPU_s;
+struct DecodedInstruction_s;
+struct Trace_s;
+struct Hooks_s;
+typedef void (*instruction_fn_ptr)(struct CPU_s* cpu);
+typedef u32  (*decoded_fn_ptr)(struct CPU_s* cpu, const struct DecodedInstruction_s* decoded);
+
+/* Decoded instruction cache, used by the whole-instruction paths (CPU_step_instruction, CPU_run).
+ * Direct mapped on the PC, and only holds code from mapped pages. Pages that are
+ * writable get their direct writes turned off while they hold decoded code, at
+ * every page mapped to the same RAM, so the first write to one of them through
+ * any mirror invalidates it.
+ *
+ * It lives outside the CPU and is only allocated once something gets decoded,
+ * so a CPU that never runs whole instructions doesn't pay for it. Machines that
+ * have to be small can have a smaller one, or none, see CPU_set_decode_cache.
+ */
+#define CPU_DECODE_CACHE_SIZE 0x1000     /* Entries by default, must be a power of 2 */
+#define CPU_DECODE_VALID      0x10000    /* Set in the tag of a valid entry */
+#define CPU_DECODE_HOOK       0x100      /* label of a hooked address */
+
+typedef struct DecodedInstruction_s {
+    decoded_fn_ptr run; /* Runs the whole instruction, returns its cycles */
+    u32 tag;            /* PC | CPU_DECODE_VALID */
+    u8  opcode;
+    u8  operand[2];
+    u8  length;
+    u8  cycles;         /* Fixed part of the cost (fetch + addressing), the operation adds its own */
+    u16 label;          /* Where the threaded core jumps: the opcode's label, or CPU_DECODE_HOOK */
+} DecodedInstruction;
+
+typedef enum STOP_e : u8 {
+    STOP_NONE      = 0,
+    STOP_BUDGET    = 1, /* The cycle budget given to CPU_run ran out */
+    STOP_BRK       = 2,
+    STOP_ILLEGAL   = 3,
+    STOP_REQUESTED = 4, /* Someone called CPU_request_stop */
+    STOP_NO_MEMORY = 5, /* Memory behind a copy-on-write page couldn't be allocated */
+    STOP_STP       = 6  /* STP ran, only a reset gets the CPU going again */
+} STOP;
+
+/* What CPU.interrupt holds while an interrupt sequence runs */
+#define CPU_INTERRUPT_NONE 0
+#define CPU_INTERRUPT_IRQ  1
+#define CPU_INTERRUPT_NMI  2
+
+typedef struct RunResult_s {
+    u64  cycles;
+    STOP reason;
+} RunResult;
 
 typedef struct CPU_s {
     RegFile r;
 
-    read_fn_ptr read_fn;  /* u8 read_fn(u16 address) */
-    write_fn_ptr write_fn; /* void write_fn(u16 address, u8 data) */ 
+    read_fn_ptr read_fn;  /* u8 read_fn(void* context, u16 address) */
+    write_fn_ptr write_fn; /* void write_fn(void* context, u16 address, u8 data) */ 
+    void* context;        /* First argument of read_fn/write_fn */
+    struct Trace_s* trace; /* Records every instruction the interpreter runs while set, see trace.h */
+    struct Hooks_s* hooks; /* Host routines that stand in for the guest's, see hooks.h */
     u8 cycle;
     bool is_running;
-    u32 instruction_count;
+    STOP stop_reason; /* Why is_running went false */
+    bool stop_requested; /* Atomic, set by CPU_request_stop and taken by the run loops */
+    u64 instruction_count;
+    u64 cycle_count;
+
+    instruction_fn_ptr execute; /* Runs the remaining cycles of the current instruction, set on fetch */
+
+    /* Page table: host memory behind each 256-byte page.
+     * NULL sends the access to read_fn/write_fn instead (I/O, unmapped space, ROM writes)
+     */
+    u8* read_pages[0x100];
+    u8* write_pages[0x100];
+    u8* ram_pages[0x100];  /* What a writable page is backed by, even while write_pages has it off */
+    bool code_pages[0x100]; /* Pages with decoded instructions in them, or in a mirror of them */
+    bool shared_pages[0x100]; /* Read-only for now, the first write goes to write_fn so it can map a copy */
+
+    DecodedInstruction* decode_cache; /* decode_mask + 1 entries, a shared empty one until the first decode allocates it */
+    u32 decode_mask;
+    u32 decode_size;                  /* Entries it gets allocated with, 0 for no cache */
 
     /* INTERNAL */
+    u8   flag_n_source; /* N and Z bits of r.P are stale, N is bit 7 of this... */
+    u8   flag_z_source; /* ...and Z is set when this is 0. Use CPU_get_P for the real P */
     i8   offset;
     u8   reset_delay;
     u8   compare_operand;
@@ -46,12 +123,38 @@ typedef struct CPU_s {
     u16  indirect_address;
     u16  old_pc;
     bool found_address;
-
-    u8 aaa;
-    u8 bbb;
-    u8 cc;
+    u8   irq_lines;     /* One bit per device holding IRQ low, see CPU_set_irq */
+    bool nmi_pending;   /* NMI is edge triggered, this is the edge not taken yet */
+    u8   interrupt;     /* CPU_INTERRUPT_IRQ or _NMI while its sequence runs */
+    bool waiting;       /* Parked by WAI until an IRQ or NMI line is active, masked or not */
 } CPU;
 
+/* Everything about a CPU besides its bus, page table and decode cache: the
+ * registers and how far it got into the current instruction. Plain data, so
+ * it can be kept around and loaded back into any CPU mapped the same way.
+ */
+typedef struct CPUState_s {
+    RegFile r;
+    u8   cycle;
+    bool is_running;
+    STOP stop_reason;
+    u64  instruction_count;
+    u64  cycle_count;
+    u8   flag_n_source;
+    u8   flag_z_source;
+    i8   offset;
+    u8   reset_delay;
+    u8   compare_operand;
+    u16  access_address;
+    u16  indirect_address;
+    u16  old_pc;
+    bool found_address;
+    u8   irq_lines;
+    bool nmi_pending;
+    u8   interrupt;
+    bool waiting;
+} CPUState;
+
 typedef enum FLAGS_e : u8 {
     FLAGS_NEG = 0b10000000,
     FLAGS_OVR = 0b01000000,
@@ -71,14 +174,87 @@ typedef enum ADDR_e : u8 {
     ADDR_IND_Y = 4,
     ADDR_ZPG_X = 5,
     ADDR_ABS_Y = 6,
-    ADDR_ABS_X = 7
+    ADDR_ABS_X = 7,
+    /* Not encoded in bbb, these only appear in the opcode lists */
+    ADDR_IMP   = 8,
+    ADDR_ACC   = 9,
+    ADDR_REL   = 10,
+    ADDR_IND   = 11
 } ADDR;
 
 static const u8 branch_flag_by_index[] = {FLAGS_NEG, FLAGS_OVR, FLAGS_CAR, FLAGS_ZER};
 static const u8 instruction_flag_by_index[] = {FLAGS_CAR, FLAGS_IRE, FLAGS_OVR, FLAGS_DEC};
 
+/* Bus access, plain memory pages are a direct load/store */
+static inline u8 CPU_read(CPU* cpu, u16 address) {
+    u8* page = cpu->read_pages[address >> 8];
+    if (page != NULL) {
+        return page[address & 0xFF];
+    }
+    return cpu->read_fn(cpu->context, address);
+}
+
+void _CPU_write_slow(CPU* cpu, u16 address, u8 data);
+
+static inline void CPU_write(CPU* cpu, u16 address, u8 data) {
+    u8* page = cpu->write_pages[address >> 8];
+    if (page != NULL) {
+        page[address & 0xFF] = data;
+        return;
+    }
+    _CPU_write_slow(cpu, address, data);
+}
+
+/* The real flags register, with N and Z filled in from their lazy sources.
+ * About the 6502's flags register:
+ * Its flags register is formatted as
+ * NV-BDIZC, which means the negative
+ * flag is at the same place at the sign bit!
+ * Essentially, &'ing it with the result
+ * gives us the sign bit at the proper position already.
+ */
+static inline u8 CPU_get_P(CPU* cpu) {
+    return (cpu->r.P & ~(FLAGS_NEG | FLAGS_ZER)) | (cpu->flag_n_source & FLAGS_NEG) | (cpu->flag_z_source == 0 ? FLAGS_ZER : 0);
+}
+
+static inline void CPU_set_P(CPU* cpu, u8 value) {
+    cpu->r.P = value;
+    cpu->flag_n_source = value;                          // N is already at bit 7
+    cpu->flag_z_source = (value & FLAGS_ZER) ? 0 : 1;
+}
+
+/* Interrupts are taken between instructions: NMI always, IRQ while any line is held and I is clear */
+static inline bool CPU_interrupt_due(CPU* cpu) {
+    return cpu->nmi_pending || (cpu->irq_lines != 0 && !(cpu->r.P & FLAGS_IRE));
+}
+
+/* WAI parked the CPU and nothing woke it yet. Only a device can, so the run loops skip to the end of their budget */
+static inline bool CPU_is_waiting(CPU* cpu) {
+    return cpu->waiting && !cpu->nmi_pending && cpu->irq_lines == 0;
+}
+
+/* Whether CPU_request_stop was called since the last time, clearing it if so */
+static inline bool CPU_take_stop_request(CPU* cpu) {
+    return __atomic_load_n(&cpu->stop_requested, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(&cpu->stop_requested, false, __ATOMIC_ACQUIRE);
+}
+
 /* External functions */
-void CPU_reset(CPU* cpu, read_fn_ptr read_fn, write_fn_ptr write_fn);
+void CPU_reset(CPU* cpu, read_fn_ptr read_fn, write_fn_ptr write_fn, void* context); /* Zero the CPU before its first reset, later ones keep its decode cache */
+void CPU_map_pages(CPU* cpu, u8 first_page, u16 page_count, u8* memory, u32 memory_size, bool writable);
+void CPU_map_shared_pages(CPU* cpu, u8 first_page, u16 page_count, const u8* memory, u32 memory_size);
+void CPU_unmap_pages(CPU* cpu, u8 first_page, u16 page_count);
 void CPU_emulate(CPU* cpu);
+u32  CPU_step_instruction(CPU* cpu);
+u64  CPU_run_instructions(CPU* cpu, u64 instruction_count);
+RunResult CPU_run(CPU* cpu, u64 cycle_budget);
+void CPU_request_stop(CPU* cpu);
+void CPU_set_irq(CPU* cpu, u8 line, bool asserted); /* Level triggered, line is a bit of its own per device */
+void CPU_trigger_nmi(CPU* cpu);                      /* Edge triggered, taken once */
+void CPU_set_decode_cache(CPU* cpu, u32 entries); /* Power of 2, allocated when it's first used. 0 frees it and runs without one */
+u32  CPU_get_decode_cache_entries(CPU* cpu);      /* How many are allocated, 0 until the first decode */
+void CPU_set_hooks(CPU* cpu, struct Hooks_s* hooks); /* NULL takes them away. Drops the decoded code, so they're looked up again */
+CPUState CPU_save_state(CPU* cpu);
+void CPU_load_state(CPU* cpu, const CPUState* state);
 
 #endif /* CPU_H */
\ No newline at end of file
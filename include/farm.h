@@ -0,0 +1,46 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include "machine.h"
+
+/* Runs many machines on a pool of worker threads.
+ * Work is handed out in time slices: a worker takes a machine, gives it
+ * slice_cycles through Machine_run, then puts it back at the end of its own
+ * queue. A worker whose queue is empty steals from the back of another's, so
+ * a core never sits idle while some other core still has machines waiting.
+ * A machine leaves the farm when its CPU stops (BRK, illegal opcode) or when
+ * it has run cycle_limit cycles.
+ *
+ * Each machine only ever runs on one thread at a time, but may move between
+ * threads from one slice to the next.
+ */
+#define FARM_DEFAULT_SLICE_CYCLES 100000
+
+typedef struct FarmWorkerStats_s {
+    u64 cycles;  /* Emulated cycles this worker ran */
+    u64 slices;
+    u64 steals;  /* Slices it took from another worker's queue */
+    u64 busy_ns; /* Time spent inside Machine_run */
+} FarmWorkerStats;
+
+typedef struct FarmStats_s {
+    u32 worker_count;
+    u32 machine_count;
+    u64 cycles;
+    u64 wall_ns;
+    double mhz;          /* Emulated cycles per wall-clock microsecond, all workers together */
+    double mhz_per_core;
+} FarmStats;
+
+typedef struct Farm_s Farm;
+
+Farm* Farm_create(u32 worker_count, u64 slice_cycles, u64 cycle_limit); /* 0 workers = one per core, 0 limit = none */
+void Farm_destroy(Farm* farm); /* Doesn't destroy the machines */
+bool Farm_add(Farm* farm, Machine* machine); /* Only before Farm_run */
+void Farm_run(Farm* farm); /* Returns once every machine has left, or after Farm_stop */
+void Farm_stop(Farm* farm); /* Safe from any thread, workers finish their current slice first */
+FarmStats Farm_get_stats(Farm* farm);
+const FarmWorkerStats* Farm_get_worker_stats(Farm* farm, u32 worker);
+void Farm_print_stats(Farm* farm, FILE* out);
+
+#endif /* FARM_H */
@@ -0,0 +1,58 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include "cpu.h"
+
+/* High-level emulation: host functions that stand in for guest routines.
+ * When the CPU gets to a hooked address (usually a JSR target) the function
+ * runs instead, with the registers and memory through the CPU, leaves its
+ * results in the registers, and the CPU returns from the routine like RTS.
+ *
+ * Hooks live in the decode cache: an address is looked up when its
+ * instruction gets decoded, and only hooked ones decode to anything
+ * different, so every other instruction runs exactly like before. Code that
+ * isn't decoded (with the cache off, outside of mapped memory, or a cycle at
+ * a time through CPU_emulate) looks them up at every fetch instead, which
+ * costs a check of pages[] outside of hooked pages. CPU_emulate runs a hook
+ * whole in the call that would have fetched the opcode, counting all of its
+ * cycles there. The JIT leaves hooked addresses to the interpreter, and
+ * Machine_run doesn't use the AOT while there are hooks.
+ *
+ * Hooks are picked up when they're handed to the CPU (CPU_set_hooks or
+ * Machine_set_hooks), so add them first.
+ */
+#define HOOKS_MAX 64
+
+/* Cycles the routine would have taken, its RTS included, or 0 to let the guest's code run after all */
+typedef u32 (*hook_fn_ptr)(CPU* cpu, void* context);
+
+typedef struct Hook_s {
+    u16 pc;
+    hook_fn_ptr fn;
+    void* context;    /* Second argument of fn */
+} Hook;
+
+typedef struct Hooks_s {
+    Hook hooks[HOOKS_MAX];
+    u32  count;
+    bool pages[0x100]; /* Pages with a hook in them, decoding anywhere else doesn't look any further */
+} Hooks;
+
+Hooks* Hooks_create(void); /* NULL if out of memory */
+void Hooks_destroy(Hooks* hooks);
+bool Hooks_add(Hooks* hooks, u16 pc, hook_fn_ptr fn, void* context); /* false when full, replaces one already at pc */
+bool Hooks_add_symbol(Hooks* hooks, const char* listing_path, const char* name, hook_fn_ptr fn, void* context); /* false (and errno set) if name isn't in the 64tass listing */
+
+static inline const Hook* Hooks_find(const Hooks* hooks, u16 pc) {
+    if (!hooks->pages[pc >> 8]) {
+        return NULL;
+    }
+    for (u32 i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].pc == pc) {
+            return &hooks->hooks[i];
+        }
+    }
+    return NULL;
+}
+
+#endif /* HOOKS_H */
@@ -0,0 +1,24 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cpu.h"
+
+/* Dynamic recompiler, x86-64 Linux hosts only.
+ * Straight-line code in ROM that keeps getting run is compiled into host
+ * code one basic block at a time, with A/X/Y/SP living in host registers.
+ * A block ends at a branch, JMP, JSR or RTS, and blocks with a fixed target
+ * jump straight into each other once both are compiled. Everything the
+ * compiler doesn't handle (RAM code, I/O fetches, BRK, PHP...) is left to
+ * CPU_step_instruction, so the state after JIT_run is the same as after CPU_run.
+ *
+ * Compiled code reads mapped pages through the pointers they had when it was
+ * compiled: call JIT_flush after CPU_map_pages/CPU_unmap_pages.
+ */
+typedef struct JIT_s JIT;
+
+JIT* JIT_create(CPU* cpu); /* NULL when the host isn't supported */
+void JIT_destroy(JIT* jit);
+void JIT_flush(JIT* jit);
+RunResult JIT_run(JIT* jit, u64 cycle_budget);
+
+#endif /* JIT_H */
@@ -0,0 +1,208 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include "cpu.h"
+#include "acia.h"
+#include "jit.h"
+#include "aot.h"
+#include "trace.h"
+#include "profile.h"
+#include "hooks.h"
+#include "scheduler.h"
+
+/* One complete computer: a CPU, its memory and its devices.
+ * Nothing in here is global, so a process can run as many of them as it likes,
+ * each one only touches its own Machine.
+ *
+ * Memory map:
+ * $0000-$1FFF RAM, 2KB mirrored
+ * $5000-$5001 ACIA
+ * $8000-$FFFF ROM
+ */
+#define MACHINE_RAM_SIZE  0x800
+#define MACHINE_ROM_SIZE  0x8000
+#define MACHINE_ACIA_BASE 0x5000
+#define MACHINE_RAM_PAGES (MACHINE_RAM_SIZE >> 8)
+#define MACHINE_ROM_PAGES (MACHINE_ROM_SIZE >> 8)
+
+/* IRQ lines, one bit each for CPU_set_irq */
+#define MACHINE_IRQ_ACIA  0x01
+
+/* How often a connected ACIA's IRQ line catches up with its input, a few characters' time at 1MHz and 9600 baud */
+#define MACHINE_ACIA_POLL_CYCLES 2000
+
+/* How long output without a newline can wait to be flushed, 20ms at 1MHz */
+#define MACHINE_ACIA_FLUSH_CYCLES 20000
+
+/* Idle loops: a guest spinning on the ACIA status register for input that
+ * isn't there doesn't get run. Machine_run skips whole rounds of the loop in
+ * one go, up to the next event that isn't the ACIA's own, sleeping in the
+ * meantime (guest time passing at MACHINE_CLOCK_HZ) unless input shows up.
+ * Without input connected nothing can show up, so it doesn't sleep at all.
+ * A CPU parked by WAI is skipped forward the same way, and input wakes it
+ * up as soon as it raises the ACIA's IRQ.
+ * A paced machine (see pacer.h) skips without sleeping: whoever paces it
+ * does the sleeping, in slices short enough that input isn't kept waiting.
+ */
+#define MACHINE_CLOCK_HZ     1000000
+#define MACHINE_IDLE_WINDOW  32     /* Two status reads finding no input this many cycles apart look like a polling loop */
+#define MACHINE_IDLE_BACKOFF 100000 /* Cycles before looking again, after polling that wasn't an idle loop */
+
+/* A ROM's bytes, shared by every image with that ROM: images captured from a
+ * machine (snapshots, forks) point at its ROM rather than copying it, so the
+ * machine keeps its ROM mappings, decoded code and JIT blocks. Reference
+ * counted, images hold one.
+ */
+typedef struct MachineROM_s {
+    u8*    data;        /* MACHINE_ROM_SIZE bytes */
+    u32    references;
+    void*  mapping;     /* Snapshot file data (and the RAM of the image loaded from it) points into, NULL when data is on the heap with it */
+    size_t mapping_size;
+} MachineROM;
+
+/* A ROM and the RAM contents machines start from, loaded once and shared
+ * read-only by every Machine made from it. A machine reads its RAM pages
+ * straight from the image until it first writes to one, then that page (and
+ * only that page) gets copied for it. Reference counted, machines hold one.
+ */
+typedef struct MachineImage_s {
+    u8*  rom;           /* MACHINE_ROM_SIZE bytes, rom_buffer's */
+    u8*  ram;           /* MACHINE_RAM_SIZE bytes */
+    u32  references;
+    MachineROM* rom_buffer;
+} MachineImage;
+
+typedef struct MachineMemoryStats_s {
+    u32 shared_pages;  /* Read straight from the image */
+    u32 private_pages; /* RAM pages the machine wrote to, copied for it alone */
+    u32 decode_cache_bytes; /* The CPU's decoded instructions, 0 until it runs whole instructions or with no cache */
+} MachineMemoryStats;
+
+/* A machine frozen at one point: memory (as an image, shared with the
+ * machine it was taken from and any restored from it), the CPU state, down
+ * to the middle of an instruction, and the ACIA's control register. Which
+ * terminal the ACIA is connected to isn't saved, restoring leaves it alone,
+ * and the ACIA's IRQ line is worked out again from the input waiting there.
+ */
+typedef struct MachineSnapshot_s {
+    MachineImage* image;
+    CPUState cpu;
+    u8 acia_control;
+} MachineSnapshot;
+
+/* Input as the guest saw it, kept so going back over it (see rewind.h) gives the guest the same
+ * input at the same points again. Only what depended on when the host's input showed up is in
+ * it: ACIA reads that found input, by their place in acia_reads, and polls that changed whether
+ * input was waiting, by their cycle. Replaying, every read that isn't in it finds no input.
+ */
+#define MACHINE_INPUT_STATUS 0 /* A status read that found input waiting */
+#define MACHINE_INPUT_DATA   1 /* A data read that took a byte */
+#define MACHINE_INPUT_POLL   2 /* A poll that changed rx_full */
+
+typedef struct MachineInputEvent_s {
+    u64  position; /* acia_reads counting the read, cycle_count for polls */
+    u8   kind;
+    u8   data;     /* The byte a data read took */
+    bool rx_full;  /* Whether input was waiting afterwards */
+} MachineInputEvent;
+
+typedef struct MachineInputLog_s {
+    MachineInputEvent* events; /* In the order they happened */
+    u32  count;
+    u32  capacity;
+    u32  position;  /* The machine's place in it, the next one recorded goes here and drops any after it */
+    u32  next_read; /* While replaying, the next read and the next poll the guest gets */
+    u32  next_poll;
+    bool replaying;
+    SerialInput*  input;  /* The ACIA's, while it's disconnected for replaying */
+    SerialOutput* output;
+} MachineInputLog;
+
+/* What the devices hold besides the CPU and memory, checkpoints keep it (scheduler events aside) */
+typedef struct MachineDeviceState_s {
+    bool acia_rx_full;
+    u8   acia_control;
+    u64  acia_reads;
+} MachineDeviceState;
+
+typedef struct Machine_s {
+    CPU  cpu;
+    ACIA acia;
+    MachineImage* image;
+    u8*  ram_copies[MACHINE_RAM_PAGES]; /* NULL while the page is still image->ram's */
+
+    /* Optional faster ways to run the ROM, Machine_run picks the first one that's set */
+    AOT* aot;
+    JIT* jit;
+
+    Trace* trace; /* Not owned, NULL when not tracing */
+    Profile* profile; /* Not owned, NULL when not profiling */
+    Hooks* hooks;     /* Not owned, NULL when there are none */
+    bool paced;       /* Kept to real time by its owner, Machine_run never sleeps */
+
+    /* Device events, Machine_run stops the CPU at each one */
+    Scheduler scheduler;
+    u64 scheduler_cycle; /* cycle_count when Machine_run last returned, to tell when the CPU was moved back */
+
+    /* Idle loop detection */
+    u64  idle_poll_cycle; /* cycle_count at the last status read that found no input */
+    u64  idle_backoff;    /* No looking for idle loops before this cycle */
+    bool idle_pending;    /* The CPU was asked to stop so Machine_run can look at the loop it's in */
+
+    /* Input recording, see MachineInputLog */
+    MachineInputLog* input_log; /* Not owned, NULL when not recording */
+    u64 acia_reads;             /* Every ACIA read the guest made, the ones in skipped idle loops too */
+} Machine;
+
+MachineImage* MachineImage_create(const u8* rom, u32 rom_size); /* RAM starts out as zeros, NULL if out of memory */
+MachineImage* MachineImage_load(const char* path); /* NULL (and errno set) if the file can't be read */
+void MachineImage_retain(MachineImage* image);
+void MachineImage_release(MachineImage* image);
+
+Machine* Machine_create(void); /* Powered on with empty ROM and the ACIA disconnected, NULL if out of memory */
+Machine* Machine_create_from_image(MachineImage* image); /* Same, sharing image's ROM and RAM */
+void Machine_destroy(Machine* machine);
+void Machine_reset(Machine* machine);
+bool Machine_load_rom(Machine* machine, const char* path); /* false (and errno set) if the file can't be read */
+bool Machine_load_rom_data(Machine* machine, const u8* data, u32 size); /* false if out of memory */
+MachineImage* Machine_capture_image(Machine* machine); /* Its ROM and RAM as they are now (say, once it booted), NULL if out of memory */
+MachineMemoryStats Machine_get_memory_stats(Machine* machine);
+void Machine_read_ram(Machine* machine, u8* ram);        /* All MACHINE_RAM_SIZE bytes */
+bool Machine_write_ram(Machine* machine, const u8* ram); /* false if out of memory */
+MachineSnapshot* Machine_snapshot(Machine* machine); /* NULL if out of memory */
+void Machine_snapshot_destroy(MachineSnapshot* snapshot);
+void Machine_restore(Machine* machine, const MachineSnapshot* snapshot);
+Machine* Machine_create_from_snapshot(const MachineSnapshot* snapshot); /* ACIA disconnected, NULL if out of memory */
+Machine* Machine_fork(Machine* machine); /* Same as a snapshot restored into a new machine */
+
+/* Snapshot files: a header with the CPU state, then the ROM and RAM, each
+ * starting on a MACHINE_SNAPSHOT_ALIGN boundary. Loading maps the file
+ * privately and read-only, machines made from it copy the pages they write
+ * to like with any image, so the file itself never changes.
+ */
+#define MACHINE_SNAPSHOT_MAGIC   "YA6502SS"
+#define MACHINE_SNAPSHOT_VERSION 3 /* 1 didn't have the ACIA's control register, it loads as 0. Up to 2 instruction_count was 32 bits */
+#define MACHINE_SNAPSHOT_ALIGN   0x1000
+
+bool Machine_snapshot_save(const MachineSnapshot* snapshot, const char* path); /* false (and errno set) if the file can't be written */
+MachineSnapshot* Machine_snapshot_load(const char* path); /* NULL (and errno set) if the file can't be read or isn't a snapshot */
+bool Machine_enable_jit(Machine* machine);
+bool Machine_enable_aot(Machine* machine, const AOTProgram* program);
+void Machine_set_trace(Machine* machine, Trace* trace); /* NULL stops tracing */
+void Machine_set_profile(Machine* machine, Profile* profile); /* NULL stops profiling */
+void Machine_set_paced(Machine* machine, bool paced);
+void Machine_set_hooks(Machine* machine, Hooks* hooks); /* NULL takes them away, kept across resets */
+void Machine_connect_acia(Machine* machine, SerialInput* input, SerialOutput* output); /* NULLs disconnect it, the caller keeps both */
+bool Machine_schedule(Machine* machine, u64 cycle, scheduler_fn_ptr callback, void* context); /* false when the scheduler is full */
+RunResult Machine_run(Machine* machine, u64 cycle_budget);
+u32  Machine_step_instruction(Machine* machine); /* Events that are due, then one instruction (to the next event when parked by WAI), 0 when nothing can run */
+void Machine_emulate(Machine* machine);          /* CPU_emulate, running the events that are due between instructions */
+
+/* Recording and replaying input, and the device state that goes with it (see rewind.h) */
+void Machine_set_input_log(Machine* machine, MachineInputLog* log); /* NULL stops recording, the caller owns it */
+MachineDeviceState Machine_save_devices(Machine* machine);
+void Machine_load_devices(Machine* machine, const MachineDeviceState* state, const SchedulerEvent* events, u32 event_count); /* After CPU_load_state */
+void Machine_replay_input(Machine* machine, u32 from); /* Input comes from the log, starting at events[from], until Machine_stop_replay. After Machine_load_devices */
+void Machine_stop_replay(Machine* machine);            /* Recording carries on from wherever the replay got to */
+
+#endif /* MACHINE_H */
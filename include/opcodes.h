@@ -0,0 +1,125 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+/* Opcode lists, used as X-macros.
+ * Every opcode that the core implements is listed exactly once in here,
+ * anything that isn't is an illegal instruction.
+ */
+
+/* Opcodes that go through an addressing mode before doing their operation.
+ * X(opcode, operation, addressing mode)
+ * Each one gets a _CPU_<operation>_<mode> handler generated for it.
+ */
+#define CPU_ADDRESSED_OPCODES(X) \
+    X(0x01, ORA, X_IND) X(0x05, ORA, ZPG) X(0x09, ORA, IMM) X(0x0D, ORA, ABS) X(0x19, ORA, ABS_Y) \
+    X(0x21, AND, X_IND) X(0x25, AND, ZPG) X(0x29, AND, IMM) X(0x2D, AND, ABS) X(0x39, AND, ABS_Y) \
+    X(0x41, EOR, X_IND) X(0x45, EOR, ZPG) X(0x49, EOR, IMM) X(0x4D, EOR, ABS) X(0x59, EOR, ABS_Y) \
+    X(0x61, ADC, X_IND) X(0x65, ADC, ZPG) X(0x69, ADC, IMM) X(0x6D, ADC, ABS) X(0x79, ADC, ABS_Y) \
+    X(0x81, STA, X_IND) X(0x85, STA, ZPG)                   X(0x8D, STA, ABS) X(0x99, STA, ABS_Y) \
+    X(0xA1, LDA, X_IND) X(0xA5, LDA, ZPG) X(0xA9, LDA, IMM) X(0xAD, LDA, ABS) X(0xB9, LDA, ABS_Y) \
+    X(0xC1, CMP, X_IND) X(0xC5, CMP, ZPG) X(0xC9, CMP, IMM) X(0xCD, CMP, ABS) X(0xD9, CMP, ABS_Y) \
+    X(0xE1, SBC, X_IND) X(0xE5, SBC, ZPG) X(0xE9, SBC, IMM) X(0xED, SBC, ABS) X(0xF9, SBC, ABS_Y) \
+    X(0x06, ASL, ZPG)                     X(0x0E, ASL, ABS)                                       \
+    X(0x26, ROL, ZPG)                     X(0x2E, ROL, ABS)                                       \
+    X(0xA2, LDX, IMM)   X(0xA6, LDX, ZPG)                   X(0xAE, LDX, ABS)                     \
+    X(0x86, STX, ZPG)                                       X(0x8E, STX, ABS)                     \
+    X(0xA0, LDY, IMM)   X(0xA4, LDY, ZPG)                   X(0xAC, LDY, ABS)                     \
+    X(0x84, STY, ZPG)                                       X(0x8C, STY, ABS)                     \
+    X(0xE0, CPX, IMM)   X(0xE4, CPX, ZPG)                   X(0xEC, CPX, ABS)                     \
+    X(0xC0, CPY, IMM)   X(0xC4, CPY, ZPG)                   X(0xCC, CPY, ABS)                     \
+                        X(0x24, BIT, ZPG)                   X(0x2C, BIT, ABS)
+
+/* Opcodes that have a handler of their own.
+ * X(opcode, mnemonic, addressing mode, handler)
+ */
+#define CPU_OTHER_OPCODES(X) \
+    X(0x0A, ASL, ACC, _CPU_ASL_A)              \
+    X(0x2A, ROL, ACC, _CPU_ROL_A)              \
+    X(0x89, NOP, IMM, _CPU_NOP_IMM)            \
+    X(0xAA, TAX, IMP, _CPU_TAX)                \
+    X(0x8A, TXA, IMP, _CPU_TXA)                \
+    X(0xA8, TAY, IMP, _CPU_TAY)                \
+    X(0x98, TYA, IMP, _CPU_TYA)                \
+    X(0x4C, JMP, ABS, _CPU_JMP_ABS)            \
+    X(0x6C, JMP, IND, _CPU_JMP_IND)            \
+    X(0x20, JSR, ABS, _CPU_JSR)                \
+    X(0x60, RTS, IMP, _CPU_RTS)                \
+    X(0x40, RTI, IMP, _CPU_RTI)                \
+    X(0x10, BPL, REL, _CPU_branch_logic)       \
+    X(0x30, BMI, REL, _CPU_branch_logic)       \
+    X(0x50, BVC, REL, _CPU_branch_logic)       \
+    X(0x70, BVS, REL, _CPU_branch_logic)       \
+    X(0x90, BCC, REL, _CPU_branch_logic)       \
+    X(0xB0, BCS, REL, _CPU_branch_logic)       \
+    X(0xD0, BNE, REL, _CPU_branch_logic)       \
+    X(0xF0, BEQ, REL, _CPU_branch_logic)       \
+    X(0x18, CLC, IMP, _CPU_flags_logic)        \
+    X(0x38, SEC, IMP, _CPU_flags_logic)        \
+    X(0x58, CLI, IMP, _CPU_flags_logic)        \
+    X(0x78, SEI, IMP, _CPU_flags_logic)        \
+    X(0xB8, CLV, IMP, _CPU_flags_logic)        \
+    X(0xD8, CLD, IMP, _CPU_flags_logic)        \
+    X(0xF8, SED, IMP, _CPU_flags_logic)        \
+    X(0x08, PHP, IMP, _CPU_stack_manipulation) \
+    X(0x28, PLP, IMP, _CPU_stack_manipulation) \
+    X(0x48, PHA, IMP, _CPU_stack_manipulation) \
+    X(0x68, PLA, IMP, _CPU_stack_manipulation) \
+    X(0xE8, INX, IMP, _CPU_INX)                \
+    X(0xCA, DEX, IMP, _CPU_DEX)                \
+    X(0xC8, INY, IMP, _CPU_INY)                \
+    X(0x88, DEY, IMP, _CPU_DEY)                \
+    X(0xEA, NOP, IMP, _CPU_NOP)                \
+    X(0x02, DBP, IMP, _CPU_DBP)                \
+    X(0x00, BRK, IMP, _CPU_BRK)
+
+/* Only present when emulating the W65C02S */
+#define CPU_W65C02S_OPCODES(X) \
+    X(0x1A, INC, ACC, _CPU_INC_A)              \
+    X(0x3A, DEC, ACC, _CPU_DEC_A)              \
+    X(0xCB, WAI, IMP, _CPU_WAI)                \
+    X(0xDB, STP, IMP, _CPU_STP)
+
+/* Instruction length in bytes, opcode included, by the addressing mode names used above */
+#define CPU_LENGTH_X_IND 2
+#define CPU_LENGTH_ZPG   2
+#define CPU_LENGTH_IMM   2
+#define CPU_LENGTH_ABS   3
+#define CPU_LENGTH_IND_Y 2
+#define CPU_LENGTH_ZPG_X 2
+#define CPU_LENGTH_ABS_Y 3
+#define CPU_LENGTH_ABS_X 3
+#define CPU_LENGTH_IMP   1
+#define CPU_LENGTH_ACC   1
+#define CPU_LENGTH_REL   2
+#define CPU_LENGTH_IND   3
+
+/* Cycles an addressed operation spends on fetch and addressing before its logic runs */
+#define CPU_BASE_CYCLES_X_IND 5
+#define CPU_BASE_CYCLES_ZPG   2
+#define CPU_BASE_CYCLES_IMM   1
+#define CPU_BASE_CYCLES_ABS   3
+#define CPU_BASE_CYCLES_ABS_Y 4
+
+/* Per-opcode tables, 0 for illegal opcodes.
+ * Whoever includes this defines _EMULATE_W65C02S first if it wants those opcodes in.
+ */
+static const u8 opcode_length[256] = {
+    #define X(opcode, op, mode) [opcode] = CPU_LENGTH_##mode,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) [opcode] = CPU_LENGTH_##mode,
+    CPU_OTHER_OPCODES(X)
+    #ifdef _EMULATE_W65C02S
+    CPU_W65C02S_OPCODES(X)
+    #endif
+    #undef X
+};
+
+/* Addressed opcodes only */
+static const u8 opcode_base_cycles[256] = {
+    #define X(opcode, op, mode) [opcode] = CPU_BASE_CYCLES_##mode,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+};
+
+#endif /* OPCODES_H */
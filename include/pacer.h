@@ -0,0 +1,39 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include "cpu.h"
+
+/* Real-time pacing: holds a machine to a clock rate instead of running it
+ * as fast as the host goes. The owner runs the guest a slice at a time and
+ * hands each slice's cycles to Pacer_wait, which sleeps (clock_nanosleep on an
+ * absolute deadline, so the sleeps' own lateness doesn't add up) until the
+ * host clock catches up with the guest's.
+ *
+ * A host that falls behind runs the guest flat out until it has caught up,
+ * but only for up to PACER_MAX_LAG_NS: anything past that is given up for
+ * good rather than made up for with a long burst of full speed afterwards.
+ */
+#define PACER_SLICE_NS   1000000  /* Guest time between sleeps, 1ms */
+#define PACER_MAX_LAG_NS 20000000 /* Most a slow host catches up on, 20ms */
+
+typedef struct Pacer_s {
+    u64 hz;
+    u64 start_ns;    /* When cycle 0 was due on CLOCK_MONOTONIC, moves forward when lag is given up */
+    u64 began_ns;    /* start_ns as it was at Pacer_init */
+    u64 cycles;      /* Paced so far */
+
+    /* Drift */
+    u64 sleeps;
+    u64 late_ns;     /* Total of how far past their deadline the sleeps woke up */
+    u64 max_late_ns;
+    u64 max_lag_ns;  /* Furthest behind it was when a slice came due */
+    u64 dropped_ns;  /* Lag given up, the guest is that much behind real time for good */
+    u64 drops;
+} Pacer;
+
+void Pacer_init(Pacer* pacer, u64 hz); /* Cycle 0 is due now */
+u64  Pacer_slice_cycles(const Pacer* pacer); /* PACER_SLICE_NS of guest time, at least 1 */
+void Pacer_wait(Pacer* pacer, u64 cycles);   /* Counts cycles as run and sleeps until they were due */
+void Pacer_print_stats(const Pacer* pacer, FILE* out);
+
+#endif /* PACER_H */
@@ -0,0 +1,69 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "cpu.h"
+
+/* Profiler: counts instructions and cycles per address and per opcode, and
+ * the cycles spent under every call stack the guest went through.
+ *
+ * It's its own core: Profile_run steps the interpreter one instruction at a
+ * time and counts after each one, so CPU_run and the JIT/AOT have no profiling
+ * code in them at all. Machine_run switches to it while a profile is attached.
+ *
+ * Call stacks come from JSR and interrupts: a frame is pushed for the routine
+ * they go to and popped once the stack pointer goes back above the return
+ * address, which covers RTS, RTI and routines that drop their return address
+ * with PLA or TXS.
+ * Addresses are named from the labels in a 64tass listing (64tass -L).
+ */
+#define PROFILE_MAX_DEPTH     128  /* Each JSR takes 2 bytes of the 256-byte stack */
+#define PROFILE_SYMBOL_LENGTH 32
+#define PROFILE_DEFAULT_TOP   20   /* Rows per table in Profile_write_report */
+
+typedef struct ProfileSymbol_s {
+    u16  address;
+    char name[PROFILE_SYMBOL_LENGTH];
+} ProfileSymbol;
+
+/* One per distinct call stack, the root is node 0 */
+typedef struct ProfileNode_s {
+    u16 address;      /* Where the routine starts, the JSR target */
+    u32 parent;
+    u32 first_child;  /* 0 when there's none, the root is never a child */
+    u32 next_sibling;
+    u64 cycles;       /* Spent in the routine itself, not in what it called */
+} ProfileNode;
+
+typedef struct ProfileFrame_s {
+    u32 node;
+    u8  sp;           /* SP right after the JSR, the frame is gone once SP is above it */
+} ProfileFrame;
+
+typedef struct Profile_s {
+    u64 pc_instructions[0x10000];
+    u64 pc_cycles[0x10000];
+    u64 opcode_instructions[0x100];
+    u64 opcode_cycles[0x100];
+    u64 instructions;
+    u64 cycles;
+
+    ProfileNode* nodes;
+    u32 node_count;
+    u32 node_capacity;
+    ProfileFrame stack[PROFILE_MAX_DEPTH];
+    u32 depth;
+    bool started;     /* The root node's address is the PC profiling started at */
+
+    ProfileSymbol* symbols; /* Sorted by address */
+    u32 symbol_count;
+} Profile;
+
+Profile* Profile_create(void); /* NULL if out of memory */
+void Profile_destroy(Profile* profile);
+bool Profile_load_symbols(Profile* profile, const char* listing_path); /* false (and errno set) if the listing can't be read */
+bool Profile_parse_label(char* line, u16* address, char* name); /* One line of the listing, false unless it has a label. name holds PROFILE_SYMBOL_LENGTH */
+RunResult Profile_run(Profile* profile, CPU* cpu, u64 cycle_budget); /* CPU_run, counting as it goes */
+void Profile_write_report(const Profile* profile, FILE* file, u32 top); /* Hot spots by address, symbol and opcode */
+void Profile_write_folded(const Profile* profile, FILE* file);          /* "ROOT;CALLER;CALLEE cycles" lines, for flamegraph.pl */
+
+#endif /* PROFILE_H */
@@ -0,0 +1,60 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "machine.h"
+
+/* Rewind buffer: lets a machine go back to any cycle in its recent past.
+ * Rewind_run runs the machine and takes a checkpoint every interval cycles.
+ * A checkpoint is the CPU state plus the RAM bytes that changed since the one
+ * before it, XORed against their old value with the unchanged runs left out,
+ * so a machine that sits in a loop costs next to nothing to record.
+ * Going back restores the nearest checkpoint before the target and runs
+ * forward from there. The oldest checkpoints are dropped to stay within
+ * memory_limit.
+ *
+ * Checkpoints also keep the devices' state and the scheduler's events, and
+ * the input the guest was given is recorded in between (see machine.h), so
+ * running forward again gives it the same input at the same points. That's
+ * done with the ACIA disconnected: nothing is printed twice, and input typed
+ * since is left waiting for when the machine carries on. Carrying on from a
+ * point it was taken back to forgets the input that came after it.
+ */
+#define REWIND_DEFAULT_INTERVAL     100000
+#define REWIND_DEFAULT_MEMORY_LIMIT (1 << 20)
+
+typedef struct RewindCheckpoint_s {
+    CPUState cpu;
+    u8*  delta;        /* Runs of (offset u16, length u8, XORed bytes), NULL when no RAM changed */
+    u32  delta_size;
+    MachineDeviceState devices;
+    SchedulerEvent* events; /* What was scheduled, NULL when nothing was */
+    u32  event_count;
+    u64  input;        /* Input events recorded before it, the first one replayed from it is input_log.events[input - input_dropped] */
+} RewindCheckpoint;
+
+typedef struct Rewind_s {
+    Machine* machine;
+    u64    interval;      /* Cycles between checkpoints */
+    size_t memory_limit;  /* Bytes of checkpoints and input to keep at most */
+    size_t memory_used;
+
+    RewindCheckpoint* checkpoints; /* Ring, checkpoints[first] is the oldest */
+    u32 capacity;
+    u32 first;
+    u32 count;
+    u64 next_checkpoint;  /* cycle_count at which the next one is due */
+    u8  ram[MACHINE_RAM_SIZE]; /* RAM at the newest checkpoint, deltas go back from here */
+
+    MachineInputLog input_log; /* The machine records into it */
+    u64 input_dropped;         /* Input events dropped with the oldest checkpoints */
+} Rewind;
+
+Rewind* Rewind_create(Machine* machine, u64 interval, size_t memory_limit); /* Takes the first checkpoint, NULL if out of memory */
+void Rewind_destroy(Rewind* rewind);
+RunResult Rewind_run(Rewind* rewind, u64 cycle_budget); /* Machine_run with checkpoints along the way */
+bool Rewind_checkpoint(Rewind* rewind);                 /* One right now, false if out of memory */
+bool Rewind_to_cycle(Rewind* rewind, u64 cycle);        /* false if that's before the oldest checkpoint */
+bool Rewind_to_instruction(Rewind* rewind, u64 instruction_count);
+bool Rewind_step_back(Rewind* rewind);                  /* To just before the last instruction that ran */
+
+#endif /* REWIND_H */
@@ -0,0 +1,40 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "cpu.h"
+
+/* Device events ordered by the CPU cycle they're due at: timers, serial input
+ * showing up, interrupt lines changing. Machine_run runs the CPU up to the
+ * next event, runs every event that's due and carries on, so devices cost
+ * nothing between their events instead of being polled on every access.
+ *
+ * A binary min-heap, small and fixed size: there are only ever a few devices.
+ * Events run once, periodic ones add themselves back from their callback.
+ */
+#define SCHEDULER_MAX_EVENTS 32
+#define SCHEDULER_NEVER      (~0ull)
+
+typedef void (*scheduler_fn_ptr)(void* context, u64 cycle); /* cycle is when it was due, the CPU can be a few past it */
+
+typedef struct SchedulerEvent_s {
+    u64 cycle;
+    scheduler_fn_ptr callback;
+    void* context;
+} SchedulerEvent;
+
+typedef struct Scheduler_s {
+    SchedulerEvent events[SCHEDULER_MAX_EVENTS]; /* Heap, events[0] is due first */
+    u32 count;
+} Scheduler;
+
+void Scheduler_init(Scheduler* scheduler);
+bool Scheduler_add(Scheduler* scheduler, u64 cycle, scheduler_fn_ptr callback, void* context); /* false when full */
+void Scheduler_cancel(Scheduler* scheduler, scheduler_fn_ptr callback, void* context);        /* Every event with both */
+void Scheduler_run_due(Scheduler* scheduler, u64 cycle);   /* Runs the events due at or before cycle, earliest first */
+void Scheduler_shift(Scheduler* scheduler, i64 cycles);    /* Moves every event, for when the CPU's cycle_count jumps */
+
+static inline u64 Scheduler_next(const Scheduler* scheduler) {
+    return scheduler->count > 0 ? scheduler->events[0].cycle : SCHEDULER_NEVER;
+}
+
+#endif /* SCHEDULER_H */
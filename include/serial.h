@@ -0,0 +1,71 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "cpu.h"
+#include <pthread.h>
+#include <stdio.h>
+
+/* Host side of the serial port's input. A reader thread blocks on the file
+ * descriptor and copies whatever shows up into a ring buffer, so a guest
+ * polling the ACIA costs a memory load instead of a syscall per poll.
+ * Terminals, pipes and files all work the same, `ya6502 rom < script` runs a
+ * scripted session.
+ *
+ * One producer (the reader thread) and one consumer (whoever runs the
+ * machine), so the ring only needs its two indices to be atomic.
+ */
+#define SERIAL_INPUT_SIZE 4096 /* Power of two */
+
+typedef struct SerialInput_s {
+    u8   buffer[SERIAL_INPUT_SIZE];
+    u32  head;             /* Atomic, free running, only the reader thread moves it */
+    u32  tail;             /* Atomic, free running, only the consumer moves it */
+    bool reader_waiting;   /* Atomic, the ring was full and the reader sleeps until the consumer makes room */
+    bool consumer_waiting; /* Atomic, the consumer sleeps in SerialInput_wait until the reader adds something */
+    bool stopping;         /* Atomic */
+    int  fd;
+    int  wake_pipe[2];     /* Gets the reader out of poll(), for room in the ring or for stopping */
+    int  data_pipe[2];     /* Gets the consumer out of SerialInput_wait */
+    pthread_t thread;
+} SerialInput;
+
+SerialInput* SerialInput_create(int fd);            /* NULL if the thread can't be started, leaves fd as it is */
+void SerialInput_destroy(SerialInput* input);       /* Stops the thread, doesn't close fd */
+bool SerialInput_read(SerialInput* input, u8* byte); /* false if nothing is waiting */
+bool SerialInput_wait(SerialInput* input, u64 timeout_ns); /* Sleeps until input is waiting or the time is up, true if it's waiting */
+
+static inline bool SerialInput_waiting(SerialInput* input) {
+    return __atomic_load_n(&input->head, __ATOMIC_ACQUIRE) != input->tail;
+}
+
+/* Host side of the serial port's output. Bytes pile up in the FILE's own
+ * buffer, which SerialOutput_create makes big and fully buffered, and only go
+ * out when it's full, at a newline (when flush_lines is set, for terminals) or
+ * when the owner calls SerialOutput_flush: on input reads and on a timer.
+ * Anything else printed to the same FILE stays in order with the guest's output.
+ *
+ * Bytes are written as they are, so with flush_lines off it's fine for binary
+ * output to a file or a pipe.
+ */
+#define SERIAL_OUTPUT_SIZE 65536
+
+typedef struct SerialOutput_s {
+    FILE* file;
+    bool  flush_lines;
+} SerialOutput;
+
+SerialOutput* SerialOutput_create(FILE* file, bool flush_lines); /* NULL if out of memory, must come before anything is written to file */
+void SerialOutput_destroy(SerialOutput* output);                  /* Flushes, doesn't close the file */
+
+static inline void SerialOutput_flush(SerialOutput* output) {
+    fflush(output->file);
+}
+
+static inline void SerialOutput_write(SerialOutput* output, u8 byte) {
+    putc(byte, output->file);
+    if (byte == '\n' && output->flush_lines) {
+        SerialOutput_flush(output);
+    }
+}
+
+#endif /* SERIAL_H */
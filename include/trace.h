@@ -0,0 +1,69 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "cpu.h"
+
+/* Instruction trace: a ring buffer holding the last instructions a CPU ran,
+ * as fixed-size binary records. Recording is three stores per
+ * instruction, nothing is formatted until the trace is dumped to a file,
+ * which tools/tracedump.c turns into text.
+ *
+ * The interpreter records every instruction it runs while CPU.trace is set
+ * (CPU_emulate, CPU_step_instruction and both CPU_run cores). JIT and AOT
+ * blocks aren't traced, Machine_run sticks to the interpreter while there's a trace.
+ */
+#define TRACE_MAGIC   "YA6502TR"
+#define TRACE_VERSION 1
+
+#define TRACE_DEFAULT_RECORDS 4096
+#define TRACE_DEFAULT_PATH    "ya6502.trace"
+
+#define TRACE_HAS_ADDRESS 0x01 /* The instruction used an effective address */
+
+/* Three words, so recording is three plain stores */
+typedef struct TraceRecord_s {
+    u64 cycle_count; /* When the instruction started */
+    u64 registers;   /* Before it ran: PC in bits 0-15, then A, X, Y, P and SP a byte each from bit 16 */
+    u64 access;      /* Effective address in bits 0-15, opcode in 16-23, TRACE_HAS_ADDRESS and co. in 24-31 */
+} TraceRecord;
+
+/* Trace files are this header, then the records oldest first */
+typedef struct TraceFileHeader_s {
+    char magic[8];
+    u32  version;
+    u32  record_size;  /* sizeof(TraceRecord) */
+    u64  record_count; /* Records in the file */
+    u64  total_count;  /* Instructions traced in all, the ones before the file's records were overwritten */
+} TraceFileHeader;
+
+typedef struct Trace_s {
+    TraceRecord* records;
+    u32 mask;          /* Record count - 1, it's a power of 2 */
+    u64 count;         /* Instructions recorded so far */
+} Trace;
+
+Trace* Trace_create(u32 record_count); /* Rounded up to a power of 2, NULL if out of memory */
+void Trace_destroy(Trace* trace);
+bool Trace_dump(Trace* trace, CPU* cpu, const char* path); /* false (and errno set) if the file can't be written */
+
+static inline u64 _Trace_access(CPU* cpu) {
+    return cpu->access_address | (u64)cpu->r.IR << 16 | (u64)(cpu->found_address ? TRACE_HAS_ADDRESS : 0) << 24;
+}
+
+/* Called right before the interpreter fetches an instruction. The opcode and
+ * effective address aren't known yet, so they're filled into the previous
+ * record instead, from what the previous instruction left in IR and access_address.
+ * The very first call fills the last slot, which gets overwritten long before it's dumped.
+ */
+static inline void Trace_instruction(Trace* trace, CPU* cpu, u64 cycle_count) {
+    u64 count = trace->count;
+    u64 registers = cpu->r.PC | (u64)cpu->r.A << 16 | (u64)cpu->r.X << 24 | (u64)cpu->r.Y << 32
+                  | (u64)CPU_get_P(cpu) << 40 | (u64)cpu->r.SP << 48;
+    trace->records[(count - 1) & trace->mask].access = _Trace_access(cpu);
+    TraceRecord* record = &trace->records[count & trace->mask];
+    record->cycle_count = cycle_count;
+    record->registers   = registers;
+    trace->count = count + 1;
+}
+
+#endif /* TRACE_H */
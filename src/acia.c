@@ -0,0 +1,54 @@
+#include "acia.h"
+
+void ACIA_init(ACIA* acia, SerialInput* input, SerialOutput* output) {
+    acia->input   = input;
+    acia->output  = output;
+    acia->rx_full = false;
+    acia->control = 0;
+    acia->received = 0;
+}
+
+bool ACIA_poll(ACIA* acia) {
+    acia->rx_full = acia->input != NULL && SerialInput_waiting(acia->input);
+    return acia->rx_full;
+}
+
+u8 ACIA_read(ACIA* acia, u8 reg) {
+    if (reg == ACIA_STATUS) {
+        ACIA_poll(acia); // A load from the ring, no syscall
+        return (acia->rx_full ? ACIA_STATUS_RX_FULL : 0) | (ACIA_irq(acia) ? ACIA_STATUS_IRQ : 0);
+    }
+    if (acia->output != NULL) {
+        SerialOutput_flush(acia->output); // Whatever the guest prompted with shows up before it takes the answer
+    }
+    u8 c;
+    if (acia->input != NULL && SerialInput_read(acia->input, &c)) {
+        ACIA_poll(acia); // Typed ahead input shows up right away
+        acia->received++;
+        return c;      // key pressed
+    }
+    acia->rx_full = false;
+    return 0;          // no key
+}
+
+/* What ACIA_read would have given with input from somewhere else, for going over recorded input again:
+ * rx_full is whether input was waiting (after taking data, for data reads), data the byte a data read took
+ */
+u8 ACIA_read_replayed(ACIA* acia, u8 reg, bool rx_full, u8 data) {
+    acia->rx_full = rx_full;
+    if (reg == ACIA_STATUS) {
+        return (acia->rx_full ? ACIA_STATUS_RX_FULL : 0) | (ACIA_irq(acia) ? ACIA_STATUS_IRQ : 0);
+    }
+    return data;
+}
+
+void ACIA_write(ACIA* acia, u8 reg, u8 data) {
+    if (reg == ACIA_STATUS) {
+        acia->control = data;
+        return;
+    }
+    if (acia->output == NULL) {
+        return;
+    }
+    SerialOutput_write(acia->output, data);
+}
@@ -0,0 +1,80 @@
+#include "aot.h"
+
+struct AOT_s {
+    CPU* cpu;
+    const AOTBlock* blocks[0x10000];
+};
+
+AOT* AOT_create(CPU* cpu, const AOTProgram* program) {
+    // The blocks have the ROM's bytes baked in, it has to be the same one and mapped read-only
+    u8* rom = malloc(program->rom_size);
+    if (rom == NULL) {
+        return NULL;
+    }
+    for (u32 i = 0; i < program->rom_size; i++) {
+        u16 address = program->rom_base + i;
+        if (cpu->read_pages[address >> 8] == NULL || cpu->ram_pages[address >> 8] != NULL) {
+            free(rom);
+            return NULL;
+        }
+        rom[i] = CPU_read(cpu, address);
+    }
+    u32 checksum = AOT_checksum(rom, program->rom_size);
+    free(rom);
+    if (checksum != program->rom_checksum) {
+        return NULL;
+    }
+
+    AOT* aot = calloc(1, sizeof(AOT));
+    if (aot == NULL) {
+        return NULL;
+    }
+    aot->cpu = cpu;
+    for (u32 i = 0; i < program->block_count; i++) {
+        aot->blocks[program->blocks[i].pc] = &program->blocks[i];
+    }
+    return aot;
+}
+
+void AOT_destroy(AOT* aot) {
+    free(aot);
+}
+
+/* Same as CPU_run, with recompiled blocks wherever the PC lands on one */
+RunResult AOT_run(AOT* aot, u64 cycle_budget) {
+    CPU* cpu = aot->cpu;
+    RunResult result = {0, STOP_NONE};
+    while (cpu->is_running) {
+        if (CPU_take_stop_request(cpu)) {
+            result.reason = STOP_REQUESTED;
+            return result;
+        }
+        if (result.cycles >= cycle_budget) {
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        if (CPU_is_waiting(cpu)) { // Nothing in here can wake it
+            cpu->cycle_count += cycle_budget - result.cycles;
+            result.cycles = cycle_budget;
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        const AOTBlock* block = NULL;
+        if (cpu->reset_delay == 0xFF && cpu->cycle == 0) {
+            block = aot->blocks[cpu->r.PC];
+        }
+        // A block only runs when all of it fits, so this stops where CPU_run would.
+        // Interrupts are taken between blocks by the interpreter, so is waking up from WAI
+        if (block == NULL || cycle_budget - result.cycles < block->cycles || CPU_interrupt_due(cpu) || cpu->waiting) {
+            result.cycles += CPU_step_instruction(cpu);
+            continue;
+        }
+        // Counted before it runs, like the JIT, so a device access at its end sees how far it got
+        cpu->instruction_count += block->instructions;
+        cpu->cycle_count += block->cycles;
+        block->run(cpu);
+        result.cycles += block->cycles;
+    }
+    result.reason = cpu->stop_reason;
+    return result;
+}
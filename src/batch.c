@@ -0,0 +1,584 @@
+#include "batch.h"
+#define _EMULATE_W65C02S // Same opcode set as cpu.c
+#include "opcodes.h"
+
+typedef signed char BatchI8  __attribute__((vector_size(BATCH_LANES)));
+typedef i16         BatchI16 __attribute__((vector_size(BATCH_LANES * 2)));
+
+/* What the addressed opcodes do, the mode is in addressed_mode */
+typedef enum BatchOp_e : u8 {
+    BATCH_OP_NONE = 0,
+    BATCH_OP_ORA, BATCH_OP_AND, BATCH_OP_EOR, BATCH_OP_ADC, BATCH_OP_STA, BATCH_OP_LDA,
+    BATCH_OP_CMP, BATCH_OP_SBC, BATCH_OP_ASL, BATCH_OP_ROL, BATCH_OP_LDX, BATCH_OP_STX,
+    BATCH_OP_LDY, BATCH_OP_STY, BATCH_OP_CPX, BATCH_OP_CPY, BATCH_OP_BIT
+} BatchOp;
+
+static const u8 addressed_operation[256] = {
+    #define X(opcode, op, mode) [opcode] = BATCH_OP_##op,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+};
+
+static const u8 addressed_mode[256] = {
+    #define X(opcode, op, mode) [opcode] = ADDR_##mode,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+};
+
+/* Masks are all ones for the lanes an operation applies to, 0 for the rest.
+ * Vectors stay out of function arguments and return values (pointers are
+ * fine), their ABI depends on which vector extensions the host has.
+ */
+#define BLEND(mask, value, old) (((value) & (mask)) | ((old) & ~(mask)))
+#define MASK16(mask)  ((BatchU16)__builtin_convertvector((BatchI8)(mask), BatchI16))
+#define SPLAT8(value)  ((BatchU8){0} + (u8)(value))
+#define SPLAT16(value) ((BatchU16){0} + (u16)(value))
+#define ALL_SET(vector) _Batch_all_set(&(vector), sizeof(vector))
+
+static inline bool _Batch_all_set(const void* vector, size_t size) {
+    u64 all = ~0ull;
+    for (size_t i = 0; i < size; i += 8) {
+        u64 word;
+        memcpy(&word, (const u8*)vector + i, 8);
+        all &= word;
+    }
+    return all == ~0ull;
+}
+
+static inline bool _Batch_is_io(u16 address) {
+    return address >= 0x2000 && address < 0x8000;
+}
+
+static inline bool _Batch_is_ram(u16 address) {
+    return address < 0x2000;
+}
+
+/* RAM or ROM only, I/O never gets here */
+static inline u8 _Batch_read(Batch* batch, u32 lane, u16 address) {
+    if (_Batch_is_ram(address)) {
+        return Batch_read_ram(batch, lane, address);
+    }
+    return batch->rom[address - 0x8000];
+}
+
+static inline void _Batch_write(Batch* batch, u32 lane, u16 address, u8 data) {
+    if (_Batch_is_ram(address)) {
+        Batch_write_ram(batch, lane, address, data);
+    }
+    // Writes to ROM go nowhere
+}
+
+/* Bus callbacks of the scalar CPU, on behalf of batch->scalar_lane. Its ROM is mapped */
+static u8 _Batch_scalar_read(void* context, u16 address) {
+    Batch* batch = context;
+    if (!_Batch_is_io(address)) {
+        return _Batch_read(batch, batch->scalar_lane, address);
+    }
+    return batch->read_fn != NULL ? batch->read_fn(batch->context, batch->scalar_lane, address) : 0;
+}
+
+static void _Batch_scalar_write(void* context, u16 address, u8 data) {
+    Batch* batch = context;
+    if (!_Batch_is_io(address)) {
+        _Batch_write(batch, batch->scalar_lane, address, data);
+    } else if (batch->write_fn != NULL) {
+        batch->write_fn(batch->context, batch->scalar_lane, address, data);
+    }
+}
+
+/* Steps between folding the pending counts in, before the cycles can overflow 16 bits */
+#define BATCH_PENDING_STEPS 4096
+
+static void _Batch_flush_counts(Batch* batch) {
+    for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+        batch->cycle_count[lane]       += batch->pending_cycles[lane];
+        batch->instruction_count[lane] += batch->pending_instructions[lane];
+    }
+    batch->pending_cycles       = SPLAT16(0);
+    batch->pending_instructions = SPLAT16(0);
+    batch->pending_steps = 0;
+}
+
+/* One instruction for one lane, on the scalar CPU. Returns its cycles */
+static u32 _Batch_step_scalar(Batch* batch, u32 lane) {
+    CPU* cpu = &batch->scalar;
+    if (batch->pending_steps != 0) {
+        _Batch_flush_counts(batch);
+    }
+    cpu->r.A  = batch->A[lane];
+    cpu->r.X  = batch->X[lane];
+    cpu->r.Y  = batch->Y[lane];
+    cpu->r.SP = batch->SP[lane];
+    cpu->r.P  = batch->P[lane];
+    cpu->r.PC = batch->PC[lane];
+    cpu->flag_n_source     = batch->flag_n_source[lane];
+    cpu->flag_z_source     = batch->flag_z_source[lane];
+    cpu->instruction_count = batch->instruction_count[lane];
+    cpu->cycle_count       = batch->cycle_count[lane];
+    cpu->is_running = true;
+    cpu->waiting = batch->waiting[lane] != 0;
+    cpu->cycle = 0; // A stopped CPU is left mid-instruction
+    batch->scalar_lane = lane;
+
+    u32 cycles = CPU_step_instruction(cpu);
+
+    batch->A[lane]  = cpu->r.A;
+    batch->X[lane]  = cpu->r.X;
+    batch->Y[lane]  = cpu->r.Y;
+    batch->SP[lane] = cpu->r.SP;
+    batch->P[lane]  = cpu->r.P;
+    batch->PC[lane] = cpu->r.PC;
+    batch->flag_n_source[lane]     = cpu->flag_n_source;
+    batch->flag_z_source[lane]     = cpu->flag_z_source;
+    batch->instruction_count[lane] = cpu->instruction_count;
+    batch->cycle_count[lane]       = cpu->cycle_count;
+    batch->waiting[lane]           = cpu->waiting ? 0xFF : 0;
+    if (!cpu->is_running) {
+        batch->running[lane] = 0;
+        batch->stop_reason[lane] = cpu->stop_reason;
+    }
+    batch->scalar_instructions++;
+    return cycles;
+}
+
+/* Returns the most cycles any of them took */
+static u32 _Batch_step_scalar_lanes(Batch* batch, const BatchU8* mask) {
+    u32 most = 0;
+    for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+        if ((*mask)[lane]) {
+            u32 cycles = _Batch_step_scalar(batch, lane);
+            most = cycles > most ? cycles : most;
+        }
+    }
+    return most;
+}
+
+/* Same cycles as the interpreter takes */
+static u8 _Batch_cycles(u8 opcode) {
+    if (opcode_base_cycles[opcode]) {
+        u8 op = addressed_operation[opcode];
+        return opcode_base_cycles[opcode] + ((op == BATCH_OP_ASL || op == BATCH_OP_ROL) ? 3 : 1);
+    }
+    if ((opcode & 0x1F) == 0x10) { // Branches
+        return 3;
+    }
+    switch (opcode) {
+        case 0x4C: return 4; // JMP abs
+        case 0x20: return 6; // JSR
+        case 0x60: return 5; // RTS
+    }
+    return 2;
+}
+
+/* Whether every lane in mask has the same value in vector as lane first */
+static inline bool _Batch_uniform(const BatchU8* vector, const BatchU8* mask, u32 first) {
+    BatchU8 same = (BatchU8)(*vector == SPLAT8((*vector)[first])) | ~*mask;
+    return ALL_SET(same);
+}
+
+static u32 _Batch_count(Batch* batch, const BatchU8* mask, u8 cycles) {
+    BatchU16 mask16 = MASK16(*mask);
+    batch->pending_cycles       += mask16 & cycles;
+    batch->pending_instructions -= mask16; // All ones is -1
+    batch->vector_steps++;
+    if (++batch->pending_steps == BATCH_PENDING_STEPS) {
+        _Batch_flush_counts(batch);
+    }
+    return cycles;
+}
+
+/* The addressed instructions, for the lanes in mask.
+ * An address that's the same for every lane (ZPG, ABS, ABS_Y with the same Y)
+ * reads and writes the lanes' bytes as one vector, the rest go lane by lane.
+ * Lanes whose access is I/O are left to the scalar CPU.
+ * Returns the most cycles any lane took.
+ */
+static u32 _Batch_addressed(Batch* batch, const BatchU8* lanes, u32 first, u8 opcode, u16 operand) {
+    BatchU8 mask = *lanes;
+    u8  op   = addressed_operation[opcode];
+    u8  mode = addressed_mode[opcode];
+    bool loads = op != BATCH_OP_STA && op != BATCH_OP_STX && op != BATCH_OP_STY;
+    BatchU8 value = {0};
+    u32  scalar_cycles = 0;
+    u16  address[BATCH_LANES];
+    u16  fixed_address = operand;
+    bool fixed = mode == ADDR_ZPG || mode == ADDR_ABS;
+    if (mode == ADDR_ABS_Y && _Batch_uniform(&batch->Y, &mask, first)) {
+        fixed = true;
+        fixed_address = operand + batch->Y[first];
+    }
+
+    if (mode == ADDR_IMM) {
+        value = SPLAT8(operand);
+    } else if (fixed) {
+        if (_Batch_is_io(fixed_address)) {
+            return _Batch_step_scalar_lanes(batch, &mask);
+        }
+        if (loads) {
+            value = _Batch_is_ram(fixed_address) ? batch->ram[fixed_address & (BATCH_RAM_SIZE - 1)]
+                                                 : SPLAT8(batch->rom[fixed_address - 0x8000]);
+        }
+    } else {
+        BatchU8 io_lanes = {0};
+        for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+            if (!mask[lane]) {
+                continue;
+            }
+            u16 lane_address = operand + batch->Y[lane];
+            if (mode == ADDR_X_IND) { // Pointer bytes wrap around in the zero page
+                u8 pointer = operand + batch->X[lane];
+                lane_address = Batch_read_ram(batch, lane, pointer) | (Batch_read_ram(batch, lane, (u8)(pointer + 1)) << 8);
+            }
+            address[lane] = lane_address;
+            if (_Batch_is_io(lane_address)) {
+                io_lanes[lane] = 0xFF;
+            } else if (loads) {
+                value[lane] = _Batch_read(batch, lane, lane_address);
+            }
+        }
+        scalar_cycles = _Batch_step_scalar_lanes(batch, &io_lanes);
+        mask &= ~io_lanes;
+    }
+
+    BatchU8 result = {0};
+    BatchU8 store = {0};
+    bool stores = false;
+    switch (op) {
+        case BATCH_OP_LDA: batch->A = BLEND(mask, value, batch->A); result = value; break;
+        case BATCH_OP_LDX: batch->X = BLEND(mask, value, batch->X); result = value; break;
+        case BATCH_OP_LDY: batch->Y = BLEND(mask, value, batch->Y); result = value; break;
+        case BATCH_OP_AND: result = batch->A & value; batch->A = BLEND(mask, result, batch->A); break;
+        case BATCH_OP_ORA: result = batch->A | value; batch->A = BLEND(mask, result, batch->A); break;
+        case BATCH_OP_EOR: result = batch->A ^ value; batch->A = BLEND(mask, result, batch->A); break;
+        case BATCH_OP_ADC: // No C or V, like the interpreter
+            result = batch->A + value + (batch->P & FLAGS_CAR);
+            batch->A = BLEND(mask, result, batch->A);
+            break;
+        case BATCH_OP_SBC:
+            result = batch->A - value - (1 - (batch->P & FLAGS_CAR));
+            batch->A = BLEND(mask, result, batch->A);
+            break;
+        case BATCH_OP_CMP:
+        case BATCH_OP_CPX:
+        case BATCH_OP_CPY: {
+            BatchU8 reg = op == BATCH_OP_CMP ? batch->A : (op == BATCH_OP_CPX ? batch->X : batch->Y);
+            BatchU8 carry = (BatchU8)(reg >= value) & FLAGS_CAR;
+            batch->P = BLEND(mask, (batch->P & (u8)~FLAGS_CAR) | carry, batch->P);
+            result = reg - value;
+            break;
+        }
+        case BATCH_OP_BIT:
+            batch->flag_z_source = BLEND(mask, value & batch->A, batch->flag_z_source);
+            batch->flag_n_source = BLEND(mask, value, batch->flag_n_source);
+            batch->P = BLEND(mask, (batch->P & (u8)~FLAGS_OVR) | (value & FLAGS_OVR), batch->P);
+            break;
+        case BATCH_OP_STA: store = batch->A; stores = true; break;
+        case BATCH_OP_STX: store = batch->X; stores = true; break;
+        case BATCH_OP_STY: store = batch->Y; stores = true; break;
+        case BATCH_OP_ASL: store = value << 1; stores = true; break; // No flags, like the interpreter
+        case BATCH_OP_ROL:
+            store = (value << 1) | (batch->P & FLAGS_CAR);
+            batch->P = BLEND(mask, (batch->P & (u8)~FLAGS_CAR) | (value >> 7), batch->P);
+            stores = true;
+            break;
+    }
+    switch (op) {
+        case BATCH_OP_LDA: case BATCH_OP_LDX: case BATCH_OP_LDY: case BATCH_OP_AND: case BATCH_OP_ORA:
+        case BATCH_OP_EOR: case BATCH_OP_ADC: case BATCH_OP_SBC: case BATCH_OP_CMP: case BATCH_OP_CPX: case BATCH_OP_CPY:
+            batch->flag_n_source = BLEND(mask, result, batch->flag_n_source);
+            batch->flag_z_source = BLEND(mask, result, batch->flag_z_source);
+            break;
+    }
+    if (stores && fixed) {
+        if (_Batch_is_ram(fixed_address)) {
+            BatchU8* bytes = &batch->ram[fixed_address & (BATCH_RAM_SIZE - 1)];
+            *bytes = BLEND(mask, store, *bytes);
+        }
+    } else if (stores) {
+        for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+            if (mask[lane]) {
+                _Batch_write(batch, lane, address[lane], store[lane]);
+            }
+        }
+    }
+
+    batch->PC = BLEND(MASK16(mask), batch->PC + opcode_length[opcode], batch->PC);
+    u32 cycles = _Batch_count(batch, &mask, _Batch_cycles(opcode));
+    return cycles > scalar_cycles ? cycles : scalar_cycles;
+}
+
+/* Pushes and pulls. With every lane's SP the same that's one vector access, otherwise it goes lane by lane */
+static void _Batch_push(Batch* batch, const BatchU8* mask, u32 first, bool uniform_sp, const BatchU8* value) {
+    if (uniform_sp) {
+        BatchU8* bytes = &batch->ram[0x100 + batch->SP[first]];
+        *bytes = BLEND(*mask, *value, *bytes);
+    } else {
+        for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+            if ((*mask)[lane]) {
+                Batch_write_ram(batch, lane, 0x100 + batch->SP[lane], (*value)[lane]);
+            }
+        }
+    }
+    batch->SP -= *mask & 1;
+}
+
+static void _Batch_pull(Batch* batch, const BatchU8* mask, u32 first, bool uniform_sp, BatchU8* value) {
+    batch->SP += *mask & 1;
+    if (uniform_sp) {
+        *value = batch->ram[0x100 + batch->SP[first]];
+    } else {
+        for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+            if ((*mask)[lane]) {
+                (*value)[lane] = Batch_read_ram(batch, lane, 0x100 + batch->SP[lane]);
+            }
+        }
+    }
+}
+
+/* Everything else the kernels do. Returns false for what's left to the scalar CPU */
+static bool _Batch_other(Batch* batch, const BatchU8* lanes, u32 first, u16 pc, u8 opcode, u16 operand) {
+    BatchU8  mask = *lanes;
+    BatchU16 next_pc = SPLAT16(pc + opcode_length[opcode]);
+    BatchU8  result = {0};
+    bool     sets_nz = true;
+
+    if ((opcode & 0x1F) == 0x10) { // Branches, the target stays in the page of the next instruction like _CPU_branch_logic
+        u16 old_pc = pc + 2;
+        u16 target = ((old_pc + (i8)operand) & 0xFF) + (old_pc & 0xFF00);
+        BatchU8 condition;
+        switch ((opcode & 0xC0) >> 6) {
+            case 0:  condition = batch->flag_n_source & FLAGS_NEG;  break;
+            case 1:  condition = batch->P & FLAGS_OVR;              break;
+            case 2:  condition = batch->P & FLAGS_CAR;              break;
+            default: condition = (BatchU8)(batch->flag_z_source == 0); break;
+        }
+        BatchU8 taken = (BatchU8)(condition != 0);
+        if (!(opcode & 0x20)) {
+            taken = ~taken;
+        }
+        next_pc = BLEND(MASK16(taken), SPLAT16(target), next_pc);
+        batch->PC = BLEND(MASK16(mask), next_pc, batch->PC);
+        return true;
+    }
+
+    bool uniform_sp = _Batch_uniform(&batch->SP, &mask, first);
+    BatchU8 pulled = {0};
+    switch (opcode) {
+        case 0x0A: case 0x2A: // ROL A only shifts in the interpreter too
+            batch->A = BLEND(mask, batch->A << 1, batch->A);
+            sets_nz = false;
+            break;
+        case 0x89: case 0xEA: sets_nz = false; break;
+        case 0xAA: result = batch->A;     batch->X = BLEND(mask, result, batch->X); break;
+        case 0x8A: result = batch->X;     batch->A = BLEND(mask, result, batch->A); break;
+        case 0xA8: result = batch->A;     batch->Y = BLEND(mask, result, batch->Y); break;
+        case 0x98: result = batch->Y;     batch->A = BLEND(mask, result, batch->A); break;
+        case 0xE8: result = batch->X + 1; batch->X = BLEND(mask, result, batch->X); break;
+        case 0xCA: result = batch->X - 1; batch->X = BLEND(mask, result, batch->X); break;
+        case 0xC8: result = batch->Y + 1; batch->Y = BLEND(mask, result, batch->Y); break;
+        case 0x88: result = batch->Y - 1; batch->Y = BLEND(mask, result, batch->Y); break;
+        case 0x1A: result = batch->A + 1; batch->A = BLEND(mask, result, batch->A); break;
+        case 0x3A: result = batch->A - 1; batch->A = BLEND(mask, result, batch->A); break;
+        case 0x4C: // JMP abs
+            next_pc = SPLAT16(operand);
+            sets_nz = false;
+            break;
+        case 0x20: { // JSR pushes the address of its last byte
+            BatchU8 high = SPLAT8((pc + 2) >> 8);
+            BatchU8 low  = SPLAT8((pc + 2) & 0xFF);
+            _Batch_push(batch, &mask, first, uniform_sp, &high);
+            _Batch_push(batch, &mask, first, uniform_sp, &low);
+            next_pc = SPLAT16(operand);
+            sets_nz = false;
+            break;
+        }
+        case 0x60: { // RTS, its dummy read is zero page RAM
+            BatchU8 high = {0};
+            _Batch_pull(batch, &mask, first, uniform_sp, &pulled);
+            _Batch_pull(batch, &mask, first, uniform_sp, &high);
+            next_pc = (__builtin_convertvector(pulled, BatchU16) | (__builtin_convertvector(high, BatchU16) << 8)) + 1;
+            sets_nz = false;
+            break;
+        }
+        case 0x48: // PHA
+            _Batch_push(batch, &mask, first, uniform_sp, &batch->A);
+            sets_nz = false;
+            break;
+        case 0x68: // PLA, no NZ like the interpreter
+            _Batch_pull(batch, &mask, first, uniform_sp, &pulled);
+            batch->A = BLEND(mask, pulled, batch->A);
+            sets_nz = false;
+            break;
+        case 0x08: { // PHP
+            BatchU8 p = (batch->P & (u8)~(FLAGS_NEG | FLAGS_ZER)) | (batch->flag_n_source & FLAGS_NEG) |
+                        ((BatchU8)(batch->flag_z_source == 0) & FLAGS_ZER) | FLAGS_BRK;
+            _Batch_push(batch, &mask, first, uniform_sp, &p);
+            sets_nz = false;
+            break;
+        }
+        case 0x28: // PLP
+            _Batch_pull(batch, &mask, first, uniform_sp, &pulled);
+            pulled &= (u8)~FLAGS_BRK;
+            batch->P = BLEND(mask, pulled, batch->P);
+            batch->flag_n_source = BLEND(mask, pulled, batch->flag_n_source);
+            batch->flag_z_source = BLEND(mask, (BatchU8)((pulled & FLAGS_ZER) == 0) & 1, batch->flag_z_source);
+            sets_nz = false;
+            break;
+        default: { // Flag instructions, decoded like _CPU_flags_logic
+            if ((opcode & 0x1F) != 0x18) {
+                return false;
+            }
+            u8 flag = instruction_flag_by_index[(opcode & 0xC0) >> 6];
+            batch->P = BLEND(mask, (batch->P & (u8)~flag) | (u8)((opcode & 0x20) ? flag : 0), batch->P);
+            sets_nz = false;
+            break;
+        }
+    }
+    if (sets_nz) {
+        batch->flag_n_source = BLEND(mask, result, batch->flag_n_source);
+        batch->flag_z_source = BLEND(mask, result, batch->flag_z_source);
+    }
+    batch->PC = BLEND(MASK16(mask), next_pc, batch->PC);
+    return true;
+}
+
+/* Runs the instruction at pc for every lane in mask, which all have their PC there. first is one of them.
+ * Returns the most cycles any lane took
+ */
+static u32 _Batch_step(Batch* batch, u16 pc, const BatchU8* lanes, u32 first) {
+    BatchU8 mask = *lanes;
+    // The kernels only see ROM code, RAM code can be different in every lane
+    if (pc < 0x8000) {
+        return _Batch_step_scalar_lanes(batch, &mask);
+    }
+    u8 opcode = batch->rom[pc - 0x8000];
+    u8 length = opcode_length[opcode];
+    if (length == 0 || (u32)pc + length > 0x10000 || opcode == 0x6C || opcode == 0x02 || opcode == 0x00 || opcode == 0x40 ||
+        opcode == 0xCB || opcode == 0xDB) {
+        return _Batch_step_scalar_lanes(batch, &mask);
+    }
+    u16 operand = (length > 1 ? batch->rom[pc + 1 - 0x8000] : 0) | (length > 2 ? batch->rom[pc + 2 - 0x8000] << 8 : 0);
+
+    if (opcode_base_cycles[opcode]) {
+        return _Batch_addressed(batch, &mask, first, opcode, operand);
+    }
+    if (_Batch_other(batch, &mask, first, pc, opcode, operand)) {
+        return _Batch_count(batch, &mask, _Batch_cycles(opcode));
+    }
+    return _Batch_step_scalar_lanes(batch, &mask);
+}
+
+Batch* Batch_create(const u8* rom, batch_read_fn_ptr read_fn, batch_write_fn_ptr write_fn, void* context) {
+    // The vectors want their natural alignment
+    size_t size = (sizeof(Batch) + 63) & ~(size_t)63;
+    Batch* batch = aligned_alloc(64, size);
+    if (batch == NULL) {
+        return NULL;
+    }
+    memset(batch, 0, sizeof(Batch));
+    batch->rom      = rom;
+    batch->read_fn  = read_fn;
+    batch->write_fn = write_fn;
+    batch->context  = context;
+    Batch_reset(batch);
+    return batch;
+}
+
+void Batch_destroy(Batch* batch) {
+    if (batch != NULL) {
+        CPU_set_decode_cache(&batch->scalar, 0); // Frees it
+    }
+    free(batch);
+}
+
+void Batch_reset(Batch* batch) {
+    CPU* cpu = &batch->scalar;
+    CPU_reset(cpu, _Batch_scalar_read, _Batch_scalar_write, batch);
+    CPU_map_pages(cpu, 0x80, 0x80, (u8*)batch->rom, BATCH_ROM_SIZE, false); // Read-only, so the cast is harmless
+    CPU_step_instruction(cpu); // The reset sequence, the same for every lane
+
+    batch->A  = SPLAT8(cpu->r.A);
+    batch->X  = SPLAT8(cpu->r.X);
+    batch->Y  = SPLAT8(cpu->r.Y);
+    batch->SP = SPLAT8(cpu->r.SP);
+    batch->P  = SPLAT8(cpu->r.P);
+    batch->PC = SPLAT16(cpu->r.PC);
+    batch->flag_n_source = SPLAT8(cpu->flag_n_source);
+    batch->flag_z_source = SPLAT8(cpu->flag_z_source);
+    batch->running       = SPLAT8(0xFF);
+    batch->waiting       = SPLAT8(0);
+    for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+        batch->cycle_count[lane]       = cpu->cycle_count;
+        batch->instruction_count[lane] = cpu->instruction_count;
+        batch->stop_reason[lane]       = STOP_NONE;
+    }
+}
+
+u64 Batch_run(Batch* batch, u64 cycle_budget) {
+    u64 start[BATCH_LANES];
+    memcpy(start, batch->cycle_count, sizeof(start));
+    BatchU8 active = cycle_budget > 0 ? batch->running & ~batch->waiting : SPLAT8(0);
+    u64 slack = cycle_budget; // Every active lane has at least this many cycles of its budget left
+
+    while (true) {
+        if (slack == 0) {
+            // Someone may be done, find out who and how far the rest have to go
+            _Batch_flush_counts(batch);
+            slack = cycle_budget;
+            for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+                u64 used = batch->cycle_count[lane] - start[lane];
+                if (used >= cycle_budget) {
+                    active[lane] = 0;
+                } else if (active[lane] && cycle_budget - used < slack) {
+                    slack = cycle_budget - used;
+                }
+            }
+        }
+        u32 first = 0;
+        while (first < BATCH_LANES && !active[first]) {
+            first++;
+        }
+        if (first == BATCH_LANES) {
+            break;
+        }
+        // Lanes that haven't diverged all go together. When they have, the lowest PC goes first
+        // and the lanes that branched ahead wait there for the rest
+        u16 leader = batch->PC[first];
+        BatchU16 at_leader = (BatchU16)(batch->PC == SPLAT16(leader)) | ~MASK16(active);
+        if (!ALL_SET(at_leader)) {
+            for (u32 lane = first + 1; lane < BATCH_LANES; lane++) {
+                if (active[lane] && batch->PC[lane] < leader) {
+                    leader = batch->PC[lane];
+                    first = lane;
+                }
+            }
+        }
+        BatchU8 mask = __builtin_convertvector((BatchU16)(batch->PC == SPLAT16(leader)), BatchU8) & active;
+        u32 cycles = _Batch_step(batch, leader, &mask, first);
+        slack = slack > cycles ? slack - cycles : 0;
+        active &= batch->running & ~batch->waiting;
+    }
+
+    _Batch_flush_counts(batch);
+    u64 total = 0;
+    for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+        u64 used = batch->cycle_count[lane] - start[lane];
+        if (batch->waiting[lane] && batch->running[lane] && used < cycle_budget) {
+            batch->cycle_count[lane] += cycle_budget - used; // Parked for the rest of it, like CPU_run
+        }
+        total += batch->cycle_count[lane] - start[lane];
+    }
+    return total;
+}
+
+RegFile Batch_get_registers(Batch* batch, u32 lane) {
+    RegFile r = {0};
+    r.A  = batch->A[lane];
+    r.X  = batch->X[lane];
+    r.Y  = batch->Y[lane];
+    r.SP = batch->SP[lane];
+    r.PC = batch->PC[lane];
+    r.P  = (batch->P[lane] & ~(FLAGS_NEG | FLAGS_ZER)) | (batch->flag_n_source[lane] & FLAGS_NEG) |
+           (batch->flag_z_source[lane] == 0 ? FLAGS_ZER : 0);
+    return r;
+}
@@ -1,38 +1,46 @@
 #include "cpu.h"
+#include "trace.h"
+#include "hooks.h"
 #define _EMULATE_W65C02S
+#include "opcodes.h"
 
 /* Flag modifying functions */
-/* Sets NZ to appropriate values following a result*/
-void CPU_set_NZ(CPU* cpu, u8 result) {
-    cpu->r.P &= ~(FLAGS_NEG | FLAGS_ZER);
-    cpu->r.P |= FLAGS_NEG & result; /* See footnote below the function */
-    cpu->r.P |= result == 0 ? FLAGS_ZER : 0;
-}
-/* About the 6502's flags register:
- * Its flags register is formatted as
- * NV-BDIZC, which means the negative
- * flag is at the same place at the sign bit!
- * Essentially, &'ing it with the result
- * gives us the sign bit at the proper position already.
+/* Sets NZ to appropriate values following a result.
+ * They are evaluated lazily: only the result is kept, and the real
+ * bits are worked out by whoever needs them (branches, CPU_get_P).
  */
+void CPU_set_NZ(CPU* cpu, u8 result) {
+    cpu->flag_n_source = result;
+    cpu->flag_z_source = result;
+}
+
+/* Whether the flag a branch looks at is set, NZ straight from their sources */
+bool _CPU_branch_flag(CPU* cpu) {
+    switch ((cpu->r.IR & 0xC0) >> 6) {
+        case 0:  return cpu->flag_n_source & FLAGS_NEG;
+        case 1:  return cpu->r.P & FLAGS_OVR;
+        case 2:  return cpu->r.P & FLAGS_CAR;
+        default: return cpu->flag_z_source == 0;
+    }
+}
 
 void _CPU_push_to_stack(CPU* cpu, u8 value) {
-    cpu->write_fn(0x100 + cpu->r.SP--, value);
+    CPU_write(cpu, 0x100 + cpu->r.SP--, value);
 }
 
 u8 _CPU_pull_from_stack(CPU* cpu) {
-    return cpu->read_fn(0x100 + ++cpu->r.SP);
+    return CPU_read(cpu, 0x100 + ++cpu->r.SP);
 }
 
 void _CPU_branch_logic(CPU* cpu) {
     switch (cpu->cycle) {
         case 1:
-            cpu->offset = (i8)cpu->read_fn(cpu->r.PC);
+            cpu->offset = (i8)CPU_read(cpu, cpu->r.PC);
             cpu->old_pc = ++cpu->r.PC;
             cpu->cycle++;
             break;
         case 2:
-            if ((bool)(cpu->r.P & branch_flag_by_index[(cpu->r.IR & 0xC0) >> 6]) ^ !(bool)(cpu->r.IR & 0x20)) {
+            if (_CPU_branch_flag(cpu) ^ !(bool)(cpu->r.IR & 0x20)) {
                 cpu->r.PC = cpu->r.PC + cpu->offset;
                 cpu->r.PC = (cpu->r.PC & 0xFF) + (cpu->old_pc & 0xFF00);
                 cpu->cycle = ((cpu->r.PC & 0xFF00) != (cpu->old_pc & 0xFF00)) ? cpu->cycle+1 : 0;
@@ -66,13 +74,13 @@ void _CPU_addressing_ABS(CPU* cpu) {
     switch (cpu->cycle) {
         case 1: {
             // Low byte first
-            cpu->access_address = cpu->read_fn(cpu->r.PC++);
+            cpu->access_address = CPU_read(cpu, cpu->r.PC++);
             cpu->cycle++;
             break;
         }
         case 2: {
             // Next byte
-            cpu->access_address |= cpu->read_fn(cpu->r.PC++) << 8;
+            cpu->access_address |= CPU_read(cpu, cpu->r.PC++) << 8;
             cpu->cycle = 0x80;
             cpu->found_address = true;
             break;
@@ -83,7 +91,7 @@ void _CPU_addressing_ABS(CPU* cpu) {
 void _CPU_addressing_ZPG(CPU* cpu) {
     // Only possible CPU cycle is 1
     // Low byte first
-    cpu->access_address = cpu->read_fn(cpu->r.PC++);
+    cpu->access_address = CPU_read(cpu, cpu->r.PC++);
     cpu->cycle = 0x80;
     cpu->found_address = true;
 }
@@ -91,7 +99,7 @@ void _CPU_addressing_ZPG(CPU* cpu) {
 void _CPU_addressing_X_IND(CPU* cpu) { // (ZPG,X)
     switch (cpu->cycle) {
         case 1: {
-            cpu->indirect_address = cpu->read_fn(cpu->r.PC++);
+            cpu->indirect_address = CPU_read(cpu, cpu->r.PC++);
             cpu->cycle++;
             break;
         }
@@ -101,12 +109,12 @@ void _CPU_addressing_X_IND(CPU* cpu) { // (ZPG,X)
             break;
         }
         case 3: {
-            cpu->access_address = cpu->read_fn(cpu->indirect_address); cpu->indirect_address = (u8)(cpu->indirect_address + 1);
+            cpu->access_address = CPU_read(cpu, cpu->indirect_address); cpu->indirect_address = (u8)(cpu->indirect_address + 1);
             cpu->cycle++;
             break;
         }
         case 4: {
-            cpu->access_address |= cpu->read_fn(cpu->indirect_address) << 8;
+            cpu->access_address |= CPU_read(cpu, cpu->indirect_address) << 8;
             cpu->cycle = 0x80;
             cpu->found_address = true;
             break;
@@ -117,12 +125,12 @@ void _CPU_addressing_X_IND(CPU* cpu) { // (ZPG,X)
 void _CPU_addressing_ABS_Y(CPU* cpu) { // abs,y
     switch (cpu->cycle) {
         case 1: { // Low byte
-            cpu->access_address = cpu->read_fn(cpu->r.PC++);
+            cpu->access_address = CPU_read(cpu, cpu->r.PC++);
             cpu->cycle++;
             break;
         }
         case 2: { // High byte
-            cpu->access_address |= cpu->read_fn(cpu->r.PC++) << 8;
+            cpu->access_address |= CPU_read(cpu, cpu->r.PC++) << 8;
             cpu->cycle++;
             break;
         }
@@ -139,11 +147,11 @@ void _CPU_stack_manipulation(CPU* cpu) {
     // Very simple
     switch((cpu->r.IR & 0x60) >> 5) {
         case 0: { // Push P
-            _CPU_push_to_stack(cpu, cpu->r.P | FLAGS_BRK);
+            _CPU_push_to_stack(cpu, CPU_get_P(cpu) | FLAGS_BRK);
             break;
         }
         case 1: { // Pull P
-            cpu->r.P = _CPU_pull_from_stack(cpu) & ~FLAGS_BRK;
+            CPU_set_P(cpu, _CPU_pull_from_stack(cpu) & ~FLAGS_BRK);
             break;    
         }
         case 2: { // Push A
@@ -185,517 +193,135 @@ void _CPU_TYA(CPU* cpu) {
     cpu->cycle = 0;
 }
 
-void _CPU_LDA(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto LDA_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-            default: {
-                return;
-            }
-        }
-        return;
-    }
-    LDA_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.A = cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
+/* Operation logic.
+ * These run once the addressing mode has found cpu->access_address, the
+ * handlers that glue them to an addressing mode are generated further down
+ * from the opcode list in opcodes.h.
+ */
+void _CPU_LDA_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.A = CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_STA(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                // STA does not have an # addressing mode, so it's a 2-byte NOP.
-                cpu->r.PC++;
-                cpu->cycle = 0;
-                return;
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-            default: {
-                // Simply return
-                return;
-            }
-        }
-        return;
-    }
-    cpu->write_fn(cpu->access_address, cpu->r.A);
+void _CPU_STA_logic(CPU* cpu) {
+    CPU_write(cpu, cpu->access_address, cpu->r.A);
     cpu->cycle = 0;
 }
 
-void _CPU_LDX(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case 0: { // LDX is special(tm) in relation to its IMM
-                _CPU_addressing_IMM(cpu); goto LDX_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    LDX_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.X = cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
+void _CPU_LDX_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.X = CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_STX(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                // STX does not have an # addressing mode, so it's a 2-byte NOP.
-                cpu->r.PC++;
-                cpu->cycle = 0;
-                return;
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-            default: {
-                // Simply return
-                return;
-            }
-        }
-        return;
-    }
-    cpu->write_fn(cpu->access_address, cpu->r.X);
+void _CPU_STX_logic(CPU* cpu) {
+    CPU_write(cpu, cpu->access_address, cpu->r.X);
     cpu->cycle = 0;
 }
 
-void _CPU_LDY(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case 0: {
-                _CPU_addressing_IMM(cpu); goto LDY_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-        }
-        return;
-    }
-    LDY_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.Y = cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
+void _CPU_LDY_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.Y = CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_STY(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                // STY does not have an # addressing mode, so it's a 2-byte NOP.
-                cpu->r.PC++;
-                cpu->cycle = 0;
-                return;
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            default: {
-                // Simply return
-                return;
-            }
-        }
-        return;
-    }
-    cpu->write_fn(cpu->access_address, cpu->r.Y);
+void _CPU_STY_logic(CPU* cpu) {
+    CPU_write(cpu, cpu->access_address, cpu->r.Y);
     cpu->cycle = 0;
 }
 
-void _CPU_CMP_logic(CPU* cpu, u8 cpu_register, u8 compare_operand) {
+void _CPU_compare(CPU* cpu, u8 cpu_register, u8 compare_operand) {
     u8 temp = cpu_register - compare_operand;
-    cpu->r.P &= ~(FLAGS_ZER | FLAGS_NEG | FLAGS_CAR);
-    cpu->r.P |= (temp == 0 ? FLAGS_ZER : 0) | (cpu_register >= compare_operand ? FLAGS_CAR : 0) | (temp & FLAGS_NEG);
+    CPU_set_NZ(cpu, temp);
+    cpu->r.P &= ~FLAGS_CAR;
+    cpu->r.P |= cpu_register >= compare_operand ? FLAGS_CAR : 0;
 }
 
-void _CPU_CMP(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto CMP_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    CMP_LOGIC:
-        _CPU_CMP_logic(cpu, cpu->r.A, cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
-        return;
+void _CPU_CMP_logic(CPU* cpu) {
+    _CPU_compare(cpu, cpu->r.A, CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_CPX(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto CPX_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-        }
-        return;
-    }
-    CPX_LOGIC:
-        _CPU_CMP_logic(cpu, cpu->r.X, cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
-        return;
+void _CPU_CPX_logic(CPU* cpu) {
+    _CPU_compare(cpu, cpu->r.X, CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_CPY(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto CPY_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-        }
-        return;
-    }
-    CPY_LOGIC:
-        _CPU_CMP_logic(cpu, cpu->r.Y, cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
-        return;
+void _CPU_CPY_logic(CPU* cpu) {
+    _CPU_compare(cpu, cpu->r.Y, CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_BIT(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-        }
-        return;
-    }
+void _CPU_BIT_logic(CPU* cpu) {
     // Note: compare_operand is being used as operand here
-    cpu->compare_operand = cpu->read_fn(cpu->access_address);
-    CPU_set_NZ(cpu, cpu->compare_operand & cpu->r.A);
-    cpu->r.P &= ~(FLAGS_NEG | FLAGS_OVR);
-    cpu->r.P |= (cpu->compare_operand & (FLAGS_NEG | FLAGS_OVR));
+    cpu->compare_operand = CPU_read(cpu, cpu->access_address);
+    cpu->flag_z_source = cpu->compare_operand & cpu->r.A;
+    cpu->flag_n_source = cpu->compare_operand;
+    cpu->r.P &= ~FLAGS_OVR;
+    cpu->r.P |= (cpu->compare_operand & FLAGS_OVR);
     cpu->cycle = 0;
-    return;
 }
 
-void _CPU_AND(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto AND_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    AND_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.A &= cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
-        return;
+void _CPU_AND_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.A &= CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_ORA(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto ORA_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    ORA_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.A |= cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
-        return;
+void _CPU_ORA_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.A |= CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_EOR(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto EOR_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    EOR_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.A ^= cpu->read_fn(cpu->access_address));
-        cpu->cycle = 0;
-        return;
+void _CPU_EOR_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.A ^= CPU_read(cpu, cpu->access_address));
+    cpu->cycle = 0;
 }
 
-void _CPU_ADC(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto ADC_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    ADC_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.A += cpu->read_fn(cpu->access_address) + (cpu->r.P & FLAGS_CAR));
-        cpu->cycle = 0;
-        return;
+void _CPU_ADC_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.A += CPU_read(cpu, cpu->access_address) + (cpu->r.P & FLAGS_CAR));
+    cpu->cycle = 0;
 }
 
-void _CPU_SBC(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                _CPU_addressing_IMM(cpu); goto SBC_LOGIC; /* IMM is the only one that doesn't do any memory accesses 
-                                                            * and as such happens in 2 cycles (fetch opcode + fetch operand), 
-                                                            * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch 
-                                                            * operand in memory) */
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    SBC_LOGIC:
-        CPU_set_NZ(cpu, cpu->r.A = cpu->r.A - cpu->read_fn(cpu->access_address) - (1 - (cpu->r.P & FLAGS_CAR)));
-        cpu->cycle = 0;
-        return;
+void _CPU_SBC_logic(CPU* cpu) {
+    CPU_set_NZ(cpu, cpu->r.A = cpu->r.A - CPU_read(cpu, cpu->access_address) - (1 - (cpu->r.P & FLAGS_CAR)));
+    cpu->cycle = 0;
 }
 
-void _CPU_ASL(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                // This skips addressing entirely and just does the operation on A.
-                cpu->r.A <<= 1;
-                cpu->cycle = 0;
-                break;
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    
+void _CPU_ASL_logic(CPU* cpu) {
     switch (cpu->cycle) { // this time it starts at 0x80
         case 0x80: {
             // Read the operand
             // Note: compare_operand is being used as operand here
-            cpu->compare_operand = cpu->read_fn(cpu->access_address);
+            cpu->compare_operand = CPU_read(cpu, cpu->access_address);
             cpu->cycle++;
             break;
         }
         case 0x81: {
             // Write back the original operand and perform the shift
-            cpu->write_fn(cpu->access_address, cpu->compare_operand);
+            CPU_write(cpu, cpu->access_address, cpu->compare_operand);
             cpu->compare_operand <<= 1;
             cpu->cycle++;
             break;
         }
         case 0x82: {
             // Write the new operand
-            cpu->write_fn(cpu->access_address, cpu->compare_operand);
+            CPU_write(cpu, cpu->access_address, cpu->compare_operand);
             cpu->cycle = 0;
             break;
         }
     }
 }
 
-void _CPU_ROL(CPU* cpu) {
-    if (!cpu->found_address) {
-        switch (cpu->bbb) {
-            case ADDR_X_IND: {
-                _CPU_addressing_X_IND(cpu); break;
-            }
-            case ADDR_ZPG: {
-                _CPU_addressing_ZPG(cpu); break;
-            }
-            case ADDR_IMM: {
-                // This skips addressing entirely and just does the operation on A.
-                cpu->r.A <<= 1;
-                cpu->cycle = 0;
-                break;
-            }
-            case ADDR_ABS: {
-                _CPU_addressing_ABS(cpu); break;
-            }
-            case ADDR_ABS_Y: {
-                _CPU_addressing_ABS_Y(cpu); break;
-            }
-        }
-        return;
-    }
-    
+void _CPU_ROL_logic(CPU* cpu) {
     switch (cpu->cycle) { // this time it starts at 0x80
         case 0x80: {
             // Read the operand
             // Note: compare_operand is being used as operand here
-            cpu->compare_operand = cpu->read_fn(cpu->access_address);
+            cpu->compare_operand = CPU_read(cpu, cpu->access_address);
             cpu->cycle++;
             break;
         }
         case 0x81: {
             // Write back the original operand and perform the shift
-            cpu->write_fn(cpu->access_address, cpu->compare_operand);
+            CPU_write(cpu, cpu->access_address, cpu->compare_operand);
             u8 previous_carry = cpu->r.P & FLAGS_CAR; // No bit shift is needed as FLAGS_CAR = 1
             cpu->r.P &= ~FLAGS_CAR;
             cpu->r.P |= (i8)cpu->compare_operand < 0 ? FLAGS_CAR : 0;
@@ -706,23 +332,61 @@ void _CPU_ROL(CPU* cpu) {
         }
         case 0x82: {
             // Write the new operand
-            cpu->write_fn(cpu->access_address, cpu->compare_operand);
+            CPU_write(cpu, cpu->access_address, cpu->compare_operand);
             cpu->cycle = 0;
             break;
         }
     }
 }
 
+void _CPU_ASL_A(CPU* cpu) {
+    // This skips addressing entirely and just does the operation on A.
+    cpu->r.A <<= 1;
+    cpu->cycle = 0;
+}
+
+void _CPU_ROL_A(CPU* cpu) {
+    // This skips addressing entirely and just does the operation on A.
+    cpu->r.A <<= 1;
+    cpu->cycle = 0;
+}
+
+void _CPU_NOP_IMM(CPU* cpu) {
+    // STA does not have an # addressing mode, so it's a 2-byte NOP.
+    cpu->r.PC++;
+    cpu->cycle = 0;
+}
+
+/* Operation + addressing mode handlers, one per opcode.
+ * The addressing mode runs until it has found the address, and the operation
+ * runs on the cycle after that. IMM is the only one that doesn't do any memory
+ * accesses and as such happens in 2 cycles (fetch opcode + fetch operand),
+ * instead of >3 (fetch opcode + 1 or 2 fetch address + 1 to 3 fetch operand
+ * in memory), so its operation runs right away.
+ */
+#define X(opcode, op, mode)                                     \
+    void _CPU_##op##_##mode(CPU* cpu) {                         \
+        if (!cpu->found_address) {                              \
+            _CPU_addressing_##mode(cpu);                        \
+            if (ADDR_##mode != ADDR_IMM) {                      \
+                return;                                         \
+            }                                                   \
+        }                                                       \
+        _CPU_##op##_logic(cpu);                                 \
+    }
+CPU_ADDRESSED_OPCODES(X)
+#undef X
+
 void _CPU_JMP_ABS(CPU* cpu) {
     switch (cpu->cycle) {
         case 1: {
-            cpu->access_address = cpu->read_fn(cpu->r.PC);
+            cpu->access_address = CPU_read(cpu, cpu->r.PC);
             cpu->r.PC++;
             cpu->cycle++;
             break;
         }
         case 2: {
-            cpu->access_address |= cpu->read_fn(cpu->r.PC) << 8;
+            cpu->access_address |= CPU_read(cpu, cpu->r.PC) << 8;
             cpu->r.PC++;
             cpu->cycle++;
             break;
@@ -739,7 +403,7 @@ void _CPU_JMP_IND(CPU* cpu) {
     #ifdef _EMULATE_W65C02S
     switch (cpu->cycle) {
         case 1: {
-            cpu->indirect_address = cpu->read_fn(cpu->r.PC); // Low byte
+            cpu->indirect_address = CPU_read(cpu, cpu->r.PC); // Low byte
             cpu->old_pc = cpu->r.PC++;
             cpu->cycle++;
             break;
@@ -751,23 +415,23 @@ void _CPU_JMP_IND(CPU* cpu) {
                 break;
             }
             // Else, simply get the next byte and skip
-            cpu->indirect_address |= cpu->read_fn(cpu->r.PC++) << 8;
+            cpu->indirect_address |= CPU_read(cpu, cpu->r.PC++) << 8;
             cpu->cycle = 4;
             break;
         }
         case 3: {
             // Page boundary was crossed.
-            cpu->indirect_address |= cpu->read_fn(cpu->r.PC++) << 8; // We have to "fake" the addition in order to maintain cycle accuracy
+            cpu->indirect_address |= CPU_read(cpu, cpu->r.PC++) << 8; // We have to "fake" the addition in order to maintain cycle accuracy
             cpu->cycle++;
             break;
         }
         case 4: {
-            cpu->access_address = cpu->read_fn(cpu->indirect_address++);
+            cpu->access_address = CPU_read(cpu, cpu->indirect_address++);
             cpu->cycle++;
             break;
         }
         case 5: {
-            cpu->access_address |= cpu->read_fn(cpu->indirect_address) << 8;
+            cpu->access_address |= CPU_read(cpu, cpu->indirect_address) << 8;
             cpu->r.PC = cpu->access_address;
             cpu->cycle = 0;
         }
@@ -779,12 +443,12 @@ void _CPU_JMP_IND(CPU* cpu) {
 void _CPU_JSR(CPU* cpu) {
     switch (cpu->cycle) {
         case 1: { // Note: old_pc is being used as a new_pc here
-            cpu->old_pc = cpu->read_fn(cpu->r.PC++);
+            cpu->old_pc = CPU_read(cpu, cpu->r.PC++);
             cpu->cycle++;
             break;
         }
         case 2: {
-            cpu->old_pc |= cpu->read_fn(cpu->r.PC++) << 8;
+            cpu->old_pc |= CPU_read(cpu, cpu->r.PC++) << 8;
             cpu->cycle++;
             break;
         }
@@ -810,7 +474,7 @@ void _CPU_JSR(CPU* cpu) {
 void _CPU_RTS(CPU* cpu) {
     switch(cpu->cycle) {
         case 1: { // Dummy read
-            cpu->read_fn(cpu->r.SP); // I don't know if it's the SP being used or the PC
+            CPU_read(cpu, cpu->r.SP); // I don't know if it's the SP being used or the PC
             cpu->cycle++;
             break;
         }
@@ -833,257 +497,864 @@ void _CPU_RTS(CPU* cpu) {
     }
 }
 
-void CPU_reset (CPU* cpu, read_fn_ptr read_fn, write_fn_ptr write_fn) {
-    memset(cpu, 0, sizeof(*cpu));
-    if (read_fn != NULL) {
-        cpu->read_fn = read_fn;
-    }
-    if (write_fn != NULL) {
-        cpu->write_fn = write_fn;
+void _CPU_RTI(CPU* cpu) {
+    switch(cpu->cycle) {
+        case 1: { // Dummy read
+            CPU_read(cpu, cpu->r.PC);
+            cpu->cycle++;
+            break;
+        }
+        case 2: { // Dummy stack read
+            CPU_read(cpu, 0x100 + cpu->r.SP);
+            cpu->cycle++;
+            break;
+        }
+        case 3: {
+            CPU_set_P(cpu, _CPU_pull_from_stack(cpu) & ~FLAGS_BRK);
+            cpu->cycle++;
+            break;
+        }
+        case 4: {
+            cpu->old_pc = _CPU_pull_from_stack(cpu);
+            cpu->cycle++;
+            break;
+        }
+        case 5: { // Unlike RTS the address pushed is the one to go back to
+            cpu->r.PC = cpu->old_pc | (_CPU_pull_from_stack(cpu) << 8);
+            cpu->cycle = 0;
+            break;
+        }
     }
-    cpu->r.PC = 0xFFFC; cpu->r.SP = 0xEA; // It should be a random value, so I chose $EA "randomly"
-    cpu->r.P = FLAGS_IGN;
-    cpu->reset_delay = 7;
-    cpu->is_running = true;
 }
-/* This function executes 1 clock cycle of the CPU */
-void CPU_emulate (CPU* cpu) {
-    switch (cpu->reset_delay) {
-        case 1: {
-            // Fetch PC low byte
-            cpu->r.PC = cpu->read_fn(0xFFFC);
-            cpu->reset_delay--;
-            return;
+
+/* IRQ and NMI sequence, in place of an instruction (the 6502 runs it as a BRK). 7 cycles with the first one */
+void _CPU_interrupt(CPU* cpu) {
+    u16 vector = cpu->interrupt == CPU_INTERRUPT_NMI ? 0xFFFA : 0xFFFE;
+    switch (cpu->cycle) {
+        case 1: { // Internal, the real one re-reads the opcode
+            cpu->cycle++;
+            break;
         }
-        case 0: {
-            // Fetch PC high byte
-            cpu->r.PC |= (cpu->read_fn(0xFFFD) << 8);
-            cpu->reset_delay = 0xFF;
-            cpu->cycle = 0;
-            return;
+        case 2: {
+            _CPU_push_to_stack(cpu, cpu->r.PC >> 8);
+            cpu->cycle++;
+            break;
         }
-        default: {
-            cpu->reset_delay--;
-            return;
+        case 3: {
+            _CPU_push_to_stack(cpu, cpu->r.PC & 0xFF);
+            cpu->cycle++;
+            break;
         }
-        case 0xFF: {
-            break; // Should fall through
+        case 4: { // B clear tells the handler it wasn't a BRK
+            _CPU_push_to_stack(cpu, (CPU_get_P(cpu) & ~FLAGS_BRK) | FLAGS_IGN);
+            cpu->r.P |= FLAGS_IRE;
+            #ifdef _EMULATE_W65C02S
+            cpu->r.P &= ~FLAGS_DEC;
+            #endif
+            cpu->cycle++;
+            break;
+        }
+        case 5: {
+            cpu->old_pc = CPU_read(cpu, vector);
+            cpu->cycle++;
+            break;
+        }
+        case 6: {
+            cpu->r.PC = cpu->old_pc | (CPU_read(cpu, vector + 1) << 8);
+            cpu->interrupt = CPU_INTERRUPT_NONE;
+            cpu->cycle = 0;
+            break;
         }
     }
-    if (cpu->cycle == 0) {
-        cpu->r.IR = cpu->read_fn(cpu->r.PC);
-        cpu->r.PC++;
-        cpu->cycle++;
-        cpu->instruction_count++;
-        cpu->found_address = false;
+}
+
+void _CPU_INX(CPU* cpu) {
+    CPU_set_NZ(cpu, ++cpu->r.X);
+    cpu->cycle = 0;
+}
+
+void _CPU_DEX(CPU* cpu) {
+    CPU_set_NZ(cpu, --cpu->r.X);
+    cpu->cycle = 0;
+}
+
+void _CPU_INY(CPU* cpu) {
+    CPU_set_NZ(cpu, ++cpu->r.Y);
+    cpu->cycle = 0;
+}
+
+void _CPU_DEY(CPU* cpu) {
+    CPU_set_NZ(cpu, --cpu->r.Y);
+    cpu->cycle = 0;
+}
+
+#ifdef _EMULATE_W65C02S
+void _CPU_INC_A(CPU* cpu) {
+    CPU_set_NZ(cpu, ++cpu->r.A);
+    cpu->cycle = 0;
+}
 
-        // Compute octal triplet
-        cpu->aaa = (cpu->r.IR & 0b11100000) >> 5;
-        cpu->bbb = (cpu->r.IR & 0b00011100) >> 2;
-        cpu->cc  = (cpu->r.IR & 0b00000011);
+void _CPU_DEC_A(CPU* cpu) {
+    CPU_set_NZ(cpu, --cpu->r.A);
+    cpu->cycle = 0;
+}
 
+/* 3 cycles, then the CPU stays parked at the next instruction until an IRQ or NMI line is active.
+ * With I set an IRQ doesn't get taken, the CPU just carries on with the next instruction
+ */
+void _CPU_WAI(CPU* cpu) {
+    if (cpu->cycle == 1) {
+        cpu->cycle++;
         return;
     }
+    cpu->waiting = true;
+    cpu->cycle = 0;
+}
 
-    if (cpu->cc == 1) {
-        // Instructions involving the accumulator.
-        switch (cpu->aaa) {
-            case 0: {
-                _CPU_ORA(cpu);
-                break;
-            }
-            case 1: {
-                _CPU_AND(cpu);
-                break;
-            }
-            case 2: {
-                _CPU_EOR(cpu);
-                break;
-            }
-            case 3: {
-                _CPU_ADC(cpu);
-                break;
-            }
-            case 4: {
-                _CPU_STA(cpu);
-                break;
-            }
-            case 5: {
-                _CPU_LDA(cpu);
-                break;
-            }
-            case 6: {
-                _CPU_CMP(cpu);
-                break;
-            }
-            case 7: {
-                _CPU_SBC(cpu);
-                break;
-            }
-            default:
-                goto SPECIAL_INSTRUCTIONS;
+void _CPU_STP(CPU* cpu) {
+    cpu->is_running = false;
+    cpu->stop_reason = STOP_STP;
+}
+#endif
+
+void _CPU_NOP(CPU* cpu) {
+    // We must do nothing for 1+1 cycles (fetch opcode + do nothing)
+    cpu->cycle = 0;
+}
+
+void _CPU_DBP(CPU* cpu) { // Debug print
+    printf("A=%02X   X=%02X    Y=%02X    P=%08B    IR=%02X    SP=%02X    PC=%04X    IC=%08llX\n", \
+           cpu->r.A, cpu->r.X, cpu->r.Y, CPU_get_P(cpu), cpu->r.IR, cpu->r.SP, cpu->r.PC, cpu->instruction_count);
+    cpu->cycle = 0;
+}
+
+void _CPU_BRK(CPU* cpu) {
+    cpu->is_running = false;
+    cpu->stop_reason = STOP_BRK;
+}
+
+void _CPU_illegal(CPU* cpu) {
+    printf("Illegal instruction $%02X at $%04X\n", cpu->r.IR, cpu->r.PC);
+    cpu->is_running = false;
+    cpu->stop_reason = STOP_ILLEGAL;
+}
+
+/* Flat opcode -> handler table, NULL entries are illegal instructions */
+static const instruction_fn_ptr opcode_table[256] = {
+    #define X(opcode, op, mode) [opcode] = _CPU_##op##_##mode,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) [opcode] = handler,
+    CPU_OTHER_OPCODES(X)
+    #ifdef _EMULATE_W65C02S
+    CPU_W65C02S_OPCODES(X)
+    #endif
+    #undef X
+};
+
+/* Decoded instruction cache */
+/* Where the operand of a decoded instruction is, PC is already past the instruction */
+static inline u16 _CPU_decoded_address_IMM(CPU* cpu, const DecodedInstruction* decoded) {
+    (void)decoded;
+    return cpu->r.PC - 1;
+}
+
+static inline u16 _CPU_decoded_address_ZPG(CPU* cpu, const DecodedInstruction* decoded) {
+    (void)cpu;
+    return decoded->operand[0];
+}
+
+static inline u16 _CPU_decoded_address_ABS(CPU* cpu, const DecodedInstruction* decoded) {
+    (void)cpu;
+    return decoded->operand[0] | (decoded->operand[1] << 8);
+}
+
+static inline u16 _CPU_decoded_address_ABS_Y(CPU* cpu, const DecodedInstruction* decoded) {
+    return (u16)((decoded->operand[0] | (decoded->operand[1] << 8)) + cpu->r.Y);
+}
+
+static inline u16 _CPU_decoded_address_X_IND(CPU* cpu, const DecodedInstruction* decoded) { // (ZPG,X)
+    u8 pointer = decoded->operand[0] + cpu->r.X;
+    return CPU_read(cpu, pointer) | (CPU_read(cpu, (u8)(pointer + 1)) << 8);
+}
+
+/* Whole-instruction versions of the addressed handlers: the address comes
+ * straight from the decoded operand, then the operation logic runs
+ * (once, or 3 times for read-modify-write) like it would have cycle by cycle.
+ */
+#define X(opcode, op, mode)                                                             \
+    u32 _CPU_##op##_##mode##_decoded(CPU* cpu, const DecodedInstruction* decoded) {     \
+        u32 cycles = decoded->cycles;                                                   \
+        cpu->r.PC += decoded->length - 1;                                               \
+        cpu->access_address = _CPU_decoded_address_##mode(cpu, decoded);                \
+        cpu->found_address = true;                                                      \
+        cpu->cycle = 0x80;                                                              \
+        do {                                                                            \
+            _CPU_##op##_logic(cpu);                                                     \
+            cycles++;                                                                   \
+        } while (cpu->cycle != 0);                                                      \
+        return cycles;                                                                  \
+    }
+CPU_ADDRESSED_OPCODES(X)
+#undef X
+
+/* Everything else runs its per-cycle handler, only the opcode fetch is saved */
+u32 _CPU_staged_decoded(CPU* cpu, const DecodedInstruction* decoded) {
+    u32 cycles = decoded->cycles;
+    cpu->execute = opcode_table[decoded->opcode];
+    if (cpu->execute == NULL) {
+        cpu->execute = _CPU_illegal;
+    }
+    do {
+        cpu->execute(cpu);
+        cycles++;
+    } while (cpu->cycle != 0 && cpu->is_running);
+    return cycles;
+}
+
+static const decoded_fn_ptr decoded_table[256] = {
+    #define X(opcode, op, mode) [opcode] = _CPU_##op##_##mode##_decoded,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+};
+
+/* Runs the hook at the PC with the registers as they are, then returns from the routine like RTS does.
+ * Returns the cycles it took, 0 when there's no hook there or it passed, leaving the CPU as it was
+ */
+static inline u32 _CPU_run_hook(CPU* cpu) {
+    const Hook* hook = Hooks_find(cpu->hooks, cpu->r.PC);
+    u32 cycles = hook != NULL ? hook->fn(cpu, hook->context) : 0;
+    if (cycles == 0) {
+        return 0;
+    }
+    cpu->r.PC = _CPU_pull_from_stack(cpu);
+    cpu->r.PC |= _CPU_pull_from_stack(cpu) << 8;
+    cpu->r.PC++; // JSR pushed the address of its last byte
+    cpu->cycle = 0;
+    return cycles;
+}
+
+/* What a hooked address decodes to. A hook that passes runs the instruction after all */
+u32 _CPU_hook_decoded(CPU* cpu, const DecodedInstruction* decoded) {
+    cpu->r.PC--; // Back on the hooked address, _CPU_run_decoded went past the opcode
+    u32 cycles = _CPU_run_hook(cpu);
+    if (cycles == 0) {
+        cpu->r.PC++;
+        return decoded_table[decoded->opcode] ? decoded_table[decoded->opcode](cpu, decoded) : _CPU_staged_decoded(cpu, decoded);
+    }
+    return cycles;
+}
+
+/* Hooks for code that isn't decoded (the cache is off, it's outside of mapped memory, or CPU_emulate
+ * runs it), looked up at the fetch instead. Counted as one instruction like a decoded one, 0 if none ran
+ */
+static inline u32 _CPU_hook_uncached(CPU* cpu) {
+    if (cpu->hooks == NULL) {
+        return 0;
+    }
+    u32 cycles = _CPU_run_hook(cpu);
+    if (cycles != 0) {
+        cpu->instruction_count++;
+    }
+    return cycles;
+}
+
+/* Where decode_cache points while there's no cache: its one entry is never
+ * valid, so every lookup goes on to _CPU_decode. Only ever read
+ */
+static DecodedInstruction _CPU_no_decode_cache[1];
+
+/* Drops every decoded instruction that has a byte in this page, and lets writes go straight to it again */
+static void _CPU_invalidate_page(CPU* cpu, u8 page) {
+    u16 start = page << 8;
+    for (u16 offset = 0; offset < 0x100; offset++) {
+        u16 pc = start + offset;
+        DecodedInstruction* decoded = &cpu->decode_cache[pc & cpu->decode_mask];
+        if (decoded->tag == (pc | CPU_DECODE_VALID)) {
+            decoded->tag = 0;
         }
-        return;
-    } else if (cpu->cc == 2) {
-        // For ASL/ROL/LSR/ROR
-        switch (cpu->aaa) {
-            case 0: {
-                _CPU_ASL(cpu);
-                break;
-            }
-            case 1: {
-                _CPU_ROL(cpu);
-                break;
-            }
-            default:
-                goto SPECIAL_INSTRUCTIONS;
+    }
+    // The last 2 instructions of the previous page can have their operand in this one
+    for (u16 pc = start - 2; pc != start; pc++) {
+        DecodedInstruction* decoded = &cpu->decode_cache[pc & cpu->decode_mask];
+        if (decoded->tag == (pc | CPU_DECODE_VALID) && (pc & 0xFF) + decoded->length > 0x100) {
+            decoded->tag = 0;
         }
+    }
+    cpu->code_pages[page] = false;
+    cpu->write_pages[page] = cpu->ram_pages[page];
+}
+
+/* Same for every page mapped to the same RAM as this one (mirrors), since
+ * a write through any of them changes the code in all of them
+ */
+void _CPU_invalidate_code_page(CPU* cpu, u8 page) {
+    _CPU_invalidate_page(cpu, page);
+    u8* ram = cpu->ram_pages[page];
+    if (ram == NULL) {
         return;
     }
-    
-    SPECIAL_INSTRUCTIONS:
-    switch (cpu->r.IR) {
-        case 0xAA: { // TAX impl
-            _CPU_TAX(cpu);
-            break;
-        }
-        case 0x4C: { // JMP abs
-            _CPU_JMP_ABS(cpu);
-            break;
-        }
-        case 0x6C: { // JMP ind
-            _CPU_JMP_IND(cpu);
-            break;
-        }
-        case 0x20: { // JSR abs
-            _CPU_JSR(cpu);
-            break;
+    for (u16 alias = 0; alias < 0x100; alias++) {
+        if (cpu->ram_pages[alias] == ram && cpu->code_pages[alias]) {
+            _CPU_invalidate_page(cpu, alias);
         }
-        case 0x60: { // RTS impl
-            _CPU_RTS(cpu);
-            break;
-        }
-        case 0x10:   // BPL rel
-        case 0x30:   // BMI rel
-        case 0x50:   // BVC rel
-        case 0x70:   // BVS rel
-        case 0x90:   // BCC rel
-        case 0xB0:   // BCS rel
-        case 0xD0:   // BNE rel
-        case 0xF0: { // BEQ rel
-            _CPU_branch_logic(cpu);
-            break;
+    }
+}
+
+/* Turns direct writes off for a RAM page that now holds decoded code, at all its mirrors */
+static void _CPU_protect_code_page(CPU* cpu, u8 page) {
+    u8* ram = cpu->ram_pages[page];
+    for (u16 alias = 0; alias < 0x100; alias++) {
+        if (cpu->ram_pages[alias] == ram) {
+            cpu->code_pages[alias] = true;
+            cpu->write_pages[alias] = NULL;
         }
-        case 0x18:   // CLC impl
-        case 0x38:   // SEC impl
-        case 0x58:   // CLI impl
-        case 0x78:   // SEI impl
-        case 0xB8:   // CLV impl /* note: there is no SEV, it's a pin, SOB */
-        case 0xD8:   // CLD impl
-        case 0xF8: { // SED impl
-            _CPU_flags_logic(cpu);
-            break;
+    }
+}
+
+/* Decodes the instruction at pc into its cache entry. Returns NULL when it
+ * can't be cached: code outside of mapped memory is fetched every time,
+ * since reading it could have side effects.
+ */
+DecodedInstruction* _CPU_decode(CPU* cpu, u16 pc, DecodedInstruction* decoded) {
+    if (cpu->read_pages[pc >> 8] == NULL) {
+        return NULL;
+    }
+    if (cpu->decode_cache == _CPU_no_decode_cache) {
+        if (cpu->decode_size == 0) {
+            return NULL;
+        }
+        DecodedInstruction* cache = calloc(cpu->decode_size, sizeof(DecodedInstruction));
+        if (cache == NULL) {
+            cpu->decode_size = 0; // Slower without it, but it still runs
+            return NULL;
+        }
+        cpu->decode_cache = cache;
+        cpu->decode_mask = cpu->decode_size - 1;
+        decoded = &cache[pc & cpu->decode_mask];
+    }
+    u8 opcode = CPU_read(cpu, pc);
+    u8 length = opcode_length[opcode] ? opcode_length[opcode] : 1;
+    for (u8 i = 1; i < length; i++) {
+        if (cpu->read_pages[(u16)(pc + i) >> 8] == NULL) {
+            return NULL;
         }
-        case 0x08:   // PHP impl
-        case 0x28:   // PLP impl
-        case 0x48:   // PHA impl
-        case 0x68: { // PLA impl
-            _CPU_stack_manipulation(cpu);
-            break;
+    }
+
+    decoded->opcode     = opcode;
+    decoded->length     = length;
+    decoded->operand[0] = length > 1 ? CPU_read(cpu, pc + 1) : 0;
+    decoded->operand[1] = length > 2 ? CPU_read(cpu, pc + 2) : 0;
+    decoded->run        = decoded_table[opcode] ? decoded_table[opcode] : _CPU_staged_decoded;
+    decoded->label      = opcode;
+    if (cpu->hooks != NULL && Hooks_find(cpu->hooks, pc) != NULL) {
+        decoded->run   = _CPU_hook_decoded; // Looked up once here, so decoded code doesn't pay for hooks
+        decoded->label = CPU_DECODE_HOOK;
+    }
+    decoded->cycles     = opcode_base_cycles[opcode] ? opcode_base_cycles[opcode] : 1;
+    decoded->tag        = pc | CPU_DECODE_VALID;
+
+    // Writes to RAM holding this instruction have to invalidate it, through any mirror
+    for (u8 i = 0; i < length; i++) {
+        u8 page = (u16)(pc + i) >> 8;
+        if (cpu->ram_pages[page] != NULL && !cpu->code_pages[page]) {
+            _CPU_protect_code_page(cpu, page);
         }
-        case 0xA2:   // LDX #
-        case 0xA6:   // LDX zpg
-        case 0xAE: { // LDX abs
-            _CPU_LDX(cpu);
-            break;
+    }
+    return decoded;
+}
+
+static inline DecodedInstruction* _CPU_decoded(CPU* cpu, u16 pc) {
+    DecodedInstruction* decoded = &cpu->decode_cache[pc & cpu->decode_mask];
+    if (decoded->tag == (pc | CPU_DECODE_VALID)) {
+        return decoded;
+    }
+    return _CPU_decode(cpu, pc, decoded);
+}
+
+/* Runs a decoded instruction, starting with what _CPU_fetch would have done minus the bus access */
+static inline u32 _CPU_run_decoded(CPU* cpu, const DecodedInstruction* decoded) {
+    cpu->r.IR = decoded->opcode;
+    cpu->r.PC++;
+    cpu->cycle = 1;
+    cpu->instruction_count++;
+    cpu->found_address = false;
+    return decoded->run(cpu, decoded);
+}
+
+/* Writes that can't go straight to memory: I/O, ROM, and RAM pages holding decoded code */
+void _CPU_write_slow(CPU* cpu, u16 address, u8 data) {
+    u8* page = cpu->ram_pages[address >> 8];
+    if (page != NULL) {
+        _CPU_invalidate_code_page(cpu, address >> 8);
+        page[address & 0xFF] = data;
+        return;
+    }
+    cpu->write_fn(cpu->context, address, data);
+}
+
+/* Points page_count pages starting at first_page straight at host memory.
+ * memory is repeated every memory_size bytes, so mirrored RAM can be mapped
+ * in one call. Pages that are not writable keep sending writes to write_fn.
+ */
+void CPU_map_pages (CPU* cpu, u8 first_page, u16 page_count, u8* memory, u32 memory_size, bool writable) {
+    for (u16 i = 0; i < page_count && first_page + i < 0x100; i++) {
+        u8* page = memory + ((i << 8) % memory_size);
+        cpu->read_pages[first_page + i] = page;
+        cpu->ram_pages[first_page + i]  = writable ? page : NULL;
+        cpu->shared_pages[first_page + i] = false;
+        _CPU_invalidate_code_page(cpu, first_page + i);
+    }
+}
+
+/* Maps memory that other CPUs read too. It isn't written to, the first write
+ * to one of these pages goes to write_fn, which should map a copy of the page
+ * for this CPU with CPU_map_pages and do the write again.
+ */
+void CPU_map_shared_pages (CPU* cpu, u8 first_page, u16 page_count, const u8* memory, u32 memory_size) {
+    CPU_map_pages(cpu, first_page, page_count, (u8*)memory, memory_size, false); // Read-only, so the cast is harmless
+    for (u16 i = 0; i < page_count && first_page + i < 0x100; i++) {
+        cpu->shared_pages[first_page + i] = true;
+    }
+}
+
+/* Sends accesses to these pages back through read_fn/write_fn, for I/O */
+void CPU_unmap_pages (CPU* cpu, u8 first_page, u16 page_count) {
+    for (u16 i = 0; i < page_count && first_page + i < 0x100; i++) {
+        cpu->read_pages[first_page + i] = NULL;
+        cpu->ram_pages[first_page + i]  = NULL;
+        cpu->shared_pages[first_page + i] = false;
+        _CPU_invalidate_code_page(cpu, first_page + i);
+    }
+}
+
+void CPU_reset (CPU* cpu, read_fn_ptr read_fn, write_fn_ptr write_fn, void* context) {
+    DecodedInstruction* decode_cache = cpu->decode_cache;
+    u32 decode_mask = cpu->decode_mask;
+    u32 decode_size = cpu->decode_size;
+    memset(cpu, 0, sizeof(*cpu));
+    if (decode_cache == NULL) { // First reset
+        decode_cache = _CPU_no_decode_cache;
+        decode_size = CPU_DECODE_CACHE_SIZE;
+    } else if (decode_cache != _CPU_no_decode_cache) {
+        memset(decode_cache, 0, (decode_mask + 1) * sizeof(DecodedInstruction));
+    }
+    cpu->decode_cache = decode_cache;
+    cpu->decode_mask  = decode_mask;
+    cpu->decode_size  = decode_size;
+    if (read_fn != NULL) {
+        cpu->read_fn = read_fn;
+    }
+    if (write_fn != NULL) {
+        cpu->write_fn = write_fn;
+    }
+    cpu->context = context;
+    cpu->r.PC = 0xFFFC; cpu->r.SP = 0xEA; // It should be a random value, so I chose $EA "randomly"
+    CPU_set_P(cpu, FLAGS_IGN | FLAGS_IRE); // IRQs stay masked until the program is ready for them (CLI)
+    cpu->reset_delay = 7;
+    cpu->is_running = true;
+}
+/* Opcode fetch, the first cycle of every instruction */
+void _CPU_fetch(CPU* cpu) {
+    cpu->r.IR = CPU_read(cpu, cpu->r.PC);
+    cpu->r.PC++;
+    cpu->cycle++;
+    cpu->instruction_count++;
+    cpu->found_address = false;
+    cpu->execute = opcode_table[cpu->r.IR];
+    if (cpu->execute == NULL) {
+        cpu->execute = _CPU_illegal;
+    }
+}
+
+/* Takes the place of _CPU_fetch when CPU_interrupt_due, NMI first. Not counted as an instruction */
+static void _CPU_begin_interrupt(CPU* cpu) {
+    if (cpu->nmi_pending) {
+        cpu->nmi_pending = false;
+        cpu->interrupt = CPU_INTERRUPT_NMI;
+    } else {
+        cpu->interrupt = CPU_INTERRUPT_IRQ;
+    }
+    cpu->r.IR = 0x00;
+    cpu->cycle = 1;
+    cpu->found_address = false;
+    cpu->execute = _CPU_interrupt;
+}
+
+/* Called at cycle 0 while waiting is set: false while the CPU stays parked (the cycle passes doing nothing),
+ * true once an interrupt line woke it up and it goes on as usual
+ */
+static inline bool _CPU_wake(CPU* cpu) {
+    if (CPU_is_waiting(cpu)) {
+        return false;
+    }
+    cpu->waiting = false;
+    return true;
+}
+
+/* This function executes 1 clock cycle of the CPU */
+void CPU_emulate (CPU* cpu) {
+    if (cpu->trace != NULL && cpu->cycle == 0 && cpu->reset_delay == 0xFF && !CPU_interrupt_due(cpu) && !CPU_is_waiting(cpu)) {
+        Trace_instruction(cpu->trace, cpu, cpu->cycle_count);
+    }
+    cpu->cycle_count++;
+    switch (cpu->reset_delay) {
+        case 1: {
+            // Fetch PC low byte
+            cpu->r.PC = CPU_read(cpu, 0xFFFC);
+            cpu->reset_delay--;
+            return;
         }
-        case 0x86:   // STX zpg
-        case 0x8E:   // STX abs
-        case 0x96: { // STX zpg,Y
-            _CPU_STX(cpu);
-            break;
+        case 0: {
+            // Fetch PC high byte
+            cpu->r.PC |= (CPU_read(cpu, 0xFFFD) << 8);
+            cpu->reset_delay = 0xFF;
+            cpu->cycle = 0;
+            return;
         }
-        case 0xA0:   // LDY #
-        case 0xA4:   // LDY zpg
-        case 0xAC: { // LDY abs
-            _CPU_LDY(cpu);
-            break;
+        default: {
+            cpu->reset_delay--;
+            return;
         }
-        case 0x84:   // STY zpg
-        case 0x8C:   // STY abs
-        case 0x94: { // STY zpg,X
-            _CPU_STY(cpu);
-            break;
+        case 0xFF: {
+            break; // Should fall through
         }
-        case 0xE8: { // INX impl
-            CPU_set_NZ(cpu, ++cpu->r.X);
-            cpu->cycle = 0;
-            break;
+    }
+    if (cpu->cycle == 0) {
+        if (cpu->waiting && !_CPU_wake(cpu)) {
+            return;
         }
-        case 0xCA: { // DEX impl
-            CPU_set_NZ(cpu, --cpu->r.X);
-            cpu->cycle = 0;
-            break;
+        if (CPU_interrupt_due(cpu)) {
+            _CPU_begin_interrupt(cpu);
+        } else {
+            u32 hooked = _CPU_hook_uncached(cpu);
+            if (hooked != 0) {
+                cpu->cycle_count += hooked - 1; // All of it in this call, it has no cycles of its own to go through
+                return;
+            }
+            _CPU_fetch(cpu);
         }
-        case 0xC8: { // INY impl
-            CPU_set_NZ(cpu, ++cpu->r.Y);
-            cpu->cycle = 0;
-            break;
+        return;
+    }
+    cpu->execute(cpu);
+}
+
+/* This function executes a whole instruction (or what's left of it) and
+ * returns how many cycles it took. Bus timing inside the instruction is
+ * not observable from outside, but the cycle count is the same as calling
+ * CPU_emulate() until the instruction completes.
+ * A pending reset sequence counts as one instruction. A CPU parked by WAI
+ * waits one cycle per call, without counting an instruction.
+ */
+static inline u32 _CPU_step(CPU* cpu) {
+    u32 cycles = 0;
+    if (cpu->reset_delay != 0xFF) {
+        // The reset sequence has no side effects other than loading the vector
+        cycles = cpu->reset_delay ? cpu->reset_delay + 1 : 1;
+        if (cpu->reset_delay) {
+            cpu->r.PC = CPU_read(cpu, 0xFFFC);
+        }
+        cpu->r.PC |= (CPU_read(cpu, 0xFFFD) << 8);
+        cpu->reset_delay = 0xFF;
+        cpu->cycle = 0;
+        cpu->cycle_count += cycles;
+        return cycles;
+    }
+    if (cpu->cycle == 0) {
+        if (cpu->waiting && !_CPU_wake(cpu)) {
+            cpu->cycle_count++;
+            return 1;
         }
-        case 0x88: { // DEY impl
-            CPU_set_NZ(cpu, --cpu->r.Y);
-            cpu->cycle = 0;
-            break;
+        if (CPU_interrupt_due(cpu)) {
+            _CPU_begin_interrupt(cpu);
+        } else {
+            if (cpu->trace != NULL) {
+                Trace_instruction(cpu->trace, cpu, cpu->cycle_count);
+            }
+            DecodedInstruction* decoded = _CPU_decoded(cpu, cpu->r.PC);
+            if (decoded != NULL) {
+                cycles = _CPU_run_decoded(cpu, decoded);
+                cpu->cycle_count += cycles;
+                return cycles;
+            }
+            if ((cycles = _CPU_hook_uncached(cpu)) != 0) {
+                cpu->cycle_count += cycles;
+                return cycles;
+            }
+            _CPU_fetch(cpu);
         }
+        cycles++;
+    }
+    do {
+        cpu->execute(cpu);
+        cycles++;
+    } while (cpu->cycle != 0 && cpu->is_running);
+    cpu->cycle_count += cycles;
+    return cycles;
+}
+
+u32 CPU_step_instruction (CPU* cpu) {
+    return _CPU_step(cpu);
+}
+
+/* Runs up to instruction_count instructions, returns the number of cycles taken */
+u64 CPU_run_instructions (CPU* cpu, u64 instruction_count) {
+    u64 cycles = 0;
+    while (instruction_count-- && cpu->is_running) {
+        cycles += _CPU_step(cpu);
+    }
+    return cycles;
+}
+
+/* Runs whole instructions until cycle_budget cycles have passed, the CPU stops
+ * or a stop is requested. The last instruction is always completed, so the
+ * returned cycle count can go over the budget by a few cycles; callers pacing
+ * themselves should carry that over into the next budget.
+ *
+ * Two interchangeable cores implement it, picked at build time:
+ * the portable one below calls through opcode_table, the threaded one
+ * (CPU_THREADED_CORE, needs GCC/Clang labels as values) gives every opcode
+ * its own label that ends by jumping straight to the next opcode's label.
+ */
+#ifndef CPU_THREADED_CORE
+RunResult CPU_run (CPU* cpu, u64 cycle_budget) {
+    RunResult result = {0, STOP_NONE};
+    while (cpu->is_running) {
+        if (CPU_take_stop_request(cpu)) {
+            result.reason = STOP_REQUESTED;
+            return result;
+        }
+        if (result.cycles >= cycle_budget) {
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        if (CPU_is_waiting(cpu)) { // Nothing in here can wake it
+            cpu->cycle_count += cycle_budget - result.cycles;
+            result.cycles = cycle_budget;
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        result.cycles += _CPU_step(cpu);
+    }
+    result.reason = cpu->stop_reason;
+    return result;
+}
+#else
+#if !defined(__GNUC__)
+    #error "CPU_THREADED_CORE needs a compiler with labels as values (GCC or Clang)"
+#endif
+RunResult CPU_run (CPU* cpu, u64 cycle_budget) {
+    /* Filled in at compile time, so threads running CPU_run at the same time
+     * only ever read it. Listed opcodes override the op_illegal default,
+     * hooked addresses decode to a label of their own past the opcodes
+     */
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Woverride-init"
+    #define X(opcode, ...) [opcode] = &&op_##opcode,
+    static void* const dispatch[CPU_DECODE_HOOK + 1] = {
+        [0 ... 255] = &&op_illegal,
+        CPU_ADDRESSED_OPCODES(X)
+        CPU_OTHER_OPCODES(X)
         #ifdef _EMULATE_W65C02S
-        case 0x1A: { // INC A
-            CPU_set_NZ(cpu, ++cpu->r.A);
-            cpu->cycle = 0;
-            break;
-        }
-        case 0x3A: { // DEC A
-            CPU_set_NZ(cpu, --cpu->r.A);
-            cpu->cycle = 0;
-            break;
-        }
+        CPU_W65C02S_OPCODES(X)
         #endif
-        case 0xE0:   // CPX #
-        case 0xE4:   // CPX zpg
-        case 0xEC: { // CPX abs
-            _CPU_CPX(cpu);
-            break;
-        }
-        case 0xC0:   // CPY #
-        case 0xC4:   // CPY zpg
-        case 0xCC: { // CPY abs
-            _CPU_CPY(cpu);
-            break;
-        }
-        case 0x24:   // BIT zpg
-        case 0x2C: { // BIT abs
-            _CPU_BIT(cpu);
-            break;
-        }
-        case 0xEA: { // NOP impl
-            // We must do nothing for 1+1 cycles (fetch opcode + do nothing)
-            cpu->cycle = 0;
-            break;
-        }
-        case 0x02: { // DBP (debug print)
-            printf("A=%02X   X=%02X    Y=%02X    P=%08B    IR=%02X    SP=%02X    PC=%04X    IC=%08X\n", \
-                   cpu->r.A, cpu->r.X, cpu->r.Y, cpu->r.P, cpu->r.IR, cpu->r.SP, cpu->r.PC, cpu->instruction_count);
-            cpu->cycle = 0;
-            break;
-        }
-        case 0x00: { // BRK
-            cpu->is_running = false;
-            break;
-        }
-        default: {
-            printf("Illegal instruction $%02X at $%04X\n", cpu->r.IR, cpu->r.PC);
-            cpu->is_running = false;
-            break;
-        }
+        [CPU_DECODE_HOOK] = &&hook,
+    };
+    #undef X
+    #pragma GCC diagnostic pop
+
+    RunResult result = {0, STOP_NONE};
+    u64 start = cpu->cycle_count; // Counted as it goes, so device callbacks see how far it got
+    DecodedInstruction* decoded;
+
+    // Finish a pending reset or a half-done instruction left by CPU_emulate first
+    if (cpu->is_running && (cpu->reset_delay != 0xFF || cpu->cycle != 0)) {
+        _CPU_step(cpu);
+    }
+
+    /* Checks whether to stop, then fetches the next opcode (from the decode cache
+     * when possible) and jumps to it. Every label has its own copy of this, so each
+     * one gets its own indirect branch.
+     */
+    #define THREADED_DISPATCH()                                 \
+        do {                                                    \
+            if (!cpu->is_running) goto stopped;                 \
+            if (CPU_take_stop_request(cpu)) goto requested;     \
+            if (cpu->cycle_count - start >= cycle_budget) goto budget; \
+            if (CPU_interrupt_due(cpu) || cpu->waiting) goto interrupt; \
+            decoded = _CPU_decoded(cpu, cpu->r.PC);             \
+            if (decoded == NULL && cpu->hooks != NULL) goto uncached; \
+            if (cpu->trace != NULL) Trace_instruction(cpu->trace, cpu, cpu->cycle_count); \
+            cpu->r.IR = decoded != NULL ? decoded->opcode : CPU_read(cpu, cpu->r.PC); \
+            cpu->r.PC++;                                        \
+            cpu->cycle = 1;                                     \
+            cpu->instruction_count++;                           \
+            cpu->found_address = false;                         \
+            goto *dispatch[decoded != NULL ? decoded->label : cpu->r.IR]; \
+        } while (0)
+
+    /* Runs the fetch cycle and the remaining cycles of the instruction in one go */
+    #define THREADED_EXECUTE(handler)                           \
+        cpu->cycle_count++;                                     \
+        do {                                                    \
+            handler(cpu);                                       \
+            cpu->cycle_count++;                                 \
+        } while (cpu->cycle != 0 && cpu->is_running);           \
+        THREADED_DISPATCH();
+
+    /* Addressed opcodes take their operand from the decoded instruction when there is one */
+    #define THREADED_EXECUTE_ADDRESSED(handler, decoded_handler) \
+        if (decoded != NULL) {                                  \
+            cpu->cycle_count += decoded_handler(cpu, decoded);  \
+            THREADED_DISPATCH();                                \
+        }                                                       \
+        THREADED_EXECUTE(handler)
+
+    THREADED_DISPATCH();
+
+    #define X(opcode, op, mode) op_##opcode: THREADED_EXECUTE_ADDRESSED(_CPU_##op##_##mode, _CPU_##op##_##mode##_decoded)
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) op_##opcode: THREADED_EXECUTE(handler)
+    CPU_OTHER_OPCODES(X)
+    #ifdef _EMULATE_W65C02S
+    CPU_W65C02S_OPCODES(X)
+    #endif
+    #undef X
+    op_illegal: THREADED_EXECUTE(_CPU_illegal)
+    hook:
+        cpu->cycle_count += _CPU_hook_decoded(cpu, decoded); // Fetched like any other
+        THREADED_DISPATCH();
+    uncached: // Code that isn't decoded could be hooked too, _CPU_step looks
+        _CPU_step(cpu);
+        THREADED_DISPATCH();
+    interrupt:
+        if (cpu->waiting) {
+            if (!_CPU_wake(cpu)) {
+                cpu->cycle_count = start + cycle_budget; // Parked for the rest of the budget
+                goto budget;
+            }
+            if (!CPU_interrupt_due(cpu)) {
+                THREADED_DISPATCH(); // Woken by a masked IRQ
+            }
+        }
+        _CPU_begin_interrupt(cpu);
+        THREADED_EXECUTE(_CPU_interrupt)
+
+    #undef THREADED_EXECUTE_ADDRESSED
+    #undef THREADED_EXECUTE
+    #undef THREADED_DISPATCH
+
+    stopped:
+        result.reason = cpu->stop_reason;
+        goto done;
+    requested:
+        result.reason = STOP_REQUESTED;
+        goto done;
+    budget:
+        result.reason = STOP_BUDGET;
+    done:
+        result.cycles = cpu->cycle_count - start;
+        return result;
+}
+#endif /* CPU_THREADED_CORE */
+
+/* Makes the current (or next) CPU_run return early. A lock-free atomic store,
+ * so it's safe to call from a signal handler or another thread
+ */
+void CPU_request_stop (CPU* cpu) {
+    __atomic_store_n(&cpu->stop_requested, true, __ATOMIC_RELEASE);
+}
+
+void CPU_set_irq (CPU* cpu, u8 line, bool asserted) {
+    if (asserted) {
+        cpu->irq_lines |= line;
+    } else {
+        cpu->irq_lines &= ~line;
     }
-    
-}
\ No newline at end of file
+}
+
+void CPU_trigger_nmi (CPU* cpu) {
+    cpu->nmi_pending = true;
+}
+
+void CPU_set_decode_cache (CPU* cpu, u32 entries) {
+    if (cpu->decode_cache != _CPU_no_decode_cache) {
+        free(cpu->decode_cache);
+    }
+    cpu->decode_cache = _CPU_no_decode_cache;
+    cpu->decode_mask = 0;
+    cpu->decode_size = entries;
+    // The decoded code went with it, so writes can go straight to RAM again
+    for (u16 page = 0; page < 0x100; page++) {
+        cpu->code_pages[page] = false;
+        cpu->write_pages[page] = cpu->ram_pages[page];
+    }
+}
+
+u32 CPU_get_decode_cache_entries (CPU* cpu) {
+    return cpu->decode_cache != _CPU_no_decode_cache ? cpu->decode_mask + 1 : 0;
+}
+
+void CPU_set_hooks (CPU* cpu, struct Hooks_s* hooks) {
+    cpu->hooks = hooks;
+    for (u16 page = 0; page < 0x100; page++) {
+        _CPU_invalidate_code_page(cpu, page);
+    }
+}
+
+CPUState CPU_save_state (CPU* cpu) {
+    CPUState state = {
+        .r                 = cpu->r,
+        .cycle             = cpu->cycle,
+        .is_running        = cpu->is_running,
+        .stop_reason       = cpu->stop_reason,
+        .instruction_count = cpu->instruction_count,
+        .cycle_count       = cpu->cycle_count,
+        .flag_n_source     = cpu->flag_n_source,
+        .flag_z_source     = cpu->flag_z_source,
+        .offset            = cpu->offset,
+        .reset_delay       = cpu->reset_delay,
+        .compare_operand   = cpu->compare_operand,
+        .access_address    = cpu->access_address,
+        .indirect_address  = cpu->indirect_address,
+        .old_pc            = cpu->old_pc,
+        .found_address     = cpu->found_address,
+        .irq_lines         = cpu->irq_lines,
+        .nmi_pending       = cpu->nmi_pending,
+        .interrupt         = cpu->interrupt,
+        .waiting           = cpu->waiting,
+    };
+    return state;
+}
+
+/* Mid-instruction states resume where they were, execute is picked again from IR like _CPU_fetch does
+ * (or is the interrupt sequence, when one was running)
+ */
+void CPU_load_state (CPU* cpu, const CPUState* state) {
+    cpu->r                 = state->r;
+    cpu->cycle             = state->cycle;
+    cpu->is_running        = state->is_running;
+    cpu->stop_reason       = state->stop_reason;
+    cpu->instruction_count = state->instruction_count;
+    cpu->cycle_count       = state->cycle_count;
+    cpu->flag_n_source     = state->flag_n_source;
+    cpu->flag_z_source     = state->flag_z_source;
+    cpu->offset            = state->offset;
+    cpu->reset_delay       = state->reset_delay;
+    cpu->compare_operand   = state->compare_operand;
+    cpu->access_address    = state->access_address;
+    cpu->indirect_address  = state->indirect_address;
+    cpu->old_pc            = state->old_pc;
+    cpu->found_address     = state->found_address;
+    cpu->irq_lines         = state->irq_lines;
+    cpu->nmi_pending       = state->nmi_pending;
+    cpu->interrupt         = state->interrupt;
+    cpu->waiting           = state->waiting;
+    cpu->execute = opcode_table[cpu->r.IR];
+    if (cpu->interrupt != CPU_INTERRUPT_NONE) {
+        cpu->execute = _CPU_interrupt;
+    } else if (cpu->execute == NULL) {
+        cpu->execute = _CPU_illegal;
+    }
+}
@@ -0,0 +1,251 @@
+#define _DEFAULT_SOURCE // sysconf, clock_gettime
+#include "farm.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A worker's queue of machines waiting for a slice.
+ * The owner takes from the front and puts back at the end, so its machines get
+ * slices round-robin. Thieves take from the end, away from where the owner works.
+ * Queues are short and only touched once per slice, a mutex is plenty.
+ */
+typedef struct FarmQueue_s {
+    pthread_mutex_t lock;
+    Machine** slots;  /* Ring buffer, room for every machine in the farm */
+    u32 head;
+    u32 count;
+} FarmQueue;
+
+typedef struct FarmWorker_s {
+    Farm* farm;
+    u32   index;
+    pthread_t thread;
+    FarmQueue queue;
+    FarmWorkerStats stats;
+} FarmWorker;
+
+struct Farm_s {
+    u32 worker_count;
+    u64 slice_cycles;
+    u64 cycle_limit;
+
+    Machine** machines;
+    u32 machine_count;
+    u32 machine_capacity;
+
+    FarmWorker* workers;
+    u32 live_machines;    /* Atomic, machines that haven't left yet */
+    bool stop_requested;  /* Atomic */
+    u64 wall_ns;
+};
+
+static u64 _Farm_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void _Farm_push(FarmQueue* queue, u32 capacity, Machine* machine) {
+    pthread_mutex_lock(&queue->lock);
+    queue->slots[(queue->head + queue->count) % capacity] = machine;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static Machine* _Farm_pop_front(FarmQueue* queue, u32 capacity) {
+    Machine* machine = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        machine = queue->slots[queue->head];
+        queue->head = (queue->head + 1) % capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return machine;
+}
+
+static Machine* _Farm_steal(FarmQueue* queue, u32 capacity) {
+    Machine* machine = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        queue->count--;
+        machine = queue->slots[(queue->head + queue->count) % capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return machine;
+}
+
+static bool _Farm_machine_done(Farm* farm, Machine* machine) {
+    if (!machine->cpu.is_running) {
+        return true;
+    }
+    return farm->cycle_limit != 0 && machine->cpu.cycle_count >= farm->cycle_limit;
+}
+
+static void* _Farm_worker(void* arg) {
+    FarmWorker* worker = arg;
+    Farm* farm = worker->farm;
+    u32 capacity = farm->machine_count;
+    u32 victim = worker->index;
+
+    while (!__atomic_load_n(&farm->stop_requested, __ATOMIC_ACQUIRE) && __atomic_load_n(&farm->live_machines, __ATOMIC_ACQUIRE) > 0) {
+        Machine* machine = _Farm_pop_front(&worker->queue, capacity);
+        if (machine == NULL) {
+            // Look around the other queues once, starting after the last one that had work
+            for (u32 i = 1; i < farm->worker_count && machine == NULL; i++) {
+                victim = (victim + 1) % farm->worker_count;
+                if (victim != worker->index) {
+                    machine = _Farm_steal(&farm->workers[victim].queue, capacity);
+                }
+            }
+            if (machine == NULL) {
+                // Everything left is being run by someone else right now
+                struct timespec backoff = {0, 50000};
+                nanosleep(&backoff, NULL);
+                continue;
+            }
+            worker->stats.steals++;
+        }
+
+        u64 budget = farm->slice_cycles;
+        if (farm->cycle_limit != 0 && farm->cycle_limit - machine->cpu.cycle_count < budget) {
+            budget = farm->cycle_limit - machine->cpu.cycle_count;
+        }
+        u64 start = _Farm_now_ns();
+        RunResult result = Machine_run(machine, budget);
+        worker->stats.busy_ns += _Farm_now_ns() - start;
+        worker->stats.cycles += result.cycles;
+        worker->stats.slices++;
+
+        if (_Farm_machine_done(farm, machine)) {
+            __atomic_sub_fetch(&farm->live_machines, 1, __ATOMIC_RELEASE);
+        } else {
+            _Farm_push(&worker->queue, capacity, machine);
+        }
+    }
+    return NULL;
+}
+
+Farm* Farm_create(u32 worker_count, u64 slice_cycles, u64 cycle_limit) {
+    if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 0 ? (u32)cores : 1;
+    }
+    Farm* farm = calloc(1, sizeof(Farm));
+    if (farm == NULL) {
+        return NULL;
+    }
+    farm->worker_count = worker_count;
+    farm->slice_cycles = slice_cycles != 0 ? slice_cycles : FARM_DEFAULT_SLICE_CYCLES;
+    farm->cycle_limit  = cycle_limit;
+    farm->workers = calloc(worker_count, sizeof(FarmWorker));
+    if (farm->workers == NULL) {
+        free(farm);
+        return NULL;
+    }
+    return farm;
+}
+
+void Farm_destroy(Farm* farm) {
+    if (farm == NULL) {
+        return;
+    }
+    free(farm->machines);
+    free(farm->workers);
+    free(farm);
+}
+
+bool Farm_add(Farm* farm, Machine* machine) {
+    if (farm->machine_count == farm->machine_capacity) {
+        u32 capacity = farm->machine_capacity ? farm->machine_capacity * 2 : 16;
+        Machine** machines = realloc(farm->machines, capacity * sizeof(Machine*));
+        if (machines == NULL) {
+            return false;
+        }
+        farm->machines = machines;
+        farm->machine_capacity = capacity;
+    }
+    farm->machines[farm->machine_count++] = machine;
+    return true;
+}
+
+void Farm_run(Farm* farm) {
+    u32 capacity = farm->machine_count;
+    __atomic_store_n(&farm->stop_requested, false, __ATOMIC_RELAXED);
+    farm->live_machines = 0;
+
+    // Deal the machines out evenly, the stealing sorts out whatever imbalance shows up later
+    for (u32 w = 0; w < farm->worker_count; w++) {
+        FarmWorker* worker = &farm->workers[w];
+        worker->farm  = farm;
+        worker->index = w;
+        memset(&worker->stats, 0, sizeof(worker->stats));
+        worker->queue.slots = calloc(capacity ? capacity : 1, sizeof(Machine*));
+        worker->queue.head  = 0;
+        worker->queue.count = 0;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+    }
+    for (u32 i = 0; i < farm->machine_count; i++) {
+        if (!_Farm_machine_done(farm, farm->machines[i])) {
+            _Farm_push(&farm->workers[i % farm->worker_count].queue, capacity, farm->machines[i]);
+            farm->live_machines++;
+        }
+    }
+
+    u64 start = _Farm_now_ns();
+    u32 started = 0;
+    for (u32 w = 0; w < farm->worker_count; w++) {
+        if (pthread_create(&farm->workers[w].thread, NULL, _Farm_worker, &farm->workers[w]) != 0) {
+            break; // The queues of workers that didn't start get stolen from
+        }
+        started++;
+    }
+    if (started == 0) {
+        _Farm_worker(&farm->workers[0]); // Couldn't get any threads, run them here
+    }
+    for (u32 w = 0; w < started; w++) {
+        pthread_join(farm->workers[w].thread, NULL);
+    }
+    farm->wall_ns = _Farm_now_ns() - start;
+
+    for (u32 w = 0; w < farm->worker_count; w++) {
+        pthread_mutex_destroy(&farm->workers[w].queue.lock);
+        free(farm->workers[w].queue.slots);
+        farm->workers[w].queue.slots = NULL;
+    }
+}
+
+void Farm_stop(Farm* farm) {
+    __atomic_store_n(&farm->stop_requested, true, __ATOMIC_RELEASE);
+}
+
+FarmStats Farm_get_stats(Farm* farm) {
+    FarmStats stats = {0};
+    stats.worker_count  = farm->worker_count;
+    stats.machine_count = farm->machine_count;
+    stats.wall_ns       = farm->wall_ns;
+    for (u32 w = 0; w < farm->worker_count; w++) {
+        stats.cycles += farm->workers[w].stats.cycles;
+    }
+    if (stats.wall_ns != 0) {
+        stats.mhz = (double)stats.cycles * 1000.0 / (double)stats.wall_ns;
+        stats.mhz_per_core = stats.mhz / stats.worker_count;
+    }
+    return stats;
+}
+
+const FarmWorkerStats* Farm_get_worker_stats(Farm* farm, u32 worker) {
+    return worker < farm->worker_count ? &farm->workers[worker].stats : NULL;
+}
+
+void Farm_print_stats(Farm* farm, FILE* out) {
+    FarmStats stats = Farm_get_stats(farm);
+    fprintf(out, "%u machines on %u workers, %llu cycles in %.3fs: %.2f MHz total, %.2f MHz per core\n",
+            stats.machine_count, stats.worker_count, stats.cycles, stats.wall_ns / 1e9, stats.mhz, stats.mhz_per_core);
+    for (u32 w = 0; w < farm->worker_count; w++) {
+        const FarmWorkerStats* worker = &farm->workers[w].stats;
+        double busy_mhz = worker->busy_ns ? (double)worker->cycles * 1000.0 / (double)worker->busy_ns : 0.0;
+        fprintf(out, "    worker %2u: %12llu cycles %8llu slices %6llu steals, %.2f MHz while busy\n",
+                w, worker->cycles, worker->slices, worker->steals, busy_mhz);
+    }
+}
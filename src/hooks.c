@@ -0,0 +1,53 @@
+#include "hooks.h"
+#include "profile.h"
+#include <errno.h>
+
+Hooks* Hooks_create(void) {
+    return calloc(1, sizeof(Hooks));
+}
+
+void Hooks_destroy(Hooks* hooks) {
+    free(hooks);
+}
+
+bool Hooks_add(Hooks* hooks, u16 pc, hook_fn_ptr fn, void* context) {
+    Hook* hook = NULL;
+    for (u32 i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].pc == pc) {
+            hook = &hooks->hooks[i];
+        }
+    }
+    if (hook == NULL) {
+        if (hooks->count == HOOKS_MAX) {
+            return false;
+        }
+        hook = &hooks->hooks[hooks->count++];
+    }
+    *hook = (Hook){pc, fn, context};
+    hooks->pages[pc >> 8] = true;
+    return true;
+}
+
+/* Labels are read the same way the profiler reads them */
+bool Hooks_add_symbol(Hooks* hooks, const char* listing_path, const char* name, hook_fn_ptr fn, void* context) {
+    FILE* file = fopen(listing_path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        u16 address;
+        char label[PROFILE_SYMBOL_LENGTH];
+        if (Profile_parse_label(line, &address, label) && strcmp(label, name) == 0) {
+            fclose(file);
+            if (!Hooks_add(hooks, address, fn, context)) {
+                errno = ENOSPC;
+                return false;
+            }
+            return true;
+        }
+    }
+    fclose(file);
+    errno = ENOENT;
+    return false;
+}
@@ -0,0 +1,941 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include "jit.h"
+#include "hooks.h"
+#define _EMULATE_W65C02S // Same opcode set as cpu.c
+#include "opcodes.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE              0x400000 /* Bytes of host code, everything gets flushed when it runs out */
+#define JIT_MAX_BLOCKS             0x4000
+#define JIT_MAX_BLOCK_INSTRUCTIONS 32
+#define JIT_MAX_BLOCK_CODE         0x4000   /* Worst case for one block, way over what 32 instructions take */
+#define JIT_HOT_THRESHOLD          32       /* Times the interpreter gets to a PC before it is compiled */
+#define JIT_NEVER                  0xFF     /* Heat of a PC that can't start a block */
+
+#define CPU_FIELD(field) ((u32)offsetof(CPU, field))
+
+/* Host registers, in x86 encoding order */
+enum {
+    HOST_RAX, HOST_RCX, HOST_RDX, HOST_RBX, HOST_RSP, HOST_RBP, HOST_RSI, HOST_RDI,
+    HOST_R8,  HOST_R9,  HOST_R10, HOST_R11, HOST_R12, HOST_R13, HOST_R14, HOST_R15
+};
+
+/* Register use inside compiled code.
+ * All of them are callee-saved, so they survive calls back into C.
+ * RAX, RCX, RDX, RSI and RDI are scratch.
+ */
+#define JIT_CPU    HOST_RBX /* CPU* */
+#define JIT_BUDGET HOST_RBP /* Cycles left, signed */
+#define JIT_A      HOST_R12
+#define JIT_X      HOST_R13
+#define JIT_Y      HOST_R14
+#define JIT_SP     HOST_R15
+
+/* x86 condition codes */
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xC
+
+typedef struct JITBlock_s {
+    void* code;      /* Has to stay first, the RTS lookup loads it without an offset */
+    void* exits[2];  /* Code each fixed exit jumps to, NULL returns to JIT_run instead */
+    u16 pc;
+    u16 cycles;      /* All instructions here take a fixed number of cycles */
+} JITBlock;
+
+typedef void** (*jit_enter_fn_ptr)(CPU* cpu, void* code, i64* budget);
+
+struct JIT_s {
+    CPU* cpu;
+    u8*  code;
+    u32  code_used;
+    u32  generation;       /* Bumped by every flush, so stale exits don't get linked */
+    jit_enter_fn_ptr enter; /* Loads the registers and jumps into a block */
+    u32  exit_stub;        /* Offset of the code that stores the registers back and returns */
+    u32  blocks_start;     /* Blocks go after the trampoline */
+    u32  block_count;
+    JITBlock* blocks[0x10000];
+    JITBlock  pool[JIT_MAX_BLOCKS];
+    u8   heat[0x10000];
+};
+
+/* An addressed instruction's operand, as the compiler sees it.
+ * ZPG and ABS have a fixed address, ABS_Y and X_IND have theirs worked out into ESI at run time.
+ */
+typedef struct JITOperand_s {
+    u8  mode;
+    u16 address;
+    u8  value;   /* IMM */
+} JITOperand;
+
+/* Called from compiled code for reads that aren't plain memory */
+static u8 _JIT_read_slow(CPU* cpu, u16 address) {
+    return cpu->read_fn(cpu->context, address);
+}
+
+/* Host code emission */
+static void _JIT_emit8(JIT* jit, u8 value) {
+    jit->code[jit->code_used++] = value;
+}
+
+static void _JIT_emit16(JIT* jit, u16 value) {
+    memcpy(jit->code + jit->code_used, &value, 2);
+    jit->code_used += 2;
+}
+
+static void _JIT_emit32(JIT* jit, u32 value) {
+    memcpy(jit->code + jit->code_used, &value, 4);
+    jit->code_used += 4;
+}
+
+static void _JIT_emit64(JIT* jit, u64 value) {
+    memcpy(jit->code + jit->code_used, &value, 8);
+    jit->code_used += 8;
+}
+
+static void _JIT_emit_bytes(JIT* jit, const u8* bytes, u32 count) {
+    memcpy(jit->code + jit->code_used, bytes, count);
+    jit->code_used += count;
+}
+#define JIT_BYTES(jit, ...) _JIT_emit_bytes(jit, (const u8[]){__VA_ARGS__}, sizeof((const u8[]){__VA_ARGS__}))
+
+/* REX prefix, left out when it isn't needed. byte_regs forces it so 4-7 mean SPL-DIL instead of AH-BH */
+static void _JIT_rex(JIT* jit, bool wide, u8 reg, u8 rm, bool byte_regs) {
+    u8 rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (rex != 0x40 || byte_regs) {
+        _JIT_emit8(jit, rex);
+    }
+}
+
+static bool _JIT_is_byte_reg_high(u8 reg) {
+    return reg >= HOST_RSP && reg <= HOST_RDI;
+}
+
+static void _JIT_modrm(JIT* jit, u8 mod, u8 reg, u8 rm) {
+    _JIT_emit8(jit, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op r/m8, r8 (mov 0x88, add 0x00, or 0x08, and 0x20, sub 0x28, xor 0x30, cmp 0x38) */
+static void _JIT_rr8(JIT* jit, u8 op, u8 dst, u8 src) {
+    _JIT_rex(jit, false, src, dst, _JIT_is_byte_reg_high(src) || _JIT_is_byte_reg_high(dst));
+    _JIT_emit8(jit, op);
+    _JIT_modrm(jit, 3, src, dst);
+}
+
+/* op r/m32, r32 or op r/m64, r64 (mov 0x89, or 0x09, test 0x85) */
+static void _JIT_rr(JIT* jit, bool wide, u8 op, u8 dst, u8 src) {
+    _JIT_rex(jit, wide, src, dst, false);
+    _JIT_emit8(jit, op);
+    _JIT_modrm(jit, 3, src, dst);
+}
+
+/* op [cpu + field], r8 or op r8, [cpu + field] (store 0x88, load 0x8A, or 0x08) */
+static void _JIT_field8(JIT* jit, u8 op, u8 reg, u32 field) {
+    _JIT_rex(jit, false, reg, JIT_CPU, _JIT_is_byte_reg_high(reg));
+    _JIT_emit8(jit, op);
+    _JIT_modrm(jit, 2, reg, JIT_CPU);
+    _JIT_emit32(jit, field);
+}
+
+/* op byte [cpu + field], imm8 (0x80 with and 4, or 1, cmp 7; 0xF6 with test 0) */
+static void _JIT_field8_imm(JIT* jit, u8 op, u8 extension, u32 field, u8 value) {
+    _JIT_emit8(jit, op);
+    _JIT_modrm(jit, 2, extension, JIT_CPU);
+    _JIT_emit32(jit, field);
+    _JIT_emit8(jit, value);
+}
+
+/* movzx r32, byte [cpu + field] */
+static void _JIT_field8_zx(JIT* jit, u8 reg, u32 field) {
+    _JIT_rex(jit, false, reg, JIT_CPU, false);
+    JIT_BYTES(jit, 0x0F, 0xB6);
+    _JIT_modrm(jit, 2, reg, JIT_CPU);
+    _JIT_emit32(jit, field);
+}
+
+/* mov word [cpu + field], r16 */
+static void _JIT_field16_store(JIT* jit, u8 reg, u32 field) {
+    _JIT_emit8(jit, 0x66);
+    _JIT_rex(jit, false, reg, JIT_CPU, false);
+    _JIT_emit8(jit, 0x89);
+    _JIT_modrm(jit, 2, reg, JIT_CPU);
+    _JIT_emit32(jit, field);
+}
+
+/* mov word [cpu + field], imm16 */
+static void _JIT_field16_imm(JIT* jit, u32 field, u16 value) {
+    JIT_BYTES(jit, 0x66, 0xC7);
+    _JIT_modrm(jit, 2, 0, JIT_CPU);
+    _JIT_emit32(jit, field);
+    _JIT_emit16(jit, value);
+}
+
+/* movzx r32, r8 */
+static void _JIT_zx8(JIT* jit, u8 dst, u8 src) {
+    _JIT_rex(jit, false, dst, src, _JIT_is_byte_reg_high(src));
+    JIT_BYTES(jit, 0x0F, 0xB6);
+    _JIT_modrm(jit, 3, dst, src);
+}
+
+static void _JIT_mov_imm32(JIT* jit, u8 reg, u32 value) {
+    _JIT_rex(jit, false, 0, reg, false);
+    _JIT_emit8(jit, 0xB8 + (reg & 7));
+    _JIT_emit32(jit, value);
+}
+
+static void _JIT_mov_imm64(JIT* jit, u8 reg, u64 value) {
+    _JIT_rex(jit, true, 0, reg, false);
+    _JIT_emit8(jit, 0xB8 + (reg & 7));
+    _JIT_emit64(jit, value);
+}
+
+/* op r32, imm32 or op r64, imm32 (add 0, or 1, and 4, sub 5, xor 6, cmp 7) */
+static void _JIT_alu_imm(JIT* jit, bool wide, u8 extension, u8 reg, u32 value) {
+    _JIT_rex(jit, wide, 0, reg, false);
+    _JIT_emit8(jit, 0x81);
+    _JIT_modrm(jit, 3, extension, reg);
+    _JIT_emit32(jit, value);
+}
+
+/* op r8, imm8, same extensions */
+static void _JIT_alu8_imm(JIT* jit, u8 extension, u8 reg, u8 value) {
+    _JIT_rex(jit, false, 0, reg, _JIT_is_byte_reg_high(reg));
+    _JIT_emit8(jit, 0x80);
+    _JIT_modrm(jit, 3, extension, reg);
+    _JIT_emit8(jit, value);
+}
+
+/* One-operand byte ops: inc 0xFE/0, dec 0xFE/1, shl by one 0xD0/4 */
+static void _JIT_unary8(JIT* jit, u8 op, u8 extension, u8 reg) {
+    _JIT_rex(jit, false, 0, reg, _JIT_is_byte_reg_high(reg));
+    _JIT_emit8(jit, op);
+    _JIT_modrm(jit, 3, extension, reg);
+}
+
+/* Shifts by an immediate: 0xC0 (8-bit) or 0xC1 (32-bit), shl 4, shr 5 */
+static void _JIT_shift_imm(JIT* jit, u8 op, u8 extension, u8 reg, u8 count) {
+    _JIT_rex(jit, false, 0, reg, op == 0xC0 && _JIT_is_byte_reg_high(reg));
+    _JIT_emit8(jit, op);
+    _JIT_modrm(jit, 3, extension, reg);
+    _JIT_emit8(jit, count);
+}
+
+static void _JIT_setcc(JIT* jit, u8 condition, u8 reg) {
+    _JIT_rex(jit, false, 0, reg, _JIT_is_byte_reg_high(reg));
+    JIT_BYTES(jit, 0x0F, 0x90 + condition);
+    _JIT_modrm(jit, 3, 0, reg);
+}
+
+static void _JIT_call(JIT* jit, const void* function) {
+    _JIT_mov_imm64(jit, HOST_RAX, (u64)function);
+    JIT_BYTES(jit, 0xFF, 0xD0);                   // call rax
+}
+
+/* Forward jumps, returning where their offset goes so _JIT_bind can fill it in */
+static u32 _JIT_jcc(JIT* jit, u8 condition) {
+    JIT_BYTES(jit, 0x0F, 0x80 + condition);
+    _JIT_emit32(jit, 0);
+    return jit->code_used - 4;
+}
+
+static u32 _JIT_jmp(JIT* jit) {
+    _JIT_emit8(jit, 0xE9);
+    _JIT_emit32(jit, 0);
+    return jit->code_used - 4;
+}
+
+static void _JIT_bind(JIT* jit, u32 jump) {
+    u32 offset = jit->code_used - (jump + 4);
+    memcpy(jit->code + jump, &offset, 4);
+}
+
+static void _JIT_jmp_to(JIT* jit, u32 target) {
+    _JIT_emit8(jit, 0xE9);
+    _JIT_emit32(jit, target - (jit->code_used + 4));
+}
+
+/* Memory access from compiled code */
+/* Byte at the address in ESI into EAX, through the page table */
+static void _JIT_emit_read(JIT* jit) {
+    _JIT_rr(jit, false, 0x89, HOST_RCX, HOST_RSI);           // mov ecx, esi
+    _JIT_shift_imm(jit, 0xC1, 5, HOST_RCX, 8);               // shr ecx, 8
+    JIT_BYTES(jit, 0x48, 0x8B, 0x8C, 0xCB);                  // mov rcx, [rbx + rcx*8 + read_pages]
+    _JIT_emit32(jit, CPU_FIELD(read_pages));
+    _JIT_rr(jit, true, 0x85, HOST_RCX, HOST_RCX);            // test rcx, rcx
+    u32 slow = _JIT_jcc(jit, CC_E);
+    _JIT_zx8(jit, HOST_RDX, HOST_RSI);                       // movzx edx, sil
+    JIT_BYTES(jit, 0x0F, 0xB6, 0x04, 0x11);                  // movzx eax, byte [rcx + rdx]
+    u32 done = _JIT_jmp(jit);
+    _JIT_bind(jit, slow);
+    _JIT_rr(jit, true, 0x89, HOST_RDI, JIT_CPU);
+    _JIT_call(jit, _JIT_read_slow);
+    _JIT_zx8(jit, HOST_RAX, HOST_RAX);
+    _JIT_bind(jit, done);
+}
+
+/* AL to the address in ESI, through the page table */
+static void _JIT_emit_write(JIT* jit) {
+    _JIT_rr(jit, false, 0x89, HOST_RCX, HOST_RSI);           // mov ecx, esi
+    _JIT_shift_imm(jit, 0xC1, 5, HOST_RCX, 8);               // shr ecx, 8
+    JIT_BYTES(jit, 0x48, 0x8B, 0x8C, 0xCB);                  // mov rcx, [rbx + rcx*8 + write_pages]
+    _JIT_emit32(jit, CPU_FIELD(write_pages));
+    _JIT_rr(jit, true, 0x85, HOST_RCX, HOST_RCX);            // test rcx, rcx
+    u32 slow = _JIT_jcc(jit, CC_E);
+    _JIT_zx8(jit, HOST_RDX, HOST_RSI);                       // movzx edx, sil
+    JIT_BYTES(jit, 0x88, 0x04, 0x11);                        // mov [rcx + rdx], al
+    u32 done = _JIT_jmp(jit);
+    _JIT_bind(jit, slow);
+    _JIT_rr(jit, true, 0x89, HOST_RDI, JIT_CPU);
+    _JIT_zx8(jit, HOST_RDX, HOST_RAX);
+    _JIT_call(jit, _CPU_write_slow);
+    _JIT_bind(jit, done);
+}
+
+/* Byte at a fixed address into EAX. Mapped pages are loaded from directly,
+ * except shared ones, which move to a copy of their own on the first write
+ */
+static void _JIT_emit_read_at(JIT* jit, u16 address) {
+    u8* page = jit->cpu->read_pages[address >> 8];
+    if (jit->cpu->shared_pages[address >> 8]) {
+        _JIT_mov_imm32(jit, HOST_RSI, address);
+        _JIT_emit_read(jit);
+        return;
+    }
+    if (page != NULL) {
+        _JIT_mov_imm64(jit, HOST_RAX, (u64)(page + (address & 0xFF)));
+        JIT_BYTES(jit, 0x0F, 0xB6, 0x00);                    // movzx eax, byte [rax]
+        return;
+    }
+    _JIT_rr(jit, true, 0x89, HOST_RDI, JIT_CPU);
+    _JIT_mov_imm32(jit, HOST_RSI, address);
+    _JIT_call(jit, _JIT_read_slow);
+    _JIT_zx8(jit, HOST_RAX, HOST_RAX);
+}
+
+/* AL to a fixed address. RAM still goes through write_pages, since the decode cache turns pages off and on */
+static void _JIT_emit_write_at(JIT* jit, u16 address) {
+    u32 done = 0;
+    bool ram = jit->cpu->ram_pages[address >> 8] != NULL || jit->cpu->shared_pages[address >> 8];
+    if (ram) {
+        JIT_BYTES(jit, 0x48, 0x8B, 0x8B);                    // mov rcx, [rbx + write_pages + page*8]
+        _JIT_emit32(jit, CPU_FIELD(write_pages) + (address >> 8) * sizeof(u8*));
+        _JIT_rr(jit, true, 0x85, HOST_RCX, HOST_RCX);        // test rcx, rcx
+        u32 slow = _JIT_jcc(jit, CC_E);
+        JIT_BYTES(jit, 0x88, 0x81);                          // mov [rcx + offset], al
+        _JIT_emit32(jit, address & 0xFF);
+        done = _JIT_jmp(jit);
+        _JIT_bind(jit, slow);
+    }
+    _JIT_rr(jit, true, 0x89, HOST_RDI, JIT_CPU);
+    _JIT_mov_imm32(jit, HOST_RSI, address);
+    _JIT_zx8(jit, HOST_RDX, HOST_RAX);
+    _JIT_call(jit, _CPU_write_slow);
+    if (ram) {
+        _JIT_bind(jit, done);
+    }
+}
+
+/* ESI = $0100 + SP */
+static void _JIT_emit_stack_address(JIT* jit) {
+    _JIT_zx8(jit, HOST_RSI, JIT_SP);
+    _JIT_alu_imm(jit, false, 0, HOST_RSI, 0x100);
+}
+
+/* Operands */
+/* Works out the address of the modes that depend on registers into ESI */
+static void _JIT_emit_address(JIT* jit, const JITOperand* operand) {
+    switch (operand->mode) {
+        case ADDR_ABS_Y: {
+            _JIT_zx8(jit, HOST_RSI, JIT_Y);
+            _JIT_alu_imm(jit, false, 0, HOST_RSI, operand->address);
+            _JIT_alu_imm(jit, false, 4, HOST_RSI, 0xFFFF);
+            break;
+        }
+        case ADDR_X_IND: { // (ZPG,X), the pointer wraps around in the zero page
+            _JIT_zx8(jit, HOST_RSI, JIT_X);
+            _JIT_alu_imm(jit, false, 0, HOST_RSI, operand->address);
+            _JIT_alu_imm(jit, false, 4, HOST_RSI, 0xFF);
+            _JIT_emit_read(jit);
+            _JIT_field8(jit, 0x88, HOST_RAX, CPU_FIELD(access_address)); // Low byte, until the high one is in
+            _JIT_zx8(jit, HOST_RSI, JIT_X);
+            _JIT_alu_imm(jit, false, 0, HOST_RSI, operand->address + 1);
+            _JIT_alu_imm(jit, false, 4, HOST_RSI, 0xFF);
+            _JIT_emit_read(jit);
+            _JIT_shift_imm(jit, 0xC1, 4, HOST_RAX, 8);
+            _JIT_field8_zx(jit, HOST_RCX, CPU_FIELD(access_address));
+            _JIT_rr(jit, false, 0x09, HOST_RAX, HOST_RCX);
+            _JIT_rr(jit, false, 0x89, HOST_RSI, HOST_RAX);
+            break;
+        }
+    }
+}
+
+static void _JIT_emit_load(JIT* jit, const JITOperand* operand) {
+    switch (operand->mode) {
+        case ADDR_IMM: _JIT_mov_imm32(jit, HOST_RAX, operand->value); break;
+        case ADDR_ZPG:
+        case ADDR_ABS: _JIT_emit_read_at(jit, operand->address);      break;
+        default:       _JIT_emit_read(jit);                          break;
+    }
+}
+
+static void _JIT_emit_store(JIT* jit, const JITOperand* operand) {
+    switch (operand->mode) {
+        case ADDR_ZPG:
+        case ADDR_ABS: _JIT_emit_write_at(jit, operand->address); break;
+        default:       _JIT_emit_write(jit);                      break;
+    }
+}
+
+static void _JIT_emit_set_NZ(JIT* jit, u8 reg) {
+    _JIT_field8(jit, 0x88, reg, CPU_FIELD(flag_n_source));
+    _JIT_field8(jit, 0x88, reg, CPU_FIELD(flag_z_source));
+}
+
+/* Operation logic, same results as the _CPU_<operation>_logic functions */
+typedef void (*jit_emit_fn_ptr)(JIT* jit, const JITOperand* operand);
+
+static void _JIT_emit_load_register(JIT* jit, const JITOperand* operand, u8 reg) {
+    _JIT_emit_load(jit, operand);
+    _JIT_rr8(jit, 0x88, reg, HOST_RAX);
+    _JIT_emit_set_NZ(jit, reg);
+}
+
+static void _JIT_emit_store_register(JIT* jit, const JITOperand* operand, u8 reg) {
+    _JIT_rr8(jit, 0x88, HOST_RAX, reg);
+    _JIT_emit_store(jit, operand);
+}
+
+static void _JIT_emit_logic_A(JIT* jit, const JITOperand* operand, u8 op) {
+    _JIT_emit_load(jit, operand);
+    _JIT_rr8(jit, op, JIT_A, HOST_RAX);
+    _JIT_emit_set_NZ(jit, JIT_A);
+}
+
+static void _JIT_emit_compare(JIT* jit, const JITOperand* operand, u8 reg) {
+    _JIT_emit_load(jit, operand);
+    _JIT_rr8(jit, 0x38, reg, HOST_RAX);                      // cmp reg, al
+    _JIT_setcc(jit, CC_AE, HOST_RCX);                        // Carry is reg >= operand
+    _JIT_rr8(jit, 0x88, HOST_RDX, reg);
+    _JIT_rr8(jit, 0x28, HOST_RDX, HOST_RAX);
+    _JIT_emit_set_NZ(jit, HOST_RDX);
+    _JIT_field8_imm(jit, 0x80, 4, CPU_FIELD(r.P), (u8)~FLAGS_CAR);
+    _JIT_field8(jit, 0x08, HOST_RCX, CPU_FIELD(r.P));
+}
+
+/* ECX = carry, flipped for SBC */
+static void _JIT_emit_carry(JIT* jit, bool borrow) {
+    _JIT_field8_zx(jit, HOST_RCX, CPU_FIELD(r.P));
+    _JIT_alu_imm(jit, false, 4, HOST_RCX, FLAGS_CAR);
+    if (borrow) {
+        _JIT_alu_imm(jit, false, 6, HOST_RCX, FLAGS_CAR);
+    }
+}
+
+static void _JIT_emit_LDA(JIT* jit, const JITOperand* operand) { _JIT_emit_load_register(jit, operand, JIT_A); }
+static void _JIT_emit_LDX(JIT* jit, const JITOperand* operand) { _JIT_emit_load_register(jit, operand, JIT_X); }
+static void _JIT_emit_LDY(JIT* jit, const JITOperand* operand) { _JIT_emit_load_register(jit, operand, JIT_Y); }
+static void _JIT_emit_STA(JIT* jit, const JITOperand* operand) { _JIT_emit_store_register(jit, operand, JIT_A); }
+static void _JIT_emit_STX(JIT* jit, const JITOperand* operand) { _JIT_emit_store_register(jit, operand, JIT_X); }
+static void _JIT_emit_STY(JIT* jit, const JITOperand* operand) { _JIT_emit_store_register(jit, operand, JIT_Y); }
+static void _JIT_emit_AND(JIT* jit, const JITOperand* operand) { _JIT_emit_logic_A(jit, operand, 0x20); }
+static void _JIT_emit_ORA(JIT* jit, const JITOperand* operand) { _JIT_emit_logic_A(jit, operand, 0x08); }
+static void _JIT_emit_EOR(JIT* jit, const JITOperand* operand) { _JIT_emit_logic_A(jit, operand, 0x30); }
+static void _JIT_emit_CMP(JIT* jit, const JITOperand* operand) { _JIT_emit_compare(jit, operand, JIT_A); }
+static void _JIT_emit_CPX(JIT* jit, const JITOperand* operand) { _JIT_emit_compare(jit, operand, JIT_X); }
+static void _JIT_emit_CPY(JIT* jit, const JITOperand* operand) { _JIT_emit_compare(jit, operand, JIT_Y); }
+
+static void _JIT_emit_ADC(JIT* jit, const JITOperand* operand) {
+    _JIT_emit_load(jit, operand);
+    _JIT_emit_carry(jit, false);
+    _JIT_rr8(jit, 0x00, HOST_RAX, HOST_RCX);                 // operand + carry
+    _JIT_rr8(jit, 0x00, JIT_A, HOST_RAX);
+    _JIT_emit_set_NZ(jit, JIT_A);
+}
+
+static void _JIT_emit_SBC(JIT* jit, const JITOperand* operand) {
+    _JIT_emit_load(jit, operand);
+    _JIT_emit_carry(jit, true);
+    _JIT_rr8(jit, 0x00, HOST_RAX, HOST_RCX);                 // operand + (1 - carry)
+    _JIT_rr8(jit, 0x28, JIT_A, HOST_RAX);
+    _JIT_emit_set_NZ(jit, JIT_A);
+}
+
+static void _JIT_emit_BIT(JIT* jit, const JITOperand* operand) {
+    _JIT_emit_load(jit, operand);
+    _JIT_rr8(jit, 0x88, HOST_RDX, HOST_RAX);
+    _JIT_rr8(jit, 0x20, HOST_RDX, JIT_A);
+    _JIT_field8(jit, 0x88, HOST_RDX, CPU_FIELD(flag_z_source));
+    _JIT_field8(jit, 0x88, HOST_RAX, CPU_FIELD(flag_n_source));
+    _JIT_field8_imm(jit, 0x80, 4, CPU_FIELD(r.P), (u8)~FLAGS_OVR);
+    _JIT_alu8_imm(jit, 4, HOST_RAX, FLAGS_OVR);
+    _JIT_field8(jit, 0x08, HOST_RAX, CPU_FIELD(r.P));
+}
+
+/* Read-modify-write: the original value is written back before the new one.
+ * compare_operand holds the value across the writes, like in the interpreter.
+ */
+static void _JIT_emit_RMW_start(JIT* jit, const JITOperand* operand) {
+    _JIT_emit_load(jit, operand);
+    _JIT_field8(jit, 0x88, HOST_RAX, CPU_FIELD(compare_operand));
+    _JIT_emit_store(jit, operand);
+    _JIT_field8_zx(jit, HOST_RAX, CPU_FIELD(compare_operand));
+}
+
+static void _JIT_emit_ASL(JIT* jit, const JITOperand* operand) {
+    _JIT_emit_RMW_start(jit, operand);
+    _JIT_unary8(jit, 0xD0, 4, HOST_RAX);
+    _JIT_emit_store(jit, operand);
+}
+
+static void _JIT_emit_ROL(JIT* jit, const JITOperand* operand) {
+    _JIT_emit_RMW_start(jit, operand);
+    _JIT_emit_carry(jit, false);
+    _JIT_rr8(jit, 0x88, HOST_RDX, HOST_RAX);
+    _JIT_shift_imm(jit, 0xC0, 5, HOST_RDX, 7);               // New carry is bit 7
+    _JIT_field8_imm(jit, 0x80, 4, CPU_FIELD(r.P), (u8)~FLAGS_CAR);
+    _JIT_field8(jit, 0x08, HOST_RDX, CPU_FIELD(r.P));
+    _JIT_unary8(jit, 0xD0, 4, HOST_RAX);
+    _JIT_rr8(jit, 0x08, HOST_RAX, HOST_RCX);
+    _JIT_emit_store(jit, operand);
+}
+
+static const jit_emit_fn_ptr emit_table[256] = {
+    #define X(opcode, op, mode) [opcode] = _JIT_emit_##op,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+};
+
+static const u8 addressing_mode[256] = {
+    #define X(opcode, op, mode) [opcode] = ADDR_##mode,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+};
+
+/* Emits one of the single-byte (or NOP #) instructions that don't touch the PC.
+ * Returns its cycles, or 0 for the ones left to the interpreter.
+ */
+static u8 _JIT_emit_implied(JIT* jit, u8 opcode) {
+    switch (opcode) {
+        case 0x0A: // ASL A
+        case 0x2A: // ROL A, a plain shift in the interpreter as well
+            _JIT_unary8(jit, 0xD0, 4, JIT_A);
+            return 2;
+        case 0x89: // NOP #
+        case 0xEA: // NOP
+            return 2;
+        case 0xAA: _JIT_rr8(jit, 0x88, JIT_X, JIT_A); _JIT_emit_set_NZ(jit, JIT_X); return 2; // TAX
+        case 0x8A: _JIT_rr8(jit, 0x88, JIT_A, JIT_X); _JIT_emit_set_NZ(jit, JIT_A); return 2; // TXA
+        case 0xA8: _JIT_rr8(jit, 0x88, JIT_Y, JIT_A); _JIT_emit_set_NZ(jit, JIT_Y); return 2; // TAY
+        case 0x98: _JIT_rr8(jit, 0x88, JIT_A, JIT_Y); _JIT_emit_set_NZ(jit, JIT_A); return 2; // TYA
+        case 0xE8: _JIT_unary8(jit, 0xFE, 0, JIT_X); _JIT_emit_set_NZ(jit, JIT_X); return 2;   // INX
+        case 0xCA: _JIT_unary8(jit, 0xFE, 1, JIT_X); _JIT_emit_set_NZ(jit, JIT_X); return 2;   // DEX
+        case 0xC8: _JIT_unary8(jit, 0xFE, 0, JIT_Y); _JIT_emit_set_NZ(jit, JIT_Y); return 2;   // INY
+        case 0x88: _JIT_unary8(jit, 0xFE, 1, JIT_Y); _JIT_emit_set_NZ(jit, JIT_Y); return 2;   // DEY
+        case 0x1A: _JIT_unary8(jit, 0xFE, 0, JIT_A); _JIT_emit_set_NZ(jit, JIT_A); return 2;   // INC A
+        case 0x3A: _JIT_unary8(jit, 0xFE, 1, JIT_A); _JIT_emit_set_NZ(jit, JIT_A); return 2;   // DEC A
+        case 0x18: case 0x38: case 0x58: case 0x78: case 0xB8: case 0xD8: case 0xF8: {
+            // Flag instructions, decoded the same way as _CPU_flags_logic
+            u8 flag = instruction_flag_by_index[(opcode & 0xC0) >> 6];
+            _JIT_field8_imm(jit, 0x80, 4, CPU_FIELD(r.P), (u8)~flag);
+            if (opcode & 0x20) {
+                _JIT_field8_imm(jit, 0x80, 1, CPU_FIELD(r.P), flag);
+            }
+            return 2;
+        }
+        case 0x48: // PHA
+            _JIT_emit_stack_address(jit);
+            _JIT_rr8(jit, 0x88, HOST_RAX, JIT_A);
+            _JIT_emit_write(jit);
+            _JIT_unary8(jit, 0xFE, 1, JIT_SP);
+            return 2;
+        case 0x68: // PLA, doesn't touch the flags in the interpreter either
+            _JIT_unary8(jit, 0xFE, 0, JIT_SP);
+            _JIT_emit_stack_address(jit);
+            _JIT_emit_read(jit);
+            _JIT_rr8(jit, 0x88, JIT_A, HOST_RAX);
+            return 2;
+    }
+    return 0;
+}
+
+/* Leaves the block for a fixed 6502 address: straight into the block there once it's linked, else back to JIT_run */
+static void _JIT_emit_exit(JIT* jit, JITBlock* block, u8 exit, u16 target) {
+    _JIT_mov_imm64(jit, HOST_RAX, (u64)&block->exits[exit]);
+    JIT_BYTES(jit, 0x48, 0x8B, 0x08);                        // mov rcx, [rax]
+    _JIT_rr(jit, true, 0x85, HOST_RCX, HOST_RCX);
+    u32 unlinked = _JIT_jcc(jit, CC_E);
+    JIT_BYTES(jit, 0xFF, 0xE1);                              // jmp rcx
+    _JIT_bind(jit, unlinked);
+    _JIT_field16_imm(jit, CPU_FIELD(r.PC), target);
+    _JIT_jmp_to(jit, jit->exit_stub);                        // RAX points at the exit for JIT_run to link
+}
+
+/* Emits the instruction that ends a block. Returns its cycles, or 0 when it isn't one */
+static u8 _JIT_emit_jump(JIT* jit, JITBlock* block, u8 opcode, u16 pc, u16 operand) {
+    if ((opcode & 0x1F) == 0x10) { // Branches
+        u16 old_pc = pc + 2;
+        // Same target as _CPU_branch_logic, which keeps the page of the next instruction
+        u16 target = ((old_pc + (i8)operand) & 0xFF) + (old_pc & 0xFF00);
+        bool taken_if_set = opcode & 0x20;
+        bool set_is_equal;
+        switch ((opcode & 0xC0) >> 6) {
+            case 0:  _JIT_field8_imm(jit, 0xF6, 0, CPU_FIELD(flag_n_source), FLAGS_NEG); set_is_equal = false; break;
+            case 1:  _JIT_field8_imm(jit, 0xF6, 0, CPU_FIELD(r.P), FLAGS_OVR);           set_is_equal = false; break;
+            case 2:  _JIT_field8_imm(jit, 0xF6, 0, CPU_FIELD(r.P), FLAGS_CAR);           set_is_equal = false; break;
+            default: _JIT_field8_imm(jit, 0x80, 7, CPU_FIELD(flag_z_source), 0);         set_is_equal = true;  break;
+        }
+        u32 taken = _JIT_jcc(jit, (taken_if_set == set_is_equal) ? CC_E : CC_NE);
+        _JIT_emit_exit(jit, block, 1, old_pc);
+        _JIT_bind(jit, taken);
+        _JIT_emit_exit(jit, block, 0, target);
+        return 3;
+    }
+    switch (opcode) {
+        case 0x4C: // JMP abs
+            _JIT_emit_exit(jit, block, 0, operand);
+            return 4;
+        case 0x20: // JSR, pushes the address of its last byte
+            _JIT_emit_stack_address(jit);
+            _JIT_mov_imm32(jit, HOST_RAX, (u16)(pc + 2) >> 8);
+            _JIT_emit_write(jit);
+            _JIT_unary8(jit, 0xFE, 1, JIT_SP);
+            _JIT_emit_stack_address(jit);
+            _JIT_mov_imm32(jit, HOST_RAX, (pc + 2) & 0xFF);
+            _JIT_emit_write(jit);
+            _JIT_unary8(jit, 0xFE, 1, JIT_SP);
+            _JIT_emit_exit(jit, block, 0, operand);
+            return 6;
+        case 0x60: { // RTS
+            if (jit->cpu->read_pages[0] == NULL) { // The dummy read only matters when it isn't plain memory
+                _JIT_zx8(jit, HOST_RSI, JIT_SP);
+                _JIT_emit_read(jit);
+            }
+            _JIT_unary8(jit, 0xFE, 0, JIT_SP);
+            _JIT_emit_stack_address(jit);
+            _JIT_emit_read(jit);
+            _JIT_field8(jit, 0x88, HOST_RAX, CPU_FIELD(access_address));
+            _JIT_unary8(jit, 0xFE, 0, JIT_SP);
+            _JIT_emit_stack_address(jit);
+            _JIT_emit_read(jit);
+            _JIT_shift_imm(jit, 0xC1, 4, HOST_RAX, 8);
+            _JIT_field8_zx(jit, HOST_RCX, CPU_FIELD(access_address));
+            _JIT_rr(jit, false, 0x09, HOST_RAX, HOST_RCX);
+            _JIT_alu_imm(jit, false, 0, HOST_RAX, 1);
+            _JIT_alu_imm(jit, false, 4, HOST_RAX, 0xFFFF);
+            _JIT_field16_store(jit, HOST_RAX, CPU_FIELD(r.PC));
+            // The return address isn't fixed, look the block up in jit->blocks
+            _JIT_mov_imm64(jit, HOST_RCX, (u64)jit->blocks);
+            JIT_BYTES(jit, 0x48, 0x8B, 0x0C, 0xC1);              // mov rcx, [rcx + rax*8]
+            _JIT_rr(jit, true, 0x85, HOST_RCX, HOST_RCX);
+            u32 missing = _JIT_jcc(jit, CC_E);
+            JIT_BYTES(jit, 0x48, 0x8B, 0x09);                    // mov rcx, [rcx]
+            JIT_BYTES(jit, 0xFF, 0xE1);                          // jmp rcx
+            _JIT_bind(jit, missing);
+            _JIT_rr(jit, false, 0x31, HOST_RAX, HOST_RAX);       // Nothing to link
+            _JIT_jmp_to(jit, jit->exit_stub);
+            return 5;
+        }
+    }
+    return 0;
+}
+
+/* Whether every byte in [address, address + length) is mapped read-only memory (shared RAM doesn't count) */
+static bool _JIT_in_rom(CPU* cpu, u16 address, u8 length) {
+    for (u8 i = 0; i < length; i++) {
+        u8 page = (u16)(address + i) >> 8;
+        if (cpu->read_pages[page] == NULL || cpu->ram_pages[page] != NULL || cpu->shared_pages[page]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _JIT_writable(JIT* jit, bool writable) {
+    mprotect(jit->code, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+}
+
+/* Whether an access reaches read_fn or write_fn, where a device can do anything */
+static bool _JIT_reaches_device(CPU* cpu, u8 page, bool store) {
+    return cpu->read_pages[page] == NULL || (store && cpu->ram_pages[page] == NULL);
+}
+
+/* Whether an instruction can change which interrupts are due: CLI unmasks IRQs, and a device can
+ * raise a line on any access that reaches it. Blocks end after one, so the next entry's check
+ * sees it at the same instruction boundary the interpreter would
+ */
+static bool _JIT_may_interrupt(CPU* cpu, u8 opcode, u16 operand) {
+    if (opcode == 0x58) { // CLI
+        return true;
+    }
+    if (emit_table[opcode] == NULL) {
+        return (opcode == 0x48 || opcode == 0x68) && _JIT_reaches_device(cpu, 0x01, opcode == 0x48); // PHA, PLA
+    }
+    jit_emit_fn_ptr emit = emit_table[opcode];
+    bool store = emit == _JIT_emit_STA || emit == _JIT_emit_STX || emit == _JIT_emit_STY
+              || emit == _JIT_emit_ASL || emit == _JIT_emit_ROL;
+    switch (addressing_mode[opcode]) {
+        case ADDR_IMM:   return false;
+        case ADDR_ZPG:   return _JIT_reaches_device(cpu, 0x00, store);
+        case ADDR_ABS:   return _JIT_reaches_device(cpu, operand >> 8, store);
+        case ADDR_ABS_Y: return _JIT_reaches_device(cpu, operand >> 8, store) || _JIT_reaches_device(cpu, (u16)(operand + 0xFF) >> 8, store);
+        default:         return true; // (ZPG,X), the pointer can point anywhere
+    }
+}
+
+/* Compiles the block starting at pc, NULL if its first instruction can't be compiled */
+static JITBlock* _JIT_compile(JIT* jit, u16 pc) {
+    CPU* cpu = jit->cpu;
+    if (!_JIT_in_rom(cpu, pc, 1) || opcode_length[CPU_read(cpu, pc)] == 0) {
+        return NULL;
+    }
+    if (jit->block_count == JIT_MAX_BLOCKS || JIT_CODE_SIZE - jit->code_used < JIT_MAX_BLOCK_CODE) {
+        JIT_flush(jit);
+    }
+    _JIT_writable(jit, true);
+
+    JITBlock* block = &jit->pool[jit->block_count];
+    u32 start = jit->code_used;
+    block->code = jit->code + start;
+    block->exits[0] = block->exits[1] = NULL;
+    block->pc = pc;
+
+    /* Every entry, chained or not, checks that the whole block fits in the budget,
+     * so a block never runs over it and the interpreter takes care of the rest.
+     * Interrupts that came due in the block before are left to the interpreter too.
+     * The block's instructions and cycles are counted before it runs, so a device
+     * access (which always ends a block) sees the count at the end of its instruction
+     */
+    _JIT_alu_imm(jit, true, 7, JIT_BUDGET, 0);
+    u32 budget_check = jit->code_used - 4;
+    u32 short_budget = _JIT_jcc(jit, CC_L);
+    _JIT_field8_imm(jit, 0x80, 7, CPU_FIELD(stop_requested), 0); // Byte loads are atomic on x86-64, JIT_run takes the request
+    u32 stop = _JIT_jcc(jit, CC_NE);
+    _JIT_field8_imm(jit, 0x80, 7, CPU_FIELD(nmi_pending), 0);
+    u32 nmi = _JIT_jcc(jit, CC_NE);
+    _JIT_field8_imm(jit, 0x80, 7, CPU_FIELD(irq_lines), 0);
+    u32 no_irq = _JIT_jcc(jit, CC_E);
+    _JIT_field8_imm(jit, 0xF6, 0, CPU_FIELD(r.P), FLAGS_IRE);
+    u32 irq = _JIT_jcc(jit, CC_E);
+    _JIT_bind(jit, no_irq);
+    _JIT_alu_imm(jit, true, 5, JIT_BUDGET, 0);
+    u32 budget_sub = jit->code_used - 4;
+    JIT_BYTES(jit, 0x48, 0x81, 0x83);                        // add qword [rbx + instruction_count], count
+    _JIT_emit32(jit, CPU_FIELD(instruction_count));
+    _JIT_emit32(jit, 0);
+    u32 instruction_add = jit->code_used - 4;
+    JIT_BYTES(jit, 0x48, 0x81, 0x83);                        // add qword [rbx + cycle_count], cycles
+    _JIT_emit32(jit, CPU_FIELD(cycle_count));
+    _JIT_emit32(jit, 0);
+    u32 cycle_add = jit->code_used - 4;
+
+    u32 cycles = 0;
+    u32 count = 0;
+    bool ended = false;
+    while (count < JIT_MAX_BLOCK_INSTRUCTIONS) {
+        u8 opcode = CPU_read(cpu, pc);
+        u8 length = opcode_length[opcode];
+        if (length == 0 || !_JIT_in_rom(cpu, pc, length)) {
+            break;
+        }
+        if (cpu->hooks != NULL && Hooks_find(cpu->hooks, pc) != NULL) {
+            break; // The interpreter runs hooks, so a block never starts or goes through one
+        }
+        u16 operand = (length > 1 ? CPU_read(cpu, pc + 1) : 0) | (length > 2 ? CPU_read(cpu, pc + 2) << 8 : 0);
+        u8 instruction_cycles;
+        if (emit_table[opcode] != NULL) {
+            JITOperand addressed = {addressing_mode[opcode], operand, operand & 0xFF};
+            _JIT_emit_address(jit, &addressed);
+            emit_table[opcode](jit, &addressed);
+            bool rmw = emit_table[opcode] == _JIT_emit_ASL || emit_table[opcode] == _JIT_emit_ROL;
+            instruction_cycles = opcode_base_cycles[opcode] + (rmw ? 3 : 1);
+        } else if ((instruction_cycles = _JIT_emit_implied(jit, opcode)) == 0) {
+            if ((instruction_cycles = _JIT_emit_jump(jit, block, opcode, pc, operand)) == 0) {
+                break;
+            }
+            ended = true;
+        }
+        cycles += instruction_cycles;
+        count++;
+        pc += length;
+        if (ended || _JIT_may_interrupt(cpu, opcode, operand)) {
+            break;
+        }
+    }
+    if (count == 0) {
+        jit->code_used = start;
+        _JIT_writable(jit, false);
+        return NULL;
+    }
+    if (!ended) {
+        _JIT_emit_exit(jit, block, 0, pc);
+    }
+
+    _JIT_bind(jit, short_budget);
+    _JIT_bind(jit, stop);
+    _JIT_bind(jit, nmi);
+    _JIT_bind(jit, irq);
+    _JIT_field16_imm(jit, CPU_FIELD(r.PC), block->pc);
+    _JIT_rr(jit, false, 0x31, HOST_RAX, HOST_RAX);
+    _JIT_jmp_to(jit, jit->exit_stub);
+
+    memcpy(jit->code + budget_check, &cycles, 4);
+    memcpy(jit->code + budget_sub, &cycles, 4);
+    memcpy(jit->code + cycle_add, &cycles, 4);
+    memcpy(jit->code + instruction_add, &count, 4);
+    _JIT_writable(jit, false);
+
+    block->cycles = cycles;
+    jit->blocks[block->pc] = block;
+    jit->block_count++;
+    return block;
+}
+
+/* The compiled block at pc. Compiles it once the interpreter has been there often enough */
+static JITBlock* _JIT_block_at(JIT* jit, u16 pc) {
+    JITBlock* block = jit->blocks[pc];
+    if (block != NULL || jit->heat[pc] == JIT_NEVER || ++jit->heat[pc] < JIT_HOT_THRESHOLD) {
+        return block;
+    }
+    block = _JIT_compile(jit, pc);
+    if (block == NULL) {
+        jit->heat[pc] = JIT_NEVER;
+    }
+    return block;
+}
+
+/* Entry and exit code shared by every block */
+static void _JIT_emit_trampoline(JIT* jit) {
+    static const u8 registers[] = {JIT_A, JIT_X, JIT_Y, JIT_SP};
+    static const u32 fields[] = {CPU_FIELD(r.A), CPU_FIELD(r.X), CPU_FIELD(r.Y), CPU_FIELD(r.SP)};
+
+    // void** enter(CPU* cpu, void* code, i64* budget)
+    jit->enter = (jit_enter_fn_ptr)jit->code;
+    JIT_BYTES(jit, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, rbp, r12-r15
+    JIT_BYTES(jit, 0x52);                                    // push rdx, which also aligns the stack for calls
+    _JIT_rr(jit, true, 0x89, JIT_CPU, HOST_RDI);
+    JIT_BYTES(jit, 0x48, 0x8B, 0x2A);                        // mov rbp, [rdx]
+    for (int i = 0; i < 4; i++) {
+        _JIT_field8_zx(jit, registers[i], fields[i]);
+    }
+    JIT_BYTES(jit, 0xFF, 0xE6);                              // jmp rsi
+
+    // RAX = exit to link or NULL
+    jit->exit_stub = jit->code_used;
+    for (int i = 0; i < 4; i++) {
+        _JIT_field8(jit, 0x88, registers[i], fields[i]);
+    }
+    JIT_BYTES(jit, 0x5A);                                    // pop rdx
+    JIT_BYTES(jit, 0x48, 0x89, 0x2A);                        // mov [rdx], rbp
+    JIT_BYTES(jit, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B); // pop r15-r12, rbp, rbx
+    JIT_BYTES(jit, 0xC3);                                    // ret
+}
+
+/* External functions */
+JIT* JIT_create(CPU* cpu) {
+    JIT* jit = calloc(1, sizeof(JIT));
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->cpu = cpu;
+    _JIT_emit_trampoline(jit);
+    jit->blocks_start = jit->code_used;
+    JIT_flush(jit);
+    return jit;
+}
+
+void JIT_destroy(JIT* jit) {
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+/* Drops every compiled block */
+void JIT_flush(JIT* jit) {
+    jit->code_used = jit->blocks_start;
+    jit->block_count = 0;
+    jit->generation++;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->heat, 0, sizeof(jit->heat));
+    _JIT_writable(jit, false);
+}
+
+/* Same as CPU_run, with compiled blocks where there are some */
+RunResult JIT_run(JIT* jit, u64 cycle_budget) {
+    CPU* cpu = jit->cpu;
+    RunResult result = {0, STOP_NONE};
+    while (cpu->is_running) {
+        if (CPU_take_stop_request(cpu)) {
+            result.reason = STOP_REQUESTED;
+            return result;
+        }
+        if (result.cycles >= cycle_budget) {
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        if (CPU_is_waiting(cpu)) { // Nothing in here can wake it
+            cpu->cycle_count += cycle_budget - result.cycles;
+            result.cycles = cycle_budget;
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        JITBlock* block = NULL;
+        if (cpu->reset_delay == 0xFF && cpu->cycle == 0) {
+            block = _JIT_block_at(jit, cpu->r.PC);
+        }
+        // Interrupts are taken between blocks by the interpreter, so is waking up from WAI
+        if (block == NULL || cycle_budget - result.cycles < block->cycles || CPU_interrupt_due(cpu) || cpu->waiting) {
+            result.cycles += CPU_step_instruction(cpu);
+            continue;
+        }
+
+        i64 budget = cycle_budget - result.cycles;
+        void** exit = jit->enter(cpu, block->code, &budget);
+        result.cycles += (cycle_budget - result.cycles) - budget; // Blocks count their cycles as they go in
+
+        // Link the exit that was taken to where it went, now or once that gets hot
+        if (exit != NULL) {
+            u32 generation = jit->generation;
+            JITBlock* next = _JIT_block_at(jit, cpu->r.PC);
+            if (next != NULL && jit->generation == generation) {
+                *exit = next->code;
+            }
+        }
+    }
+    result.reason = cpu->stop_reason;
+    return result;
+}
+
+#else
+/* No recompiler on this host, callers fall back to CPU_run */
+JIT* JIT_create(CPU* cpu) {
+    (void)cpu;
+    return NULL;
+}
+
+void JIT_destroy(JIT* jit) {
+    (void)jit;
+}
+
+void JIT_flush(JIT* jit) {
+    (void)jit;
+}
+
+RunResult JIT_run(JIT* jit, u64 cycle_budget) {
+    (void)jit; (void)cycle_budget;
+    RunResult result = {0, STOP_NONE};
+    return result;
+}
+#endif
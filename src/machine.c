@@ -0,0 +1,1068 @@
+#define _DEFAULT_SOURCE // clock_gettime
+#include "machine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Bus callbacks, everything that isn't mapped straight to ram/rom ends up here */
+static void _Machine_update_irq(Machine* machine) {
+    CPU_set_irq(&machine->cpu, MACHINE_IRQ_ACIA, ACIA_irq(&machine->acia));
+}
+
+/* Two status reads close together that found nothing stop the CPU, so Machine_run can look for an idle loop */
+static void _Machine_empty_poll(Machine* machine) {
+    u64 cycle = machine->cpu.cycle_count;
+    if (cycle - machine->idle_poll_cycle <= MACHINE_IDLE_WINDOW && cycle >= machine->idle_backoff &&
+        !machine->idle_pending && machine->profile == NULL) { // Profiles count every instruction, skipped ones too
+        machine->idle_pending = true;
+        CPU_request_stop(&machine->cpu);
+    }
+    machine->idle_poll_cycle = cycle;
+}
+
+/* Adds an event at the machine's place in its input log, dropping any that were after it.
+ * Recording is best effort, running out of memory loses the event */
+static void _Machine_record(Machine* machine, u8 kind, u64 position, u8 data) {
+    MachineInputLog* log = machine->input_log;
+    if (log == NULL || log->replaying) {
+        return;
+    }
+    if (log->position == log->capacity) {
+        u32 capacity = log->capacity > 0 ? log->capacity * 2 : 64;
+        MachineInputEvent* events = realloc(log->events, capacity * sizeof(MachineInputEvent));
+        if (events == NULL) {
+            return;
+        }
+        log->events = events;
+        log->capacity = capacity;
+    }
+    log->events[log->position++] = (MachineInputEvent){position, kind, data, machine->acia.rx_full};
+    log->count = log->position;
+}
+
+/* The next event at or after index that's a poll (or isn't), count if there's none */
+static u32 _Machine_next_logged(MachineInputLog* log, u32 index, bool poll) {
+    while (index < log->count && (log->events[index].kind == MACHINE_INPUT_POLL) != poll) {
+        index++;
+    }
+    return index;
+}
+
+/* A read replayed from the log: what it found the first time if it's there, no input otherwise */
+static u8 _Machine_replay_read(Machine* machine, u8 reg) {
+    MachineInputLog* log = machine->input_log;
+    while (log->next_read < log->count && log->events[log->next_read].position < machine->acia_reads) {
+        log->next_read = _Machine_next_logged(log, log->next_read + 1, false); // Gone past, it went differently
+    }
+    MachineInputEvent* event = log->next_read < log->count ? &log->events[log->next_read] : NULL;
+    if (event == NULL || event->position != machine->acia_reads || (event->kind == MACHINE_INPUT_DATA) != (reg == ACIA_DATA)) {
+        return ACIA_read_replayed(&machine->acia, reg, false, 0);
+    }
+    log->next_read = _Machine_next_logged(log, log->next_read + 1, false);
+    return ACIA_read_replayed(&machine->acia, reg, event->rx_full, event->data);
+}
+
+static u8 _Machine_read(void* context, u16 address) {
+    Machine* machine = context;
+    if ((address & 0xFFFE) == MACHINE_ACIA_BASE) {
+        u8 data;
+        machine->acia_reads++;
+        if (machine->input_log != NULL && machine->input_log->replaying) {
+            data = _Machine_replay_read(machine, address & 1);
+        } else {
+            u32 received = machine->acia.received;
+            data = ACIA_read(&machine->acia, address & 1);
+            if ((address & 1) == ACIA_STATUS && machine->acia.rx_full) {
+                _Machine_record(machine, MACHINE_INPUT_STATUS, machine->acia_reads, 0);
+            } else if ((address & 1) == ACIA_DATA && machine->acia.received != received) {
+                _Machine_record(machine, MACHINE_INPUT_DATA, machine->acia_reads, data);
+            }
+        }
+        _Machine_update_irq(machine); // Reading the data takes the byte, and the IRQ with it
+        if ((address & 1) == ACIA_STATUS && !(data & ACIA_STATUS_RX_FULL)) {
+            _Machine_empty_poll(machine);
+        }
+        return data;
+    }
+    return 0; // Open bus
+}
+
+static bool _Machine_copy_page(Machine* machine, u8 page);
+
+static void _Machine_write(void* context, u16 address, u8 data) {
+    Machine* machine = context;
+    if (address < 0x2000) { // First write to a shared RAM page
+        if (!_Machine_copy_page(machine, (address >> 8) & (MACHINE_RAM_PAGES - 1))) {
+            machine->cpu.is_running = false;
+            machine->cpu.stop_reason = STOP_NO_MEMORY;
+            return;
+        }
+        CPU_write(&machine->cpu, address, data);
+        return;
+    }
+    if ((address & 0xFFFE) == MACHINE_ACIA_BASE) {
+        ACIA_write(&machine->acia, address & 1, data);
+        _Machine_update_irq(machine);
+    }
+    // Writes to ROM and unmapped space go nowhere
+}
+
+/* RAM page page of $0000-$07FF, at all 4 of its mirrors in $0000-$1FFF */
+static void _Machine_map_ram_page(Machine* machine, u8 page) {
+    for (u8 mirror = page; mirror < 0x20; mirror += MACHINE_RAM_PAGES) {
+        if (machine->ram_copies[page] != NULL) {
+            CPU_map_pages(&machine->cpu, mirror, 1, machine->ram_copies[page], 0x100, true);
+        } else {
+            CPU_map_shared_pages(&machine->cpu, mirror, 1, machine->image->ram + (page << 8), 0x100);
+        }
+    }
+}
+
+static void _Machine_map(Machine* machine) {
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) { // $0000-$1FFF, RAM mirrored every $800
+        _Machine_map_ram_page(machine, page);
+    }
+    CPU_map_pages(&machine->cpu, 0x80, 0x80, machine->image->rom, MACHINE_ROM_SIZE, false); // $8000-$FFFF
+    if (machine->jit != NULL) {
+        JIT_flush(machine->jit);
+    }
+}
+
+/* Gives the machine its own copy of a RAM page it was sharing. Only the
+ * decoded code in that page is dropped, the JIT never reads shared pages
+ * from where they were mapped at compile time
+ */
+static bool _Machine_copy_page(Machine* machine, u8 page) {
+    if (machine->ram_copies[page] != NULL) {
+        return true;
+    }
+    u8* copy = malloc(0x100);
+    if (copy == NULL) {
+        return false;
+    }
+    memcpy(copy, machine->image->ram + (page << 8), 0x100);
+    machine->ram_copies[page] = copy;
+    _Machine_map_ram_page(machine, page);
+    return true;
+}
+
+/* RAM as the machine sees it, copied pages and shared ones */
+void Machine_read_ram(Machine* machine, u8* ram) {
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+        const u8* source = machine->ram_copies[page] != NULL ? machine->ram_copies[page] : machine->image->ram + (page << 8);
+        memcpy(ram + (page << 8), source, 0x100);
+    }
+}
+
+/* Only the pages that differ are written, like a burst of writes to them would */
+bool Machine_write_ram(Machine* machine, const u8* ram) {
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+        const u8* current = machine->ram_copies[page] != NULL ? machine->ram_copies[page] : machine->image->ram + (page << 8);
+        if (memcmp(current, ram + (page << 8), 0x100) == 0) {
+            continue;
+        }
+        if (!_Machine_copy_page(machine, page)) {
+            return false;
+        }
+        memcpy(machine->ram_copies[page], ram + (page << 8), 0x100);
+        _Machine_map_ram_page(machine, page); // Drops code decoded from it
+    }
+    return true;
+}
+
+/* Moves the machine onto image, dropping its copied pages. RAM reads as image->ram afterwards */
+static void _Machine_set_image(Machine* machine, MachineImage* image) {
+    MachineImage_retain(image);
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+        free(machine->ram_copies[page]);
+        machine->ram_copies[page] = NULL;
+    }
+    MachineImage_release(machine->image);
+    machine->image = image;
+    _Machine_map(machine);
+}
+
+/* Machines on several threads can share one, so the count is atomic */
+static void _MachineROM_release(MachineROM* rom) {
+    if (__atomic_sub_fetch(&rom->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (rom->mapping != NULL) {
+            munmap(rom->mapping, rom->mapping_size);
+        }
+        free(rom);
+    }
+}
+
+/* An image with rom's ROM (it takes the caller's reference) and its RAM on the heap with it, all zeros */
+static MachineImage* _MachineImage_create_with_rom(MachineROM* rom) {
+    MachineImage* image = calloc(1, sizeof(MachineImage) + MACHINE_RAM_SIZE);
+    if (image == NULL) {
+        _MachineROM_release(rom);
+        return NULL;
+    }
+    image->rom = rom->data;
+    image->ram = (u8*)(image + 1);
+    image->references = 1;
+    image->rom_buffer = rom;
+    return image;
+}
+
+MachineImage* MachineImage_create(const u8* rom, u32 rom_size) {
+    MachineROM* buffer = calloc(1, sizeof(MachineROM) + MACHINE_ROM_SIZE);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->data = (u8*)(buffer + 1);
+    buffer->references = 1;
+    // Images smaller than the ROM sit at $8000, the rest reads as 0
+    if (rom_size > MACHINE_ROM_SIZE) {
+        rom_size = MACHINE_ROM_SIZE;
+    }
+    if (rom_size > 0) {
+        memcpy(buffer->data, rom, rom_size);
+    }
+    return _MachineImage_create_with_rom(buffer);
+}
+
+MachineImage* MachineImage_load(const char* path) {
+    FILE* rom_file = fopen(path, "rb");
+    if (rom_file == NULL) {
+        return NULL;
+    }
+    u8 data[MACHINE_ROM_SIZE];
+    size_t read_bytes = fread(data, 1, sizeof(data), rom_file);
+    fclose(rom_file);
+    if (read_bytes == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return MachineImage_create(data, read_bytes);
+}
+
+/* Machines on several threads can share one, so the count is atomic */
+void MachineImage_retain(MachineImage* image) {
+    __atomic_add_fetch(&image->references, 1, __ATOMIC_RELAXED);
+}
+
+void MachineImage_release(MachineImage* image) {
+    if (image != NULL && __atomic_sub_fetch(&image->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        _MachineROM_release(image->rom_buffer);
+        free(image);
+    }
+}
+
+Machine* Machine_create(void) {
+    MachineImage* image = MachineImage_create(NULL, 0);
+    if (image == NULL) {
+        return NULL;
+    }
+    Machine* machine = Machine_create_from_image(image);
+    MachineImage_release(image); // The machine has its own reference
+    return machine;
+}
+
+Machine* Machine_create_from_image(MachineImage* image) {
+    Machine* machine = calloc(1, sizeof(Machine));
+    if (machine == NULL) {
+        return NULL;
+    }
+    MachineImage_retain(image);
+    machine->image = image;
+    ACIA_init(&machine->acia, NULL, NULL);
+    Scheduler_init(&machine->scheduler);
+    Machine_reset(machine);
+    return machine;
+}
+
+void Machine_destroy(Machine* machine) {
+    if (machine == NULL) {
+        return;
+    }
+    AOT_destroy(machine->aot);
+    JIT_destroy(machine->jit);
+    CPU_set_decode_cache(&machine->cpu, 0); // Frees it
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+        free(machine->ram_copies[page]);
+    }
+    MachineImage_release(machine->image);
+    free(machine);
+}
+
+/* Like pressing the reset button, RAM keeps its contents */
+void Machine_reset(Machine* machine) {
+    CPU_reset(&machine->cpu, _Machine_read, _Machine_write, machine);
+    machine->cpu.trace = machine->trace;
+    machine->cpu.hooks = machine->hooks;
+    _Machine_map(machine);
+    _Machine_update_irq(machine);
+}
+
+/* Moves the machine onto a new image with another ROM, RAM keeps its contents */
+static void _Machine_switch_rom(Machine* machine, MachineImage* image) {
+    Machine_read_ram(machine, image->ram);
+    _Machine_set_image(machine, image); // Drops code decoded from the old ROM
+    MachineImage_release(image);
+    AOT_destroy(machine->aot); // Recompiled from the old ROM
+    machine->aot = NULL;
+}
+
+bool Machine_load_rom(Machine* machine, const char* path) {
+    MachineImage* image = MachineImage_load(path);
+    if (image == NULL) {
+        return false;
+    }
+    _Machine_switch_rom(machine, image);
+    return true;
+}
+
+bool Machine_load_rom_data(Machine* machine, const u8* data, u32 size) {
+    MachineImage* image = MachineImage_create(data, size);
+    if (image == NULL) {
+        return false;
+    }
+    _Machine_switch_rom(machine, image);
+    return true;
+}
+
+/* The machine moves onto the new image too, so it shares its RAM with the machines made from it.
+ * The ROM is the same buffer, so only the RAM pages it was sharing get mapped again: the ROM's
+ * mappings, decoded code and JIT blocks stay, and so do its copied pages, compiled code can
+ * point straight at them
+ */
+MachineImage* Machine_capture_image(Machine* machine) {
+    MachineROM* rom = machine->image->rom_buffer;
+    __atomic_add_fetch(&rom->references, 1, __ATOMIC_RELAXED);
+    MachineImage* image = _MachineImage_create_with_rom(rom);
+    if (image == NULL) {
+        return NULL;
+    }
+    Machine_read_ram(machine, image->ram);
+    MachineImage_retain(image);
+    MachineImage_release(machine->image);
+    machine->image = image;
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+        if (machine->ram_copies[page] == NULL) {
+            _Machine_map_ram_page(machine, page);
+        }
+    }
+    return image;
+}
+
+/* The machine moves onto the snapshot's image, so from then on the pages it
+ * shares are still as they were in it, and restoring only has to put its
+ * copied pages back.
+ */
+MachineSnapshot* Machine_snapshot(Machine* machine) {
+    MachineSnapshot* snapshot = malloc(sizeof(MachineSnapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    snapshot->image = Machine_capture_image(machine);
+    if (snapshot->image == NULL) {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->cpu = CPU_save_state(&machine->cpu);
+    snapshot->acia_control = machine->acia.control;
+    return snapshot;
+}
+
+void Machine_snapshot_destroy(MachineSnapshot* snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    MachineImage_release(snapshot->image);
+    free(snapshot);
+}
+
+/* After CPU_load_state, whose irq_lines has the ACIA's line as it was back then: it's brought in line
+ * with the control register and the input that's waiting now */
+static void _Machine_load_acia_control(Machine* machine, u8 control) {
+    machine->acia.control = control;
+    ACIA_poll(&machine->acia);
+    _Machine_update_irq(machine);
+}
+
+void Machine_restore(Machine* machine, const MachineSnapshot* snapshot) {
+    if (machine->image == snapshot->image) {
+        // Copied back into place rather than freed, compiled JIT code can point straight at them
+        for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+            if (machine->ram_copies[page] != NULL) {
+                memcpy(machine->ram_copies[page], snapshot->image->ram + (page << 8), 0x100);
+                _Machine_map_ram_page(machine, page); // Drops code decoded from it
+            }
+        }
+    } else {
+        if (machine->image->rom != snapshot->image->rom && memcmp(machine->image->rom, snapshot->image->rom, MACHINE_ROM_SIZE) != 0) {
+            AOT_destroy(machine->aot); // Recompiled from the old ROM
+            machine->aot = NULL;
+        }
+        _Machine_set_image(machine, snapshot->image);
+    }
+    CPU_load_state(&machine->cpu, &snapshot->cpu);
+    _Machine_load_acia_control(machine, snapshot->acia_control);
+}
+
+Machine* Machine_create_from_snapshot(const MachineSnapshot* snapshot) {
+    Machine* machine = Machine_create_from_image(snapshot->image);
+    if (machine == NULL) {
+        return NULL;
+    }
+    CPU_load_state(&machine->cpu, &snapshot->cpu);
+    _Machine_load_acia_control(machine, snapshot->acia_control);
+    return machine;
+}
+
+Machine* Machine_fork(Machine* machine) {
+    MachineSnapshot* snapshot = Machine_snapshot(machine);
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    Machine* fork = Machine_create_from_snapshot(snapshot);
+    Machine_snapshot_destroy(snapshot);
+    return fork;
+}
+
+/* Snapshot file header. The CPU state is spelled out field by field so the
+ * layout doesn't depend on the compiler, multi-byte fields are little-endian
+ * like every host this runs on.
+ */
+typedef struct MachineSnapshotHeader_s {
+    char magic[8];
+    u32  version;
+    u32  header_size;
+    u32  rom_offset;
+    u32  rom_size;
+    u32  ram_offset;
+    u32  ram_size;
+
+    u64  cycle_count;
+    u32  instruction_count_v2; /* instruction_count up to version 2, unused since */
+    u16  pc;
+    u16  access_address;
+    u16  indirect_address;
+    u16  old_pc;
+    u8   a;
+    u8   x;
+    u8   y;
+    u8   ir;
+    u8   p;
+    u8   sp;
+    u8   cycle;
+    u8   is_running;
+    u8   stop_reason;
+    u8   flag_n_source;
+    u8   flag_z_source;
+    u8   offset;
+    u8   reset_delay;
+    u8   compare_operand;
+    u8   found_address;
+    u8   irq_lines;        /* Were reserved (so 0) in files from before interrupts, which is right for them */
+    u8   nmi_pending;
+    u8   interrupt;
+    u8   waiting;
+    u8   acia_control;     /* Reserved in version 1 */
+    u64  instruction_count; /* Version 3 on, the header ended before it */
+} MachineSnapshotHeader;
+
+_Static_assert(sizeof(MachineSnapshotHeader) == 80, "The snapshot header layout changed, bump MACHINE_SNAPSHOT_VERSION");
+
+#define MACHINE_SNAPSHOT_ROM_OFFSET MACHINE_SNAPSHOT_ALIGN
+#define MACHINE_SNAPSHOT_RAM_OFFSET (MACHINE_SNAPSHOT_ROM_OFFSET + MACHINE_ROM_SIZE)
+
+bool Machine_snapshot_save(const MachineSnapshot* snapshot, const char* path) {
+    const CPUState* cpu = &snapshot->cpu;
+    MachineSnapshotHeader header = {
+        .version     = MACHINE_SNAPSHOT_VERSION,
+        .header_size = sizeof(MachineSnapshotHeader),
+        .rom_offset  = MACHINE_SNAPSHOT_ROM_OFFSET,
+        .rom_size    = MACHINE_ROM_SIZE,
+        .ram_offset  = MACHINE_SNAPSHOT_RAM_OFFSET,
+        .ram_size    = MACHINE_RAM_SIZE,
+
+        .cycle_count       = cpu->cycle_count,
+        .instruction_count = cpu->instruction_count,
+        .pc                = cpu->r.PC,
+        .access_address    = cpu->access_address,
+        .indirect_address  = cpu->indirect_address,
+        .old_pc            = cpu->old_pc,
+        .a                 = cpu->r.A,
+        .x                 = cpu->r.X,
+        .y                 = cpu->r.Y,
+        .ir                = cpu->r.IR,
+        .p                 = cpu->r.P,
+        .sp                = cpu->r.SP,
+        .cycle             = cpu->cycle,
+        .is_running        = cpu->is_running,
+        .stop_reason       = cpu->stop_reason,
+        .flag_n_source     = cpu->flag_n_source,
+        .flag_z_source     = cpu->flag_z_source,
+        .offset            = (u8)cpu->offset,
+        .reset_delay       = cpu->reset_delay,
+        .compare_operand   = cpu->compare_operand,
+        .found_address     = cpu->found_address,
+        .irq_lines         = cpu->irq_lines,
+        .nmi_pending       = cpu->nmi_pending,
+        .interrupt         = cpu->interrupt,
+        .waiting           = cpu->waiting,
+        .acia_control      = snapshot->acia_control,
+    };
+    memcpy(header.magic, MACHINE_SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    static const u8 padding[MACHINE_SNAPSHOT_ALIGN];
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(padding, MACHINE_SNAPSHOT_ROM_OFFSET - sizeof(header), 1, file) == 1
+                && fwrite(snapshot->image->rom, MACHINE_ROM_SIZE, 1, file) == 1
+                && fwrite(snapshot->image->ram, MACHINE_RAM_SIZE, 1, file) == 1;
+    if (fclose(file) != 0) {
+        written = false;
+    }
+    return written;
+}
+
+static bool _Machine_snapshot_header_valid(const MachineSnapshotHeader* header, size_t file_size) {
+    return memcmp(header->magic, MACHINE_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+        && header->version >= 1 && header->version <= MACHINE_SNAPSHOT_VERSION
+        && header->header_size >= (header->version >= 3 ? sizeof(MachineSnapshotHeader)
+                                                         : offsetof(MachineSnapshotHeader, instruction_count))
+        && header->rom_size == MACHINE_ROM_SIZE
+        && header->ram_size == MACHINE_RAM_SIZE
+        && header->rom_offset % MACHINE_SNAPSHOT_ALIGN == 0
+        && header->ram_offset % MACHINE_SNAPSHOT_ALIGN == 0
+        && (u64)header->rom_offset + header->rom_size <= file_size
+        && (u64)header->ram_offset + header->ram_size <= file_size;
+}
+
+/* No copying: the image's ROM and RAM are the file's own pages */
+MachineSnapshot* Machine_snapshot_load(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = info.st_size;
+    if (size < sizeof(MachineSnapshotHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    u8* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    const MachineSnapshotHeader* header = (const MachineSnapshotHeader*)mapping;
+    if (!_Machine_snapshot_header_valid(header, size)) {
+        munmap(mapping, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    MachineSnapshot* snapshot = malloc(sizeof(MachineSnapshot));
+    MachineImage* image = calloc(1, sizeof(MachineImage));
+    MachineROM* rom = calloc(1, sizeof(MachineROM));
+    if (snapshot == NULL || image == NULL || rom == NULL) {
+        free(snapshot);
+        free(image);
+        free(rom);
+        munmap(mapping, size);
+        return NULL;
+    }
+    rom->data         = mapping + header->rom_offset;
+    rom->references   = 1;
+    rom->mapping      = mapping;
+    rom->mapping_size = size;
+    image->rom        = rom->data;
+    image->ram        = mapping + header->ram_offset;
+    image->references = 1;
+    image->rom_buffer = rom;
+    snapshot->image = image;
+
+    CPUState* cpu = &snapshot->cpu;
+    *cpu = (CPUState){
+        .r = {
+            .A  = header->a,
+            .X  = header->x,
+            .Y  = header->y,
+            .IR = header->ir,
+            .P  = header->p,
+            .PC = header->pc,
+            .SP = header->sp,
+        },
+        .cycle             = header->cycle,
+        .is_running        = header->is_running,
+        .stop_reason       = header->stop_reason,
+        .instruction_count = header->version >= 3 ? header->instruction_count : header->instruction_count_v2,
+        .cycle_count       = header->cycle_count,
+        .flag_n_source     = header->flag_n_source,
+        .flag_z_source     = header->flag_z_source,
+        .offset            = (i8)header->offset,
+        .reset_delay       = header->reset_delay,
+        .compare_operand   = header->compare_operand,
+        .access_address    = header->access_address,
+        .indirect_address  = header->indirect_address,
+        .old_pc            = header->old_pc,
+        .found_address     = header->found_address,
+        .irq_lines         = header->irq_lines,
+        .nmi_pending       = header->nmi_pending,
+        .interrupt         = header->interrupt,
+        .waiting           = header->waiting,
+    };
+    snapshot->acia_control = header->acia_control;
+    return snapshot;
+}
+
+MachineMemoryStats Machine_get_memory_stats(Machine* machine) {
+    MachineMemoryStats stats = {MACHINE_ROM_PAGES, 0, CPU_get_decode_cache_entries(&machine->cpu) * sizeof(DecodedInstruction)};
+    for (u8 page = 0; page < MACHINE_RAM_PAGES; page++) {
+        if (machine->ram_copies[page] != NULL) {
+            stats.private_pages++;
+        } else {
+            stats.shared_pages++;
+        }
+    }
+    return stats;
+}
+
+bool Machine_enable_jit(Machine* machine) {
+    if (machine->jit == NULL) {
+        machine->jit = JIT_create(&machine->cpu);
+    }
+    return machine->jit != NULL;
+}
+
+/* Only works when program was recompiled from the ROM that's loaded now */
+bool Machine_enable_aot(Machine* machine, const AOTProgram* program) {
+    if (machine->aot == NULL) {
+        machine->aot = AOT_create(&machine->cpu, program);
+    }
+    return machine->aot != NULL;
+}
+
+void Machine_set_trace(Machine* machine, Trace* trace) {
+    machine->trace = trace;
+    machine->cpu.trace = trace;
+}
+
+void Machine_set_profile(Machine* machine, Profile* profile) {
+    machine->profile = profile;
+}
+
+void Machine_set_paced(Machine* machine, bool paced) {
+    machine->paced = paced;
+}
+
+void Machine_set_hooks(Machine* machine, Hooks* hooks) {
+    machine->hooks = hooks;
+    CPU_set_hooks(&machine->cpu, hooks);
+    if (machine->jit != NULL) {
+        JIT_flush(machine->jit); // Blocks compiled through what's hooked now
+    }
+}
+
+/* ACIA_poll and the IRQ line with it, recorded when it changes whether input is waiting */
+static void _Machine_poll(Machine* machine) {
+    bool rx_full = machine->acia.rx_full;
+    if (ACIA_poll(&machine->acia) != rx_full) {
+        _Machine_record(machine, MACHINE_INPUT_POLL, machine->cpu.cycle_count, 0);
+    }
+    _Machine_update_irq(machine);
+}
+
+/* The scheduler events of a connected ACIA. They come back counting from now rather than from when
+ * they were due, so after an idle loop was skipped they run once instead of catching up.
+ * Machine_connect_acia cancels them on disconnecting, one that finds its side gone anyway just ends */
+static void _Machine_poll_acia(void* context, u64 cycle) {
+    (void)cycle;
+    Machine* machine = context;
+    if (machine->acia.input == NULL) {
+        return;
+    }
+    _Machine_poll(machine);
+    Scheduler_add(&machine->scheduler, machine->cpu.cycle_count + MACHINE_ACIA_POLL_CYCLES, _Machine_poll_acia, machine);
+}
+
+/* Output that hasn't been flushed by a newline, a full buffer or an input read goes out on this timer */
+static void _Machine_flush_acia(void* context, u64 cycle) {
+    (void)cycle;
+    Machine* machine = context;
+    if (machine->acia.output == NULL) {
+        return;
+    }
+    SerialOutput_flush(machine->acia.output);
+    Scheduler_add(&machine->scheduler, machine->cpu.cycle_count + MACHINE_ACIA_FLUSH_CYCLES, _Machine_flush_acia, machine);
+}
+
+/* Only polled and flushed while connected, a machine without devices runs Machine_run in one go */
+static void _Machine_schedule_acia(Machine* machine) {
+    Scheduler_cancel(&machine->scheduler, _Machine_poll_acia, machine);
+    Scheduler_cancel(&machine->scheduler, _Machine_flush_acia, machine);
+    if (machine->acia.input != NULL) {
+        Scheduler_add(&machine->scheduler, machine->cpu.cycle_count, _Machine_poll_acia, machine);
+    }
+    if (machine->acia.output != NULL) {
+        Scheduler_add(&machine->scheduler, machine->cpu.cycle_count + MACHINE_ACIA_FLUSH_CYCLES, _Machine_flush_acia, machine);
+    }
+}
+
+void Machine_connect_acia(Machine* machine, SerialInput* input, SerialOutput* output) {
+    u8 control = machine->acia.control;
+    bool rx_full = machine->acia.rx_full;
+    if (machine->acia.output != NULL) {
+        SerialOutput_flush(machine->acia.output);
+    }
+    ACIA_init(&machine->acia, input, output);
+    machine->acia.control = control;
+    if (rx_full) {
+        _Machine_record(machine, MACHINE_INPUT_POLL, machine->cpu.cycle_count, 0); // Input that was waiting went with it
+    }
+    _Machine_schedule_acia(machine);
+    _Machine_update_irq(machine);
+}
+
+bool Machine_schedule(Machine* machine, u64 cycle, scheduler_fn_ptr callback, void* context) {
+    return Scheduler_add(&machine->scheduler, cycle, callback, context);
+}
+
+/* Profiles and traces are only recorded by the interpreter, so they leave the AOT and JIT aside.
+ * The AOT's blocks were cut without knowing about hooks, so hooks leave it aside too */
+static RunResult _Machine_run_slice(Machine* machine, u64 cycle_budget) {
+    if (machine->profile != NULL) {
+        return Profile_run(machine->profile, &machine->cpu, cycle_budget);
+    }
+    if (machine->trace != NULL) {
+        return CPU_run(&machine->cpu, cycle_budget);
+    }
+    if (machine->aot != NULL && machine->hooks == NULL) {
+        return AOT_run(machine->aot, cycle_budget);
+    }
+    if (machine->jit != NULL) {
+        return JIT_run(machine->jit, cycle_budget);
+    }
+    return CPU_run(&machine->cpu, cycle_budget);
+}
+
+static u64 _Machine_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Code bytes, without going through read_fn: false if any of them is behind I/O */
+static bool _Machine_peek_code(CPU* cpu, u16 address, u8* bytes, u32 count) {
+    for (u32 i = 0; i < count; i++, address++) {
+        u8* page = cpu->read_pages[address >> 8];
+        if (page == NULL) {
+            return false;
+        }
+        bytes[i] = page[address & 0xFF];
+    }
+    return true;
+}
+
+/* Whether opcode only tests what load put in its register, against an immediate */
+static bool _Machine_is_idle_test(u8 load, u8 opcode) {
+    switch (load) {
+        case 0xAD: return opcode == 0x29 || opcode == 0x09 || opcode == 0x49 || opcode == 0xC9; // LDA: AND ORA EOR CMP
+        case 0xAE: return opcode == 0xE0; // LDX: CPX
+        case 0xAC: return opcode == 0xC0; // LDY: CPY
+        default:   return false;          // BIT: it's all in the flags already
+    }
+}
+
+/* Matches a loop that does nothing but poll the ACIA status: a load of it (LDA, LDX, LDY or
+ * BIT abs), up to two immediate tests of what it loaded, then a branch back to the load, or a
+ * branch out followed by a JMP back. Everything it changes only depends on the status, so once
+ * it has been round it's in the same state every time round, for as long as the status stays.
+ * Returns how many instructions one round takes, 0 if the code at start isn't such a loop.
+ */
+static u32 _Machine_match_idle_loop(CPU* cpu, u16 start) {
+    u8 code[12]; // The longest: load, two tests, branch, JMP
+    u16 status = MACHINE_ACIA_BASE + ACIA_STATUS;
+    if (!_Machine_peek_code(cpu, start, code, sizeof(code))) {
+        return 0;
+    }
+    if ((code[0] != 0xAD && code[0] != 0xAE && code[0] != 0xAC && code[0] != 0x2C) ||
+        (code[1] | code[2] << 8) != status) {
+        return 0;
+    }
+    u32 offset = 3;
+    u32 count = 1;
+    while (count < 3 && _Machine_is_idle_test(code[0], code[offset])) {
+        offset += 2;
+        count++;
+    }
+    if ((code[offset] & 0x1F) != 0x10) { // Bxx
+        return 0;
+    }
+    u16 target = start + offset + 2 + (i8)code[offset + 1];
+    offset += 2;
+    count++;
+    if (target == start) {
+        return count;
+    }
+    if (code[offset] == 0x4C && (code[offset + 1] | code[offset + 2] << 8) == start) {
+        return count + 1;
+    }
+    return 0;
+}
+
+/* The earliest event a skipped idle loop has to stop for: the ACIA's own are all about input,
+ * which wakes the sleep up anyway, and output, which is flushed before sleeping */
+static u64 _Machine_next_wake(Machine* machine) {
+    u64 next = SCHEDULER_NEVER;
+    for (u32 i = 0; i < machine->scheduler.count; i++) {
+        SchedulerEvent* event = &machine->scheduler.events[i];
+        if (event->callback != _Machine_poll_acia && event->callback != _Machine_flush_acia && event->cycle < next) {
+            next = event->cycle;
+        }
+    }
+    return next;
+}
+
+/* Lets up to cycles of guest time go by on the host clock, flushing output first. With wake_on_input
+ * it's cut short by input showing up. Returns the cycles that actually went by, cycles at most
+ */
+static u64 _Machine_sleep(Machine* machine, u64 cycles, bool wake_on_input) {
+    if (cycles > MACHINE_CLOCK_HZ) {
+        cycles = MACHINE_CLOCK_HZ; // Sleeps a second at most, whatever the budget
+    }
+    if (machine->acia.output != NULL) {
+        SerialOutput_flush(machine->acia.output); // Whatever it prompted with before waiting
+    }
+    u64 started = _Machine_now_ns();
+    u64 timeout = cycles * 1000000000ull / MACHINE_CLOCK_HZ;
+    if (wake_on_input) {
+        SerialInput_wait(machine->acia.input, timeout);
+    } else {
+        struct timespec ts = {timeout / 1000000000ull, timeout % 1000000000ull};
+        nanosleep(&ts, NULL);
+    }
+    u64 slept = (_Machine_now_ns() - started) * MACHINE_CLOCK_HZ / 1000000000ull;
+    return slept < cycles ? slept : cycles; // Woken up early, only the time that went by
+}
+
+/* Called with the CPU stopped by _Machine_empty_poll: if it's in an idle loop, goes round it once
+ * for real and then skips as many whole rounds as fit before cycle_limit (or the next event),
+ * sleeping through them while input can still show up. Returns the cycles it took the CPU forward.
+ */
+static u64 _Machine_idle(Machine* machine, u64 cycle_limit) {
+    CPU* cpu = &machine->cpu;
+    u16 start = cpu->r.PC;
+    u32 count = 0;
+    if (cpu->cycle == 0 && cpu->reset_delay == 0xFF && cpu->interrupt == CPU_INTERRUPT_NONE) {
+        count = _Machine_match_idle_loop(cpu, start);
+        if (count == 0) {
+            start -= 3; // Stopped right after the load
+            count = _Machine_match_idle_loop(cpu, start);
+        }
+    }
+    u64 cycles = 0;
+    for (u32 i = 0; count > 0 && cpu->r.PC != start && i < count && cpu->is_running; i++) {
+        cycles += CPU_step_instruction(cpu);
+    }
+    u64 round_start = cpu->cycle_count;
+    for (u32 i = 0; count > 0 && (i > 0 || cpu->r.PC == start) && i < count && cpu->is_running; i++) {
+        cycles += CPU_step_instruction(cpu); // Once round for real, after which it's in its steady state
+    }
+    u64 round = cpu->cycle_count - round_start;
+    if (count == 0 || cpu->r.PC != start || !cpu->is_running || machine->acia.rx_full || CPU_interrupt_due(cpu) || round == 0) {
+        machine->idle_backoff = cpu->cycle_count + MACHINE_IDLE_BACKOFF; // Polling, but doing something else too
+        return cycles;
+    }
+
+    u64 skip = cycle_limit > cycles ? cycle_limit - cycles : 0;
+    u64 next = _Machine_next_wake(machine);
+    if (next <= cpu->cycle_count) {
+        skip = 0; // Came due while going round
+    } else if (next - cpu->cycle_count < skip) {
+        skip = next - cpu->cycle_count;
+    }
+    if (machine->acia.input != NULL && !machine->paced && skip >= round) {
+        skip = _Machine_sleep(machine, skip, true);
+    }
+    u64 rounds = skip / round; // Never past the budget or the event, the CPU runs the rest of the way
+    MachineInputLog* log = machine->input_log;
+    if (log != NULL && log->replaying && log->next_read < log->count) { // One status read a round, the one that found input runs
+        u64 reads = log->events[log->next_read].position - machine->acia_reads;
+        if (rounds >= reads) {
+            rounds = reads > 0 ? reads - 1 : 0;
+        }
+    }
+    cpu->cycle_count += rounds * round;
+    cpu->instruction_count += rounds * count;
+    machine->acia_reads += rounds;
+    return cycles + rounds * round;
+}
+
+/* Called while WAI has the CPU parked: nothing runs until a device raises a line, so the CPU goes
+ * straight to cycle_limit or the next event, sleeping through it like an idle loop does. Input wakes
+ * the sleep up when it raises the ACIA's IRQ, the line is brought up to date right away
+ * rather than at the next poll. Returns the cycles it took the CPU forward.
+ */
+static u64 _Machine_wait(Machine* machine, u64 cycle_limit) {
+    CPU* cpu = &machine->cpu;
+    u64 skip = cycle_limit;
+    u64 next = _Machine_next_wake(machine);
+    if (next - cpu->cycle_count < skip) { // Machine_run ran whatever was due, so next is still ahead
+        skip = next - cpu->cycle_count;
+    }
+    if (machine->acia.input != NULL && !machine->paced) {
+        skip = _Machine_sleep(machine, skip, machine->acia.control & ACIA_CONTROL_RX_IRQ);
+    }
+    cpu->cycle_count += skip;
+    if (machine->acia.input != NULL) {
+        _Machine_poll(machine); // Recorded at the cycle it woke up on
+    }
+    return skip;
+}
+
+/* Running on after being taken back (not replaying), the input recorded after that point didn't happen */
+static void _Machine_go_on(Machine* machine) {
+    if (machine->input_log != NULL && !machine->input_log->replaying) {
+        machine->input_log->count = machine->input_log->position;
+    }
+}
+
+/* Runs up to the next event, runs the events that are due, and so on until the budget is spent */
+RunResult Machine_run(Machine* machine, u64 cycle_budget) {
+    CPU* cpu = &machine->cpu;
+    _Machine_go_on(machine);
+    if (cpu->cycle_count < machine->scheduler_cycle) { // Reset, restored or rewound, events stay as far ahead as they were
+        Scheduler_shift(&machine->scheduler, (i64)(cpu->cycle_count - machine->scheduler_cycle));
+        machine->idle_poll_cycle = machine->idle_backoff = 0;
+    }
+    RunResult result = {0, STOP_BUDGET};
+    while (result.reason == STOP_BUDGET && result.cycles < cycle_budget) {
+        Scheduler_run_due(&machine->scheduler, cpu->cycle_count);
+        if (CPU_is_waiting(cpu)) {
+            result.cycles += _Machine_wait(machine, cycle_budget - result.cycles);
+            continue;
+        }
+        u64 slice = cycle_budget - result.cycles;
+        u64 next = Scheduler_next(&machine->scheduler);
+        if (next - cpu->cycle_count < slice) {
+            slice = next - cpu->cycle_count;
+        }
+        RunResult run = _Machine_run_slice(machine, slice);
+        result.cycles += run.cycles;
+        result.reason  = run.reason;
+        if (run.reason == STOP_REQUESTED && machine->idle_pending) {
+            result.cycles += _Machine_idle(machine, result.cycles < cycle_budget ? cycle_budget - result.cycles : 0);
+            result.reason  = cpu->is_running ? STOP_BUDGET : cpu->stop_reason;
+            machine->idle_pending = false;
+        }
+    }
+    machine->scheduler_cycle = cpu->cycle_count;
+    return result;
+}
+
+u32 Machine_step_instruction(Machine* machine) {
+    CPU* cpu = &machine->cpu;
+    _Machine_go_on(machine);
+    Scheduler_run_due(&machine->scheduler, cpu->cycle_count);
+    u32 cycles = 0;
+    if (CPU_is_waiting(cpu)) {
+        u64 next = Scheduler_next(&machine->scheduler);
+        if (next != SCHEDULER_NEVER) {
+            cycles = _Machine_wait(machine, next - cpu->cycle_count);
+        }
+    } else if (cpu->is_running) {
+        cycles = CPU_step_instruction(cpu);
+    }
+    machine->scheduler_cycle = cpu->cycle_count;
+    return cycles;
+}
+
+void Machine_emulate(Machine* machine) {
+    CPU* cpu = &machine->cpu;
+    _Machine_go_on(machine);
+    if (cpu->cycle == 0 && cpu->reset_delay == 0xFF) {
+        Scheduler_run_due(&machine->scheduler, cpu->cycle_count);
+    }
+    CPU_emulate(cpu);
+    machine->scheduler_cycle = cpu->cycle_count;
+}
+
+void Machine_set_input_log(Machine* machine, MachineInputLog* log) {
+    machine->input_log = log;
+}
+
+MachineDeviceState Machine_save_devices(Machine* machine) {
+    return (MachineDeviceState){machine->acia.rx_full, machine->acia.control, machine->acia_reads};
+}
+
+/* The events replace whatever is scheduled now, counting from the cycle the CPU was loaded at */
+void Machine_load_devices(Machine* machine, const MachineDeviceState* state, const SchedulerEvent* events, u32 event_count) {
+    machine->acia.rx_full = state->acia_rx_full;
+    machine->acia.control = state->acia_control;
+    machine->acia_reads   = state->acia_reads;
+    _Machine_update_irq(machine);
+    Scheduler_init(&machine->scheduler);
+    for (u32 i = 0; i < event_count; i++) {
+        Scheduler_add(&machine->scheduler, events[i].cycle, events[i].callback, events[i].context);
+    }
+    machine->scheduler_cycle = machine->cpu.cycle_count;
+    machine->idle_poll_cycle = machine->idle_backoff = 0;
+    machine->idle_pending = false;
+}
+
+/* Polls replayed from the log, each one schedules the next */
+static void _Machine_replay_poll(void* context, u64 cycle) {
+    (void)cycle;
+    Machine* machine = context;
+    MachineInputLog* log = machine->input_log;
+    if (log == NULL || !log->replaying || log->next_poll == log->count) {
+        return;
+    }
+    machine->acia.rx_full = log->events[log->next_poll].rx_full;
+    _Machine_update_irq(machine);
+    log->next_poll = _Machine_next_logged(log, log->next_poll + 1, true);
+    if (log->next_poll < log->count) {
+        Scheduler_add(&machine->scheduler, log->events[log->next_poll].position, _Machine_replay_poll, machine);
+    }
+}
+
+/* The ACIA is disconnected meanwhile, without its events and leaving what's waiting alone, so nothing
+ * is printed twice and input typed since stays there for when the machine carries on */
+void Machine_replay_input(Machine* machine, u32 from) {
+    MachineInputLog* log = machine->input_log;
+    if (!log->replaying) {
+        if (machine->acia.output != NULL) {
+            SerialOutput_flush(machine->acia.output);
+        }
+        log->input  = machine->acia.input;
+        log->output = machine->acia.output;
+        machine->acia.input  = NULL;
+        machine->acia.output = NULL;
+        _Machine_schedule_acia(machine);
+    }
+    log->replaying = true;
+    log->next_read = _Machine_next_logged(log, from, false);
+    log->next_poll = _Machine_next_logged(log, from, true);
+    if (log->next_poll < log->count) {
+        Scheduler_add(&machine->scheduler, log->events[log->next_poll].position, _Machine_replay_poll, machine);
+    }
+}
+
+/* What the guest sees of the ACIA now stays until its first poll, which records any difference */
+void Machine_stop_replay(Machine* machine) {
+    MachineInputLog* log = machine->input_log;
+    Scheduler_cancel(&machine->scheduler, _Machine_replay_poll, machine);
+    log->replaying = false;
+    log->position = log->next_read < log->next_poll ? log->next_read : log->next_poll;
+    machine->acia.input  = log->input;
+    machine->acia.output = log->output;
+    _Machine_schedule_acia(machine);
+}
@@ -1,103 +1,407 @@
-#include "cpu.h"
-#include <stdio.h>
-#include <unistd.h>
-#include <termios.h>
-#include <fcntl.h>
-#include <sys/select.h>
-
-unsigned char to_print;
-static struct termios oldt;
-
-void keyboard_init(void) {
-    struct termios newt;
-
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-
-    newt.c_lflag &= ~(ICANON | ECHO); // raw input
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-
-    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-}
-
-void keyboard_restore(void) {
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-}
-
-int read_key(void) {
-    unsigned char c;
-    if (read(STDIN_FILENO, &c, 1) == 1)
-        return c;      // key pressed
-    return 0;         // no key
-}
-
-int key_waiting(void) {
-    fd_set fds;
-    struct timeval tv = {0, 0};
-
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
-
-    return select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0;
-}
-
-FILE *romFile = NULL;
-u8 RAM[0x800]  = {0};
-u8 ROM[0x8000] = {0};
-
-/* For the CPU struct */
-u8 cpu_read(u16 address) {
-    u8 output_value = 0;
-    if (address == 0x5000) {
-        return read_key();
-    } else if (address == 0x5001) {
-        return (u8)key_waiting() << 3;
-    }
-    if (address < 0x2000) {
-        output_value = RAM[address & 0x7FF];
-    }
-    if (address >= 0x8000) {
-        output_value = ROM[address & 0x7FFF];
-    }
-    //printf("A=%04X D=%02X R\n", address, output_value);
-    return output_value;
-}
-void cpu_write(u16 address, u8 data) {
-    if (address == 0x5000) {
-        printf("%c", data); fflush(stdout);
-        return;
-    }
-    if (address < 0x2000) {
-        RAM[address & 0x7FF] = data;
-    }
-    //printf("A=%04X D=%02X W\n", address, data);
-}
-
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        printf("Not enough arguments!\n    Usage: ya6502 <rom file name or path>\n");
-        return 1;
-    }
-    keyboard_init();
-
-    romFile = fopen(argv[1], "rb");
-    guarantee(romFile != NULL, "Error opening file (does it exist?)");
-
-    fseek(romFile, 0, SEEK_SET);
-    size_t read_bytes = fread(ROM, 1, sizeof(ROM), romFile);
-    guarantee(read_bytes > 0, "Error reading file (is it empty?)");
-    fclose(romFile);
-
-    CPU cpu;
-    CPU_reset(&cpu, cpu_read, cpu_write);
-
-    while (cpu.is_running) {
-        CPU_emulate(&cpu);
-        //sleep_ms(2);
-        //printf("A=%02X   X=%02X    Y=%02X    P=%08B    IR=%02X    SP=%02X    PC=%04X    IC=%08X ", \
-                cpu.r.A, cpu.r.X,  cpu.r.Y,  cpu.r.P,  cpu.r.IR,  cpu.r.SP,  cpu.r.PC,  cpu.instruction_count);
-        //printf("AA=%04X IA=%04X C=%02d OC=%04X \n", cpu.access_address, cpu.indirect_address, cpu.cycle, cpu.old_pc);
-        //sleep(1);
-    }
-    keyboard_restore();
-}
\ No newline at end of file
+#define _DEFAULT_SOURCE // clock_gettime
+#include "machine.h"
+#include "farm.h"
+#include "batch.h"
+#include "rewind.h"
+#include "pacer.h"
+#include <time.h>
+#include <stdio.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <signal.h>
+
+/* The terminal is shared by the whole process, not part of any machine.
+ * Pipes and files are read as they are, the SerialInput thread doesn't need stdin non-blocking */
+bool keyboard_init(struct termios* saved) {
+    struct termios newt;
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, saved) != 0) {
+        return false;
+    }
+    newt = *saved;
+
+    newt.c_lflag &= ~(ICANON | ECHO); // raw input
+    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    return true;
+}
+
+void keyboard_restore(const struct termios* saved) {
+    tcsetattr(STDIN_FILENO, TCSANOW, saved);
+}
+
+/* Ctrl+C ends the run like --cycles running out, so the profile still gets written */
+static volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int signal_number) {
+    (void)signal_number;
+    interrupted = 1;
+}
+
+/* How many cycles the main loop hands to Machine_run at a time */
+#define RUN_SLICE_CYCLES 100000
+
+/* --clock rates: "1.0MHz", "500kHz", "1843200Hz", a bare number is in MHz. 0 if it isn't one */
+u64 parse_clock(const char* text) {
+    char* end;
+    double hz = strtod(text, &end);
+    if (strcasecmp(end, "MHz") == 0 || *end == '\0') {
+        hz *= 1e6;
+    } else if (strcasecmp(end, "kHz") == 0) {
+        hz *= 1e3;
+    } else if (strcasecmp(end, "Hz") != 0) {
+        return 0;
+    }
+    return hz >= 1 && hz < 1e10 ? (u64)(hz + 0.5) : 0;
+}
+
+/* --hle: wozmon's output routines run by the host. A, P, the output and the cycles come out the same
+ * as from the interpreter running the guest's code, only the stack below SP isn't written to.
+ * PRBYTE is left to the guest: it shifts with LSR A, which the interpreter doesn't have
+ */
+u32 hle_echo(CPU* cpu, void* context) {
+    (void)context;
+    CPU_write(cpu, MACHINE_ACIA_BASE + ACIA_DATA, cpu->r.A); // STA ACIA_DATA
+    return 4 + 5; // STA abs, RTS
+}
+
+/* The low nibble of A as a hex digit. The interpreter's ADC only sets N and Z, and doesn't do
+ * decimal mode, so a letter keeps the carry CMP #$3A left and V stays as it was
+ */
+u32 hle_prhex(CPU* cpu, void* context) {
+    (void)context;
+    u8 digit = (cpu->r.A & 0x0F) | '0';
+    u8 p = CPU_get_P(cpu) & ~(FLAGS_NEG | FLAGS_ZER | FLAGS_CAR);
+    u32 cycles = 2 + 2 + 2 + 3; // AND, ORA, CMP, BCC (taken or not)
+    if (digit < 0x3A) {
+        p |= FLAGS_NEG;          // CMP: digit - $3A
+    } else {
+        digit += 0x06 + 1;       // ADC #$06 with CMP's carry, $41-$46
+        p |= FLAGS_CAR;
+        cycles += 2;
+    }
+    cpu->r.A = digit;
+    CPU_set_P(cpu, p);
+    return cycles + hle_echo(cpu, NULL);
+}
+
+/* Decode cache entries for each --machines guest: 6KB instead of the default 96KB, hot loops still fit */
+#define FARM_DECODE_CACHE_ENTRIES 0x100
+
+/* Cycles per lane for --batch without --cycles */
+#define BATCH_DEFAULT_CYCLES 100000000
+
+/* Runs machine_count copies of the ROM headless (ACIA disconnected) and reports the speed */
+int run_farm(const char* rom_path, u32 machine_count, u32 thread_count, u64 cycle_limit, bool use_jit) {
+    Farm* farm = Farm_create(thread_count, FARM_DEFAULT_SLICE_CYCLES, cycle_limit);
+    guarantee(farm != NULL, "Error creating the farm");
+    Machine** machines = calloc(machine_count, sizeof(Machine*));
+    guarantee(machines != NULL, "Error creating the machines");
+    MachineImage* image = MachineImage_load(rom_path); // One copy of the ROM for all of them
+    guarantee(image != NULL, "Error reading file (does it exist? is it empty?)");
+
+    for (u32 i = 0; i < machine_count; i++) {
+        machines[i] = Machine_create_from_image(image);
+        guarantee(machines[i] != NULL, "Error creating the machines");
+        CPU_set_decode_cache(&machines[i]->cpu, FARM_DECODE_CACHE_ENTRIES);
+        #ifdef CPU_AOT
+        Machine_enable_aot(machines[i], &aot_program);
+        #endif
+        if (use_jit && machines[i]->aot == NULL) {
+            Machine_enable_jit(machines[i]);
+        }
+        Farm_add(farm, machines[i]);
+    }
+
+    Farm_run(farm);
+    Farm_print_stats(farm, stdout);
+
+    u32 private_pages = 0;
+    u64 decode_cache_bytes = 0;
+    for (u32 i = 0; i < machine_count; i++) {
+        MachineMemoryStats stats = Machine_get_memory_stats(machines[i]);
+        private_pages += stats.private_pages;
+        decode_cache_bytes += stats.decode_cache_bytes;
+    }
+    printf("Memory: %u pages shared by every machine, %u private pages (%.2f per machine), %.1fKB of decode cache per machine\n",
+           MACHINE_ROM_PAGES + MACHINE_RAM_PAGES, private_pages, (double)private_pages / machine_count,
+           decode_cache_bytes / 1024.0 / machine_count);
+
+    for (u32 i = 0; i < machine_count; i++) {
+        Machine_destroy(machines[i]);
+    }
+    MachineImage_release(image);
+    free(machines);
+    Farm_destroy(farm);
+    return 0;
+}
+
+/* How many instructions --rewind shows when the machine stops on BRK or an illegal opcode */
+#define HISTORY_INSTRUCTIONS 8
+
+/* Steps back through the last few instructions, oldest first, leaving the machine before the last one */
+void print_history(Rewind* rewind) {
+    CPU* cpu = &rewind->machine->cpu;
+    u64 last = cpu->instruction_count;
+    printf("\nLast instructions:\n");
+    for (u32 back = HISTORY_INSTRUCTIONS; back > 0; back--) {
+        if (last < back || !Rewind_to_instruction(rewind, last - back)) {
+            continue;
+        }
+        u8* page = cpu->read_pages[cpu->r.PC >> 8]; // Peeking at I/O could have side effects
+        printf("    PC=%04X    OP=%02X    A=%02X   X=%02X    Y=%02X    P=%02X    SP=%02X    IC=%08llX    CC=%llu\n",
+               cpu->r.PC, page != NULL ? page[cpu->r.PC & 0xFF] : 0, cpu->r.A, cpu->r.X, cpu->r.Y, CPU_get_P(cpu),
+               cpu->r.SP, cpu->instruction_count, cpu->cycle_count);
+    }
+}
+
+/* Runs one batch of BATCH_LANES headless copies of the ROM in lockstep and reports the speed */
+int run_batch(const char* rom_path, u64 cycle_limit) {
+    MachineImage* image = MachineImage_load(rom_path); // The batch only uses its ROM
+    guarantee(image != NULL, "Error reading file (does it exist? is it empty?)");
+    Batch* batch = Batch_create(image->rom, NULL, NULL, NULL);
+    guarantee(batch != NULL, "Error creating the batch");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    u64 cycles = Batch_run(batch, cycle_limit > 0 ? cycle_limit : BATCH_DEFAULT_CYCLES);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    u64 instructions = 0;
+    for (u32 lane = 0; lane < BATCH_LANES; lane++) {
+        instructions += batch->instruction_count[lane];
+    }
+    printf("%u lanes, %llu cycles in %.3fs: %.2f MHz total, %llu vector steps, %llu of %llu instructions run alone\n",
+           BATCH_LANES, cycles, seconds, seconds > 0 ? cycles / seconds / 1e6 : 0.0,
+           batch->vector_steps, batch->scalar_instructions, instructions);
+
+    Batch_destroy(batch);
+    MachineImage_release(image);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* rom_path = NULL;
+    bool use_jit = false;
+    bool use_batch = false;
+    const char* resume_path = NULL;
+    const char* save_path = NULL;
+    u32 rewind_kb = 0;
+    u32 trace_records = TRACE_DEFAULT_RECORDS;
+    bool trace_given = false;
+    const char* trace_path = TRACE_DEFAULT_PATH;
+    const char* profile_path = NULL;
+    const char* folded_path = NULL;
+    const char* symbols_path = NULL;
+    const char* serial_out_path = NULL;
+    u32 machine_count = 0;
+    u32 thread_count = 0;
+    u64 cycle_limit = 0;
+    u64 clock_hz = 0;
+    bool use_hle = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            use_batch = true;
+        } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewind_kb = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_records = strtoul(argv[++i], NULL, 0);
+            trace_given = true;
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+            folded_path = argv[++i];
+        } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+            symbols_path = argv[++i];
+        } else if (strcmp(argv[i], "--serial-out") == 0 && i + 1 < argc) {
+            serial_out_path = argv[++i];
+        } else if (strcmp(argv[i], "--machines") == 0 && i + 1 < argc) {
+            machine_count = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycle_limit = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--hle") == 0) {
+            use_hle = true;
+        } else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc) {
+            clock_hz = parse_clock(argv[++i]);
+            if (clock_hz == 0) {
+                printf("--clock takes a rate like 1.0MHz, 500kHz or 1843200Hz, not %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            rom_path = argv[i];
+        }
+    }
+    if (rom_path == NULL && resume_path == NULL) {
+        printf("Not enough arguments!\n    Usage: ya6502 [--jit] [--machines N [--threads N] [--cycles N]] [--batch [--cycles N]] <rom file name or path>\n"
+               "           ya6502 [--jit] [--clock rate] [--cycles N] [--save snapshot] [--rewind KB] [--trace N] [--trace-file path]\n"
+               "                  [--profile report] [--folded stacks] [--symbols listing] [--hle] [--serial-out file]\n"
+               "                  <rom file name or path | --resume snapshot>\n");
+        return 1;
+    }
+    if (use_batch) {
+        return run_batch(rom_path, cycle_limit);
+    }
+    if (machine_count > 0) {
+        return run_farm(rom_path, machine_count, thread_count, cycle_limit, use_jit);
+    }
+
+    Machine* machine = NULL;
+    if (resume_path != NULL) {
+        MachineSnapshot* snapshot = Machine_snapshot_load(resume_path);
+        guarantee(snapshot != NULL, "Error reading snapshot (does it exist? is it a snapshot?)");
+        machine = Machine_create_from_snapshot(snapshot);
+        Machine_snapshot_destroy(snapshot); // The machine keeps the file mapped
+        guarantee(machine != NULL, "Error creating the machine");
+    } else {
+        machine = Machine_create();
+        guarantee(machine != NULL, "Error creating the machine");
+        guarantee(Machine_load_rom(machine, rom_path), "Error reading file (does it exist? is it empty?)");
+    }
+    SerialInput* input = SerialInput_create(STDIN_FILENO);
+    guarantee(input != NULL, "Error starting the input thread");
+    // The guest's output as raw bytes when it goes to a file, a line at a time on a terminal
+    FILE* serial_file = serial_out_path != NULL ? fopen(serial_out_path, "wb") : stdout;
+    guarantee(serial_file != NULL, "Error opening the serial output file");
+    SerialOutput* output = SerialOutput_create(serial_file, serial_out_path == NULL && isatty(STDOUT_FILENO));
+    guarantee(output != NULL, "Error creating the serial output");
+    Machine_connect_acia(machine, input, output);
+
+    #ifdef CPU_AOT
+    if (!Machine_enable_aot(machine, &aot_program)) {
+        printf("This build was recompiled for a different ROM, interpreting instead\n");
+    }
+    #endif
+
+    if (use_jit && machine->aot == NULL && !Machine_enable_jit(machine)) {
+        printf("The JIT isn't supported on this host, interpreting instead\n");
+    }
+
+    // On by default, but it keeps Machine_run in the interpreter, so the JIT and AOT only get it if asked for
+    if (!trace_given && (machine->aot != NULL || machine->jit != NULL)) {
+        trace_records = 0;
+    }
+    Trace* trace = NULL;
+    if (trace_records > 0) {
+        trace = Trace_create(trace_records);
+        guarantee(trace != NULL, "Error creating the trace");
+        Machine_set_trace(machine, trace);
+    }
+
+    Profile* profile = NULL;
+    if (profile_path != NULL || folded_path != NULL) {
+        profile = Profile_create();
+        guarantee(profile != NULL, "Error creating the profile");
+        // The assemble target's listing, when there is one
+        if (!Profile_load_symbols(profile, symbols_path != NULL ? symbols_path : "a.txt") && symbols_path != NULL) {
+            perror("Error reading the symbols, reporting bare addresses");
+        }
+        Machine_set_profile(machine, profile);
+    }
+
+    Hooks* hooks = NULL;
+    if (use_hle) {
+        hooks = Hooks_create();
+        guarantee(hooks != NULL, "Error creating the hooks");
+        static const struct { const char* name; hook_fn_ptr fn; } routines[] = {
+            {"ECHO", hle_echo}, {"PRHEX", hle_prhex},
+        };
+        for (u32 i = 0; i < sizeof(routines) / sizeof(routines[0]); i++) {
+            if (!Hooks_add_symbol(hooks, symbols_path != NULL ? symbols_path : "a.txt", routines[i].name, routines[i].fn, NULL)) {
+                fprintf(stderr, "%s isn't in the listing (%s), the guest runs its own\n", routines[i].name, strerror(errno));
+            }
+        }
+        Machine_set_hooks(machine, hooks);
+    }
+
+    Rewind* rewind = NULL;
+    if (rewind_kb > 0) {
+        rewind = Rewind_create(machine, REWIND_DEFAULT_INTERVAL, (size_t)rewind_kb * 1024);
+        guarantee(rewind != NULL, "Error creating the rewind buffer");
+    }
+
+    struct termios saved_terminal;
+    bool is_terminal = keyboard_init(&saved_terminal);
+    signal(SIGINT, on_interrupt);
+
+    // --clock runs it in short slices and sleeps after each one, otherwise it goes as fast as it can
+    Pacer pacer;
+    u64 run_slice = RUN_SLICE_CYCLES;
+    if (clock_hz > 0) {
+        Machine_set_paced(machine, true);
+        Pacer_init(&pacer, clock_hz);
+        run_slice = Pacer_slice_cycles(&pacer);
+    }
+    u64 cycles_left = cycle_limit > 0 ? cycle_limit : ~0ull; // --cycles stops it early, for --save
+    while (machine->cpu.is_running && cycles_left > 0 && !interrupted) {
+        u64 slice = cycles_left < run_slice ? cycles_left : run_slice;
+        u64 cycles = rewind != NULL ? Rewind_run(rewind, slice).cycles : Machine_run(machine, slice).cycles;
+        cycles_left = cycles < cycles_left ? cycles_left - cycles : 0; // The last instruction can go past the budget
+        if (clock_hz > 0) {
+            Pacer_wait(&pacer, cycles);
+        }
+    }
+    Machine_set_profile(machine, NULL);
+    // Before print_history, going back runs the machine again and that would be traced too
+    if (trace != NULL && !machine->cpu.is_running) {
+        Machine_set_trace(machine, NULL);
+        if (Trace_dump(trace, &machine->cpu, trace_path)) {
+            printf("Trace of the last instructions written to %s (ya6502-tracedump reads it)\n", trace_path);
+        } else {
+            perror("Error writing the trace");
+        }
+    }
+    if (rewind != NULL && (machine->cpu.stop_reason == STOP_BRK || machine->cpu.stop_reason == STOP_ILLEGAL)) {
+        print_history(rewind);
+    }
+    Rewind_destroy(rewind);
+    if (profile != NULL) {
+        FILE* file = profile_path != NULL ? fopen(profile_path, "w") : NULL;
+        if (file != NULL) {
+            Profile_write_report(profile, file, PROFILE_DEFAULT_TOP);
+            fclose(file);
+        } else if (profile_path != NULL) {
+            perror("Error writing the profile");
+        }
+        file = folded_path != NULL ? fopen(folded_path, "w") : NULL;
+        if (file != NULL) {
+            Profile_write_folded(profile, file);
+            fclose(file);
+        } else if (folded_path != NULL) {
+            perror("Error writing the folded stacks");
+        }
+        Profile_destroy(profile);
+    }
+    if (save_path != NULL) {
+        MachineSnapshot* snapshot = Machine_snapshot(machine);
+        if (snapshot == NULL || !Machine_snapshot_save(snapshot, save_path)) {
+            perror("Error saving snapshot");
+        }
+        Machine_snapshot_destroy(snapshot);
+    }
+    Machine_destroy(machine);
+    Hooks_destroy(hooks);
+    SerialInput_destroy(input);
+    SerialOutput_destroy(output);
+    if (serial_file != stdout) {
+        fclose(serial_file);
+    }
+    Trace_destroy(trace);
+    if (is_terminal) {
+        keyboard_restore(&saved_terminal);
+    }
+    if (clock_hz > 0) {
+        Pacer_print_stats(&pacer, stdout);
+    }
+}
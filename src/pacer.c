@@ -0,0 +1,65 @@
+#define _DEFAULT_SOURCE // clock_nanosleep
+#include "pacer.h"
+#include <time.h>
+
+static u64 _Pacer_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Split so hours of cycles don't overflow */
+static u64 _Pacer_cycles_to_ns(const Pacer* pacer, u64 cycles) {
+    return cycles / pacer->hz * 1000000000ull + cycles % pacer->hz * 1000000000ull / pacer->hz;
+}
+
+void Pacer_init(Pacer* pacer, u64 hz) {
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->hz = hz > 0 ? hz : 1;
+    pacer->start_ns = pacer->began_ns = _Pacer_now_ns();
+}
+
+u64 Pacer_slice_cycles(const Pacer* pacer) {
+    u64 cycles = pacer->hz / (1000000000ull / PACER_SLICE_NS);
+    return cycles > 0 ? cycles : 1;
+}
+
+void Pacer_wait(Pacer* pacer, u64 cycles) {
+    pacer->cycles += cycles;
+    u64 deadline = pacer->start_ns + _Pacer_cycles_to_ns(pacer, pacer->cycles);
+    u64 now = _Pacer_now_ns();
+    if (now < deadline) {
+        struct timespec ts = {deadline / 1000000000ull, deadline % 1000000000ull};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL); // A signal cutting it short only makes the next slice early
+        now = _Pacer_now_ns();
+        u64 late = now > deadline ? now - deadline : 0;
+        pacer->sleeps++;
+        pacer->late_ns += late;
+        if (late > pacer->max_late_ns) {
+            pacer->max_late_ns = late;
+        }
+        return;
+    }
+    // Behind: no sleep, the next slices run straight away until it has caught up
+    u64 lag = now - deadline;
+    if (lag > pacer->max_lag_ns) {
+        pacer->max_lag_ns = lag;
+    }
+    if (lag > PACER_MAX_LAG_NS) {
+        pacer->start_ns += lag - PACER_MAX_LAG_NS;
+        pacer->dropped_ns += lag - PACER_MAX_LAG_NS;
+        pacer->drops++;
+    }
+}
+
+void Pacer_print_stats(const Pacer* pacer, FILE* out) {
+    u64 wall_ns = _Pacer_now_ns() - pacer->began_ns;
+    u64 guest_ns = _Pacer_cycles_to_ns(pacer, pacer->cycles);
+    double drift_ms = ((double)wall_ns - (double)guest_ns) / 1e6; // Positive: the guest is behind real time
+    fprintf(out, "Clock: %.6f MHz target, %.6f MHz over %.3fs, %+.3fms drift (%.3fms given up in %llu catch-ups)\n",
+            pacer->hz / 1e6, wall_ns ? pacer->cycles * 1000.0 / wall_ns : 0.0, wall_ns / 1e9, drift_ms,
+            pacer->dropped_ns / 1e6, pacer->drops);
+    fprintf(out, "    %llu sleeps woke up %.1fus late on average, %.1fus at worst; %.3fms behind at worst\n",
+            pacer->sleeps, pacer->sleeps ? pacer->late_ns / 1e3 / pacer->sleeps : 0.0, pacer->max_late_ns / 1e3,
+            pacer->max_lag_ns / 1e6);
+}
@@ -0,0 +1,329 @@
+#include "profile.h"
+#define _EMULATE_W65C02S // Same opcode set as cpu.c
+#include "opcodes.h"
+#include <ctype.h>
+
+#define PROFILE_JSR 0x20
+
+static const char* const mnemonics[256] = {
+    #define X(opcode, op, mode) [opcode] = #op,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) [opcode] = #mnemonic,
+    CPU_OTHER_OPCODES(X)
+    CPU_W65C02S_OPCODES(X)
+    #undef X
+};
+
+/* A row of one of the report's tables */
+typedef struct ProfileEntry_s {
+    u32 key;
+    u64 instructions;
+    u64 cycles;
+} ProfileEntry;
+
+Profile* Profile_create(void) {
+    Profile* profile = calloc(1, sizeof(Profile));
+    if (profile == NULL) {
+        return NULL;
+    }
+    profile->node_capacity = 256;
+    profile->nodes = calloc(profile->node_capacity, sizeof(ProfileNode));
+    if (profile->nodes == NULL) {
+        free(profile);
+        return NULL;
+    }
+    profile->node_count = 1; // The root
+    return profile;
+}
+
+void Profile_destroy(Profile* profile) {
+    if (profile == NULL) {
+        return;
+    }
+    free(profile->nodes);
+    free(profile->symbols);
+    free(profile);
+}
+
+static int _Profile_compare_symbols(const void* a, const void* b) {
+    const ProfileSymbol* left  = a;
+    const ProfileSymbol* right = b;
+    return (int)left->address - (int)right->address;
+}
+
+/* Code lines in a 64tass listing are tab separated: ".offset  PC  hex  monitor  source",
+ * a label is the first word of the source column when it ends with a colon
+ */
+bool Profile_parse_label(char* line, u16* address, char* name) {
+    if (line[0] != '.') {
+        return false;
+    }
+    char* field = strchr(line, '\t');
+    if (field == NULL) {
+        return false;
+    }
+    *address = strtoul(field + 1, &field, 16);
+    while ((field = strchr(field, '\t')) != NULL) {
+        field++;
+        if (!isalpha((unsigned char)*field) && *field != '_') {
+            continue;
+        }
+        size_t length = strcspn(field, " \t\r\n");
+        if (length > 1 && length <= PROFILE_SYMBOL_LENGTH && field[length - 1] == ':') {
+            memcpy(name, field, length - 1);
+            name[length - 1] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Profile_load_symbols(Profile* profile, const char* listing_path) {
+    FILE* file = fopen(listing_path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    u32 capacity = profile->symbol_count;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ProfileSymbol symbol = {0};
+        if (!Profile_parse_label(line, &symbol.address, symbol.name)) {
+            continue;
+        }
+        if (profile->symbol_count > 0 && profile->symbols[profile->symbol_count - 1].address == symbol.address) {
+            continue; // Labels sharing an address go by the first one
+        }
+        if (profile->symbol_count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            ProfileSymbol* symbols = realloc(profile->symbols, capacity * sizeof(ProfileSymbol));
+            if (symbols == NULL) {
+                fclose(file);
+                return false;
+            }
+            profile->symbols = symbols;
+        }
+        profile->symbols[profile->symbol_count++] = symbol;
+    }
+    fclose(file);
+    qsort(profile->symbols, profile->symbol_count, sizeof(ProfileSymbol), _Profile_compare_symbols);
+    return true;
+}
+
+/* Index of the last symbol at or before address, symbol_count if there's none */
+static u32 _Profile_find_symbol(const Profile* profile, u16 address) {
+    u32 low = 0;
+    u32 high = profile->symbol_count;
+    while (low < high) {
+        u32 middle = (low + high) / 2;
+        if (profile->symbols[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 ? low - 1 : profile->symbol_count;
+}
+
+/* "NEXTCHAR", "NEXTCHAR+$3" or "$0300" when no label comes before it */
+static void _Profile_name(const Profile* profile, u16 address, char* name, size_t size) {
+    u32 index = _Profile_find_symbol(profile, address);
+    if (index == profile->symbol_count) {
+        snprintf(name, size, "$%04X", address);
+    } else if (profile->symbols[index].address == address) {
+        snprintf(name, size, "%s", profile->symbols[index].name);
+    } else {
+        snprintf(name, size, "%s+$%X", profile->symbols[index].name, address - profile->symbols[index].address);
+    }
+}
+
+/* The node for calling address from parent, made the first time that happens. 0 (the root) if out of memory */
+static u32 _Profile_child(Profile* profile, u32 parent, u16 address) {
+    for (u32 child = profile->nodes[parent].first_child; child != 0; child = profile->nodes[child].next_sibling) {
+        if (profile->nodes[child].address == address) {
+            return child;
+        }
+    }
+    if (profile->node_count == profile->node_capacity) {
+        ProfileNode* nodes = realloc(profile->nodes, profile->node_capacity * 2 * sizeof(ProfileNode));
+        if (nodes == NULL) {
+            return 0;
+        }
+        profile->nodes = nodes;
+        profile->node_capacity *= 2;
+    }
+    u32 child = profile->node_count++;
+    profile->nodes[child] = (ProfileNode){address, parent, 0, profile->nodes[parent].first_child, 0};
+    profile->nodes[parent].first_child = child;
+    return child;
+}
+
+/* A frame for the routine the CPU just went to, unless the stack is already as deep as it goes */
+static void _Profile_call(Profile* profile, CPU* cpu) {
+    if (profile->depth < PROFILE_MAX_DEPTH) {
+        u32 node = profile->depth > 0 ? profile->stack[profile->depth - 1].node : 0;
+        profile->stack[profile->depth++] = (ProfileFrame){_Profile_child(profile, node, cpu->r.PC), cpu->r.SP};
+    }
+}
+
+static void _Profile_count(Profile* profile, CPU* cpu, u16 pc, u32 cycles) {
+    u8 opcode = cpu->r.IR;
+    profile->instructions++;
+    profile->cycles += cycles;
+    profile->pc_instructions[pc]++;
+    profile->pc_cycles[pc] += cycles;
+    profile->opcode_instructions[opcode]++;
+    profile->opcode_cycles[opcode] += cycles;
+
+    u32 node = profile->depth > 0 ? profile->stack[profile->depth - 1].node : 0;
+    profile->nodes[node].cycles += cycles;
+
+    while (profile->depth > 0 && cpu->r.SP > profile->stack[profile->depth - 1].sp) {
+        profile->depth--;
+    }
+    if (opcode == PROFILE_JSR && cpu->is_running) {
+        _Profile_call(profile, cpu);
+    }
+}
+
+/* An interrupt is a call to its handler that RTI returns from, its 7 cycles go to the handler */
+static void _Profile_interrupt(Profile* profile, CPU* cpu, u32 cycles) {
+    profile->cycles += cycles;
+    _Profile_call(profile, cpu);
+    profile->nodes[profile->depth > 0 ? profile->stack[profile->depth - 1].node : 0].cycles += cycles;
+}
+
+RunResult Profile_run(Profile* profile, CPU* cpu, u64 cycle_budget) {
+    RunResult result = {0, STOP_NONE};
+    while (cpu->is_running) {
+        if (CPU_take_stop_request(cpu)) {
+            result.reason = STOP_REQUESTED;
+            return result;
+        }
+        if (result.cycles >= cycle_budget) {
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        if (CPU_is_waiting(cpu)) { // Nothing in here can wake it
+            cpu->cycle_count += cycle_budget - result.cycles;
+            result.cycles = cycle_budget;
+            result.reason = STOP_BUDGET;
+            return result;
+        }
+        // The reset sequence and the rest of an instruction CPU_emulate started aren't counted
+        bool whole = cpu->reset_delay == 0xFF && cpu->cycle == 0;
+        u16 pc = cpu->r.PC;
+        u64 instruction_count = cpu->instruction_count;
+        u32 cycles = CPU_step_instruction(cpu);
+        result.cycles += cycles;
+        if (whole) {
+            if (!profile->started) {
+                profile->nodes[0].address = pc;
+                profile->started = true;
+            }
+            if (cpu->instruction_count != instruction_count) {
+                _Profile_count(profile, cpu, pc, cycles);
+            } else {
+                _Profile_interrupt(profile, cpu, cycles);
+            }
+        }
+    }
+    result.reason = cpu->stop_reason;
+    return result;
+}
+
+static int _Profile_compare_entries(const void* a, const void* b) {
+    const ProfileEntry* left  = a;
+    const ProfileEntry* right = b;
+    if (left->cycles != right->cycles) {
+        return left->cycles < right->cycles ? 1 : -1;
+    }
+    return left->key < right->key ? -1 : left->key > right->key;
+}
+
+/* Sorts the entries by cycles and prints the top ones, name_key names a row */
+static void _Profile_write_table(const Profile* profile, FILE* file, const char* title, ProfileEntry* entries, u32 count, u32 top,
+                                 void (*name_key)(const Profile* profile, u32 key, char* name, size_t size)) {
+    qsort(entries, count, sizeof(ProfileEntry), _Profile_compare_entries);
+    fprintf(file, "%s\n    %-24s %14s %14s %7s\n", title, "", "INSTRUCTIONS", "CYCLES", "%");
+    for (u32 i = 0; i < count && i < top && entries[i].cycles > 0; i++) {
+        char name[PROFILE_SYMBOL_LENGTH + 16];
+        name_key(profile, entries[i].key, name, sizeof(name));
+        fprintf(file, "    %-24s %14llu %14llu %6.2f%%\n", name, entries[i].instructions, entries[i].cycles,
+                profile->cycles > 0 ? 100.0 * entries[i].cycles / profile->cycles : 0.0);
+    }
+    fprintf(file, "\n");
+}
+
+static void _Profile_name_address(const Profile* profile, u32 key, char* name, size_t size) {
+    char symbol[PROFILE_SYMBOL_LENGTH + 8];
+    _Profile_name(profile, key, symbol, sizeof(symbol));
+    snprintf(name, size, "$%04X %s", key, symbol);
+}
+
+static void _Profile_name_symbol(const Profile* profile, u32 key, char* name, size_t size) {
+    snprintf(name, size, "%s", key < profile->symbol_count ? profile->symbols[key].name : "(no symbol)");
+}
+
+static void _Profile_name_opcode(const Profile* profile, u32 key, char* name, size_t size) {
+    (void)profile;
+    snprintf(name, size, "$%02X %s", key, mnemonics[key] != NULL ? mnemonics[key] : "???");
+}
+
+void Profile_write_report(const Profile* profile, FILE* file, u32 top) {
+    ProfileEntry* entries = calloc(0x10000, sizeof(ProfileEntry));
+    if (entries == NULL) {
+        return;
+    }
+    fprintf(file, "Profile: %llu instructions, %llu cycles\n\n", profile->instructions, profile->cycles);
+
+    u32 count = 0;
+    for (u32 pc = 0; pc < 0x10000; pc++) {
+        if (profile->pc_instructions[pc] > 0) {
+            entries[count++] = (ProfileEntry){pc, profile->pc_instructions[pc], profile->pc_cycles[pc]};
+        }
+    }
+    _Profile_write_table(profile, file, "Hot spots by address:", entries, count, top, _Profile_name_address);
+
+    // One row per symbol plus one for the addresses before the first symbol
+    count = profile->symbol_count + 1;
+    for (u32 i = 0; i < count; i++) {
+        entries[i] = (ProfileEntry){i, 0, 0};
+    }
+    for (u32 pc = 0; pc < 0x10000; pc++) {
+        if (profile->pc_instructions[pc] > 0) {
+            ProfileEntry* entry = &entries[_Profile_find_symbol(profile, pc)];
+            entry->instructions += profile->pc_instructions[pc];
+            entry->cycles       += profile->pc_cycles[pc];
+        }
+    }
+    _Profile_write_table(profile, file, "Hot spots by symbol:", entries, count, top, _Profile_name_symbol);
+
+    for (u32 opcode = 0; opcode < 0x100; opcode++) {
+        entries[opcode] = (ProfileEntry){opcode, profile->opcode_instructions[opcode], profile->opcode_cycles[opcode]};
+    }
+    _Profile_write_table(profile, file, "Hot spots by opcode:", entries, 0x100, top, _Profile_name_opcode);
+    free(entries);
+}
+
+void Profile_write_folded(const Profile* profile, FILE* file) {
+    for (u32 node = 0; node < profile->node_count; node++) {
+        if (profile->nodes[node].cycles == 0) {
+            continue;
+        }
+        u32 path[PROFILE_MAX_DEPTH + 1];
+        u32 depth = 0;
+        for (u32 at = node; ; at = profile->nodes[at].parent) {
+            path[depth++] = at;
+            if (at == 0) {
+                break;
+            }
+        }
+        while (depth-- > 0) {
+            char name[PROFILE_SYMBOL_LENGTH + 8];
+            _Profile_name(profile, profile->nodes[path[depth]].address, name, sizeof(name));
+            fprintf(file, "%s%c", name, depth > 0 ? ';' : ' ');
+        }
+        fprintf(file, "%llu\n", profile->nodes[node].cycles);
+    }
+}
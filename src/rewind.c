@@ -0,0 +1,285 @@
+#include "rewind.h"
+
+/* More than any instruction takes, replays get this close with Machine_run and do the rest cycle by cycle */
+#define REWIND_REPLAY_MARGIN 16
+
+/* Every other byte changed: runs of 1 byte take 4 */
+#define REWIND_MAX_DELTA (MACHINE_RAM_SIZE * 2)
+
+static RewindCheckpoint* _Rewind_at(Rewind* rewind, u32 index) {
+    return &rewind->checkpoints[(rewind->first + index) % rewind->capacity];
+}
+
+static void _Rewind_free_delta(Rewind* rewind, RewindCheckpoint* checkpoint) {
+    free(checkpoint->delta);
+    rewind->memory_used -= checkpoint->delta_size;
+    checkpoint->delta = NULL;
+    checkpoint->delta_size = 0;
+}
+
+static void _Rewind_free(Rewind* rewind, RewindCheckpoint* checkpoint) {
+    _Rewind_free_delta(rewind, checkpoint);
+    free(checkpoint->events);
+    rewind->memory_used -= sizeof(RewindCheckpoint) + checkpoint->event_count * sizeof(SchedulerEvent);
+}
+
+/* Input from before the oldest checkpoint can't be replayed any more */
+static void _Rewind_trim_input(Rewind* rewind) {
+    MachineInputLog* log = &rewind->input_log;
+    u32 drop = _Rewind_at(rewind, 0)->input - rewind->input_dropped;
+    if (drop == 0) {
+        return;
+    }
+    memmove(log->events, log->events + drop, (log->count - drop) * sizeof(MachineInputEvent));
+    log->count -= drop;
+    log->position -= drop;
+    rewind->input_dropped += drop;
+}
+
+/* Going back only ever applies deltas from the newest one down, the oldest's is never needed */
+static void _Rewind_drop_oldest(Rewind* rewind) {
+    _Rewind_free(rewind, _Rewind_at(rewind, 0));
+    rewind->first = (rewind->first + 1) % rewind->capacity;
+    rewind->count--;
+    if (rewind->count > 0) {
+        _Rewind_free_delta(rewind, _Rewind_at(rewind, 0));
+        _Rewind_trim_input(rewind);
+    }
+}
+
+static void _Rewind_drop_newest(Rewind* rewind) {
+    _Rewind_free(rewind, _Rewind_at(rewind, rewind->count - 1));
+    rewind->count--;
+}
+
+static bool _Rewind_grow(Rewind* rewind) {
+    u32 capacity = rewind->capacity * 2;
+    RewindCheckpoint* checkpoints = malloc(capacity * sizeof(RewindCheckpoint));
+    if (checkpoints == NULL) {
+        return false;
+    }
+    for (u32 i = 0; i < rewind->count; i++) {
+        checkpoints[i] = *_Rewind_at(rewind, i);
+    }
+    free(rewind->checkpoints);
+    rewind->checkpoints = checkpoints;
+    rewind->capacity = capacity;
+    rewind->first = 0;
+    return true;
+}
+
+/* old ^ new as runs of (offset u16, length u8, XORed bytes), pages that didn't change are skipped whole.
+ * Returns the size, which is at most REWIND_MAX_DELTA
+ */
+static u32 _Rewind_encode(const u8* old, const u8* new, u8* out) {
+    u32 size = 0;
+    for (u32 page = 0; page < MACHINE_RAM_SIZE; page += 0x100) {
+        if (memcmp(old + page, new + page, 0x100) == 0) {
+            continue;
+        }
+        u32 offset = page;
+        while (offset < page + 0x100) {
+            if (old[offset] == new[offset]) {
+                offset++;
+                continue;
+            }
+            u32 length = 0;
+            while (offset + length < page + 0x100 && length < 0xFF && old[offset + length] != new[offset + length]) {
+                length++;
+            }
+            out[size++] = offset & 0xFF;
+            out[size++] = offset >> 8;
+            out[size++] = length;
+            for (u32 i = 0; i < length; i++) {
+                out[size++] = old[offset + i] ^ new[offset + i];
+            }
+            offset += length;
+        }
+    }
+    return size;
+}
+
+/* The same delta takes the RAM either way, XOR undoes itself */
+static void _Rewind_apply(u8* ram, const u8* delta, u32 size) {
+    u32 position = 0;
+    while (position < size) {
+        u16 offset = delta[position] | (delta[position + 1] << 8);
+        u8 length  = delta[position + 2];
+        position += 3;
+        for (u8 i = 0; i < length; i++) {
+            ram[offset + i] ^= delta[position + i];
+        }
+        position += length;
+    }
+}
+
+Rewind* Rewind_create(Machine* machine, u64 interval, size_t memory_limit) {
+    Rewind* rewind = calloc(1, sizeof(Rewind));
+    if (rewind == NULL) {
+        return NULL;
+    }
+    rewind->machine      = machine;
+    rewind->interval     = interval > 0 ? interval : REWIND_DEFAULT_INTERVAL;
+    rewind->memory_limit = memory_limit > 0 ? memory_limit : REWIND_DEFAULT_MEMORY_LIMIT;
+    rewind->capacity     = 64;
+    rewind->checkpoints  = malloc(rewind->capacity * sizeof(RewindCheckpoint));
+    if (rewind->checkpoints == NULL) {
+        free(rewind);
+        return NULL;
+    }
+    Machine_read_ram(machine, rewind->ram);
+    Machine_set_input_log(machine, &rewind->input_log);
+    if (!Rewind_checkpoint(rewind)) {
+        Rewind_destroy(rewind);
+        return NULL;
+    }
+    return rewind;
+}
+
+void Rewind_destroy(Rewind* rewind) {
+    if (rewind == NULL) {
+        return;
+    }
+    while (rewind->count > 0) {
+        _Rewind_drop_newest(rewind);
+    }
+    if (rewind->machine->input_log == &rewind->input_log) {
+        Machine_set_input_log(rewind->machine, NULL);
+    }
+    free(rewind->input_log.events);
+    free(rewind->checkpoints);
+    free(rewind);
+}
+
+bool Rewind_checkpoint(Rewind* rewind) {
+    Machine* machine = rewind->machine;
+    if (rewind->count == rewind->capacity && !_Rewind_grow(rewind)) {
+        return false;
+    }
+
+    u8 ram[MACHINE_RAM_SIZE];
+    u8 delta[REWIND_MAX_DELTA];
+    Machine_read_ram(machine, ram);
+    u32 delta_size = rewind->count > 0 ? _Rewind_encode(rewind->ram, ram, delta) : 0;
+
+    RewindCheckpoint checkpoint = {CPU_save_state(&machine->cpu), NULL, delta_size, Machine_save_devices(machine),
+                                   NULL, machine->scheduler.count, rewind->input_dropped + rewind->input_log.position};
+    if (delta_size > 0) {
+        checkpoint.delta = malloc(delta_size);
+        if (checkpoint.delta == NULL) {
+            return false;
+        }
+        memcpy(checkpoint.delta, delta, delta_size);
+    }
+    if (checkpoint.event_count > 0) {
+        checkpoint.events = malloc(checkpoint.event_count * sizeof(SchedulerEvent));
+        if (checkpoint.events == NULL) {
+            free(checkpoint.delta);
+            return false;
+        }
+        memcpy(checkpoint.events, machine->scheduler.events, checkpoint.event_count * sizeof(SchedulerEvent));
+    }
+    memcpy(rewind->ram, ram, sizeof(ram));
+    rewind->count++;
+    *_Rewind_at(rewind, rewind->count - 1) = checkpoint;
+    rewind->memory_used += sizeof(RewindCheckpoint) + delta_size + checkpoint.event_count * sizeof(SchedulerEvent);
+    rewind->next_checkpoint = machine->cpu.cycle_count + rewind->interval;
+
+    while (rewind->memory_used + rewind->input_log.count * sizeof(MachineInputEvent) > rewind->memory_limit && rewind->count > 1) {
+        _Rewind_drop_oldest(rewind);
+    }
+    return true;
+}
+
+/* Checkpoints land between Machine_run slices, so always on an instruction boundary */
+RunResult Rewind_run(Rewind* rewind, u64 cycle_budget) {
+    CPU* cpu = &rewind->machine->cpu;
+    RunResult result = {0, STOP_NONE};
+    while (result.cycles < cycle_budget) {
+        if (cpu->cycle_count >= rewind->next_checkpoint && cpu->cycle == 0) {
+            Rewind_checkpoint(rewind); // Recording is best effort, running out of memory just leaves a gap
+        }
+        u64 slice = cycle_budget - result.cycles;
+        if (rewind->next_checkpoint > cpu->cycle_count && rewind->next_checkpoint - cpu->cycle_count < slice) {
+            slice = rewind->next_checkpoint - cpu->cycle_count;
+        }
+        RunResult run = Machine_run(rewind->machine, slice);
+        result.cycles += run.cycles;
+        result.reason  = run.reason;
+        if (run.reason != STOP_BUDGET) {
+            return result;
+        }
+    }
+    return result;
+}
+
+/* Puts the machine back at checkpoint index and forgets the newer ones, replaying the input
+ * it was given from there on until Machine_stop_replay */
+static bool _Rewind_restore(Rewind* rewind, u32 index) {
+    for (u32 i = rewind->count - 1; i > index; i--) {
+        RewindCheckpoint* checkpoint = _Rewind_at(rewind, i);
+        _Rewind_apply(rewind->ram, checkpoint->delta, checkpoint->delta_size);
+        _Rewind_drop_newest(rewind);
+    }
+    RewindCheckpoint* checkpoint = _Rewind_at(rewind, index);
+    if (!Machine_write_ram(rewind->machine, rewind->ram)) {
+        return false;
+    }
+    CPU_load_state(&rewind->machine->cpu, &checkpoint->cpu);
+    Machine_load_devices(rewind->machine, &checkpoint->devices, checkpoint->events, checkpoint->event_count);
+    Machine_replay_input(rewind->machine, checkpoint->input - rewind->input_dropped);
+    rewind->next_checkpoint = checkpoint->cpu.cycle_count + rewind->interval;
+    return true;
+}
+
+/* Newest checkpoint at or before the target, count if there's none */
+static u32 _Rewind_find(Rewind* rewind, u64 cycle, u64 instruction_count) {
+    for (u32 i = rewind->count; i-- > 0;) {
+        const CPUState* state = &_Rewind_at(rewind, i)->cpu;
+        if (state->cycle_count <= cycle && state->instruction_count <= instruction_count) {
+            return i;
+        }
+    }
+    return rewind->count;
+}
+
+bool Rewind_to_cycle(Rewind* rewind, u64 cycle) {
+    Machine* machine = rewind->machine;
+    CPU* cpu = &machine->cpu;
+    u32 index = _Rewind_find(rewind, cycle, ~0ull);
+    if (index == rewind->count || !_Rewind_restore(rewind, index)) {
+        return false;
+    }
+    while (cpu->is_running && cpu->cycle_count < cycle) {
+        u64 left = cycle - cpu->cycle_count;
+        if (left > REWIND_REPLAY_MARGIN) {
+            Machine_run(machine, left - REWIND_REPLAY_MARGIN);
+        } else {
+            Machine_emulate(machine);
+        }
+    }
+    Machine_stop_replay(machine);
+    return true;
+}
+
+bool Rewind_to_instruction(Rewind* rewind, u64 instruction_count) {
+    Machine* machine = rewind->machine;
+    CPU* cpu = &machine->cpu;
+    u32 index = _Rewind_find(rewind, ~0ull, instruction_count);
+    if (index == rewind->count || !_Rewind_restore(rewind, index)) {
+        return false;
+    }
+    while (cpu->is_running && cpu->instruction_count < instruction_count) {
+        if (Machine_step_instruction(machine) == 0) {
+            break; // Parked by WAI with nothing left to wake it up
+        }
+    }
+    Machine_stop_replay(machine);
+    return true;
+}
+
+/* Also works from a halt: BRK and illegal opcodes stop partway, and counted, so this goes to just before them */
+bool Rewind_step_back(Rewind* rewind) {
+    u64 instruction_count = rewind->machine->cpu.instruction_count;
+    return instruction_count > 0 && Rewind_to_instruction(rewind, instruction_count - 1);
+}
@@ -0,0 +1,82 @@
+#include "scheduler.h"
+
+static void _Scheduler_swap(Scheduler* scheduler, u32 a, u32 b) {
+    SchedulerEvent event = scheduler->events[a];
+    scheduler->events[a] = scheduler->events[b];
+    scheduler->events[b] = event;
+}
+
+static void _Scheduler_sift_up(Scheduler* scheduler, u32 index) {
+    while (index > 0) {
+        u32 parent = (index - 1) / 2;
+        if (scheduler->events[parent].cycle <= scheduler->events[index].cycle) {
+            return;
+        }
+        _Scheduler_swap(scheduler, parent, index);
+        index = parent;
+    }
+}
+
+static void _Scheduler_sift_down(Scheduler* scheduler, u32 index) {
+    while (true) {
+        u32 earliest = index;
+        u32 left  = index * 2 + 1;
+        u32 right = index * 2 + 2;
+        if (left < scheduler->count && scheduler->events[left].cycle < scheduler->events[earliest].cycle) {
+            earliest = left;
+        }
+        if (right < scheduler->count && scheduler->events[right].cycle < scheduler->events[earliest].cycle) {
+            earliest = right;
+        }
+        if (earliest == index) {
+            return;
+        }
+        _Scheduler_swap(scheduler, earliest, index);
+        index = earliest;
+    }
+}
+
+static void _Scheduler_remove(Scheduler* scheduler, u32 index) {
+    scheduler->events[index] = scheduler->events[--scheduler->count];
+    if (index < scheduler->count) {
+        _Scheduler_sift_down(scheduler, index);
+        _Scheduler_sift_up(scheduler, index);
+    }
+}
+
+void Scheduler_init(Scheduler* scheduler) {
+    scheduler->count = 0;
+}
+
+bool Scheduler_add(Scheduler* scheduler, u64 cycle, scheduler_fn_ptr callback, void* context) {
+    if (scheduler->count == SCHEDULER_MAX_EVENTS) {
+        return false;
+    }
+    scheduler->events[scheduler->count] = (SchedulerEvent){cycle, callback, context};
+    _Scheduler_sift_up(scheduler, scheduler->count++);
+    return true;
+}
+
+void Scheduler_cancel(Scheduler* scheduler, scheduler_fn_ptr callback, void* context) {
+    for (u32 i = scheduler->count; i-- > 0;) {
+        if (scheduler->events[i].callback == callback && scheduler->events[i].context == context) {
+            _Scheduler_remove(scheduler, i);
+        }
+    }
+}
+
+/* The callback can add events, even ones that are already due */
+void Scheduler_run_due(Scheduler* scheduler, u64 cycle) {
+    while (scheduler->count > 0 && scheduler->events[0].cycle <= cycle) {
+        SchedulerEvent event = scheduler->events[0];
+        _Scheduler_remove(scheduler, 0);
+        event.callback(event.context, event.cycle);
+    }
+}
+
+/* Same amount for every event, so the heap stays in order */
+void Scheduler_shift(Scheduler* scheduler, i64 cycles) {
+    for (u32 i = 0; i < scheduler->count; i++) {
+        scheduler->events[i].cycle += cycles;
+    }
+}
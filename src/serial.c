@@ -0,0 +1,155 @@
+#include "serial.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+
+static void _SerialInput_wake(int pipe_fd) {
+    u8 signal = 0;
+    ssize_t written = write(pipe_fd, &signal, 1);
+    (void)written; // A full pipe already has a wake up in it
+}
+
+static void _SerialInput_drain(int pipe_fd) {
+    u8 signals[64];
+    while (read(pipe_fd, signals, sizeof(signals)) > 0) {
+    }
+}
+
+/* Sleeps in poll() until there's input (or room for it, or a stop), then reads as much as fits in one go */
+static void* _SerialInput_reader(void* argument) {
+    SerialInput* input = argument;
+    struct pollfd fds[2] = {{input->fd, POLLIN, 0}, {input->wake_pipe[0], POLLIN, 0}};
+    while (!__atomic_load_n(&input->stopping, __ATOMIC_ACQUIRE)) {
+        u32 head = input->head;
+        u32 room = SERIAL_INPUT_SIZE - (head - __atomic_load_n(&input->tail, __ATOMIC_ACQUIRE));
+        if (room == 0) {
+            __atomic_store_n(&input->reader_waiting, true, __ATOMIC_SEQ_CST);
+            // The consumer could have made room before it was able to see the flag
+            if (head - __atomic_load_n(&input->tail, __ATOMIC_SEQ_CST) < SERIAL_INPUT_SIZE) {
+                __atomic_store_n(&input->reader_waiting, false, __ATOMIC_RELAXED);
+                continue;
+            }
+        }
+        fds[0].fd = room > 0 ? input->fd : -1; // Full: only the wake pipe, the input stays in the kernel
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            _SerialInput_drain(input->wake_pipe[0]);
+        }
+        if (room == 0 || fds[0].revents == 0) {
+            continue;
+        }
+        u32 offset = head & (SERIAL_INPUT_SIZE - 1);
+        u32 length = SERIAL_INPUT_SIZE - offset < room ? SERIAL_INPUT_SIZE - offset : room;
+        ssize_t got = read(input->fd, input->buffer + offset, length);
+        if (got > 0) {
+            __atomic_store_n(&input->head, head + (u32)got, __ATOMIC_SEQ_CST);
+            // Pairs with SerialInput_wait setting the flag and then looking at head
+            if (__atomic_load_n(&input->consumer_waiting, __ATOMIC_SEQ_CST) &&
+                __atomic_exchange_n(&input->consumer_waiting, false, __ATOMIC_SEQ_CST)) {
+                _SerialInput_wake(input->data_pipe[1]);
+            }
+        } else if (got == 0 || (errno != EINTR && errno != EAGAIN)) {
+            break; // End of input, what's in the ring can still be read
+        }
+    }
+    return NULL;
+}
+
+static void _SerialInput_close_pipes(SerialInput* input) {
+    close(input->wake_pipe[0]);
+    close(input->wake_pipe[1]);
+    close(input->data_pipe[0]);
+    close(input->data_pipe[1]);
+}
+
+SerialInput* SerialInput_create(int fd) {
+    SerialInput* input = calloc(1, sizeof(SerialInput));
+    if (input == NULL) {
+        return NULL;
+    }
+    input->fd = fd;
+    if (pipe(input->wake_pipe) != 0) {
+        free(input);
+        return NULL;
+    }
+    if (pipe(input->data_pipe) != 0) {
+        close(input->wake_pipe[0]);
+        close(input->wake_pipe[1]);
+        free(input);
+        return NULL;
+    }
+    for (u32 i = 0; i < 2; i++) {
+        fcntl(input->wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(input->data_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    if (pthread_create(&input->thread, NULL, _SerialInput_reader, input) != 0) {
+        _SerialInput_close_pipes(input);
+        free(input);
+        return NULL;
+    }
+    return input;
+}
+
+void SerialInput_destroy(SerialInput* input) {
+    if (input == NULL) {
+        return;
+    }
+    __atomic_store_n(&input->stopping, true, __ATOMIC_RELEASE);
+    _SerialInput_wake(input->wake_pipe[1]);
+    pthread_join(input->thread, NULL);
+    _SerialInput_close_pipes(input);
+    free(input);
+}
+
+bool SerialInput_read(SerialInput* input, u8* byte) {
+    u32 tail = input->tail;
+    if (__atomic_load_n(&input->head, __ATOMIC_ACQUIRE) == tail) {
+        return false;
+    }
+    *byte = input->buffer[tail & (SERIAL_INPUT_SIZE - 1)];
+    __atomic_store_n(&input->tail, tail + 1, __ATOMIC_SEQ_CST);
+    // Pairs with the reader setting the flag and then looking at tail, one of the two sees the other
+    if (__atomic_load_n(&input->reader_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&input->reader_waiting, false, __ATOMIC_SEQ_CST)) {
+        _SerialInput_wake(input->wake_pipe[1]);
+    }
+    return true;
+}
+
+bool SerialInput_wait(SerialInput* input, u64 timeout_ns) {
+    __atomic_store_n(&input->consumer_waiting, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&input->head, __ATOMIC_SEQ_CST) == input->tail) {
+        struct pollfd fd = {input->data_pipe[0], POLLIN, 0};
+        u64 timeout_ms = (timeout_ns + 999999) / 1000000;
+        poll(&fd, 1, timeout_ms < INT_MAX ? (int)timeout_ms : INT_MAX);
+        _SerialInput_drain(input->data_pipe[0]);
+    }
+    __atomic_store_n(&input->consumer_waiting, false, __ATOMIC_SEQ_CST);
+    return SerialInput_waiting(input);
+}
+
+SerialOutput* SerialOutput_create(FILE* file, bool flush_lines) {
+    SerialOutput* output = malloc(sizeof(SerialOutput));
+    if (output == NULL) {
+        return NULL;
+    }
+    output->file = file;
+    output->flush_lines = flush_lines;
+    setvbuf(file, NULL, _IOFBF, SERIAL_OUTPUT_SIZE); // stdio allocates it, so it outlives the SerialOutput
+    return output;
+}
+
+void SerialOutput_destroy(SerialOutput* output) {
+    if (output == NULL) {
+        return;
+    }
+    SerialOutput_flush(output);
+    free(output);
+}
@@ -0,0 +1,58 @@
+#include "trace.h"
+
+Trace* Trace_create(u32 record_count) {
+    u32 size = 1;
+    while (size < record_count && size < 0x80000000u) {
+        size <<= 1;
+    }
+    Trace* trace = calloc(1, sizeof(Trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->records = calloc(size, sizeof(TraceRecord));
+    if (trace->records == NULL) {
+        free(trace);
+        return NULL;
+    }
+    trace->mask = size - 1;
+    return trace;
+}
+
+void Trace_destroy(Trace* trace) {
+    if (trace == NULL) {
+        return;
+    }
+    free(trace->records);
+    free(trace);
+}
+
+/* cpu is the one that was traced, the newest record still needs its opcode and address from it */
+bool Trace_dump(Trace* trace, CPU* cpu, const char* path) {
+    if (trace->count > 0) {
+        trace->records[(trace->count - 1) & trace->mask].access = _Trace_access(cpu);
+    }
+    u64 size = (u64)trace->mask + 1;
+    u64 record_count = trace->count < size ? trace->count : size;
+    TraceFileHeader header = {
+        .version      = TRACE_VERSION,
+        .record_size  = sizeof(TraceRecord),
+        .record_count = record_count,
+        .total_count  = trace->count,
+    };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    // Oldest first: the ring wraps at the slot the next record would go to
+    u64 start = (trace->count - record_count) & trace->mask;
+    u64 first_part = size - start < record_count ? size - start : record_count;
+    written = written && fwrite(&trace->records[start], sizeof(TraceRecord), first_part, file) == first_part;
+    written = written && fwrite(trace->records, sizeof(TraceRecord), record_count - first_part, file) == record_count - first_part;
+    if (fclose(file) != 0) {
+        written = false;
+    }
+    return written;
+}
@@ -0,0 +1,572 @@
+; Test ROM for ya6502-difftest (make difftest builds and runs it by default).
+; Runs every opcode the interpreter implements, in every addressing mode it
+; has, on pseudo-random data: ALU, read-modify-write, stack, JSR/RTS, RTI,
+; JMP (ind), every branch both ways, (zp,X) through RAM, a RAM mirror, the
+; ACIA and the ROM, and a routine in RAM that keeps being rewritten through
+; a mirror. Each result and the flags it left are folded into SUM, which is
+; printed on the ACIA every 16 rounds, so a difference shows up in RAM, in
+; the output or in the registers soon after it happens.
+; Left out: DBP prints on the host, BRK and WAI would stop or park it early.
+; It ends with STP.
+
+.logical $8000
+
+SEED    = $10                          ; Pseudo-random state, 2 bytes
+SUM     = $12                          ; Every result and flags register, folded together
+TMP     = $13                          ; Zero page operand
+COUNT   = $14                          ; Rounds so far, 2 bytes
+PTRS    = $20                          ; 4 pointers for (zp,X)
+
+VECTOR  = $0200                        ; JMP (ind) target
+ABSVAL  = $0280                        ; Absolute operand
+ABSREG  = $0281                        ; Absolute STX/STY target
+BUF     = $0300                        ; 256 random bytes, indexed by Y
+CODE    = $0400                        ; RAMCODE runs from here
+BUFM    = $0B00                        ; BUF through the first mirror of RAM
+CODEM   = $0C00                        ; CODE through the first mirror of RAM
+
+ACIA_DATA   = $5000
+ACIA_STATUS = $5001
+
+ROUNDS  = 1024
+
+  * = $8000
+
+RESET:
+                CLD
+                SEI
+                LDA     #$01
+                STA     SEED
+                STA     SEED+1
+                LDA     #$00
+                STA     SUM
+                STA     COUNT
+                STA     COUNT+1
+
+                LDA     #<BUF          ; (PTRS,X) reads RAM with X=0...
+                STA     PTRS
+                LDA     #>BUF
+                STA     PTRS+1
+                LDA     #<(BUFM+$40)   ; ...the mirror with X=2...
+                STA     PTRS+2
+                LDA     #>(BUFM+$40)
+                STA     PTRS+3
+                LDA     #<ACIA_STATUS  ; ...the ACIA with X=4...
+                STA     PTRS+4
+                LDA     #>ACIA_STATUS
+                STA     PTRS+5
+                LDA     #<HEX          ; ...and the ROM with X=6.
+                STA     PTRS+6
+                LDA     #>HEX
+                STA     PTRS+7
+
+                LDY     #$00           ; Routine into RAM.
+COPY:           LDA     RAMCODE,Y
+                STA     CODE,Y
+                INY
+                CPY     #RAMCODE_END-RAMCODE
+                BNE     COPY
+
+                LDY     #$00           ; Random buffer.
+FILL:           JSR     RANDOM
+                STA     BUF,Y
+                INY
+                BNE     FILL
+
+ROUND:
+                JSR     ALU
+                JSR     SHIFTS
+                JSR     REGISTERS
+                JSR     STACK
+                JSR     BRANCHES
+                JSR     JUMPS
+                JSR     SELFMOD
+
+                LDA     COUNT          ; ADC leaves C alone, so the carry is Z.
+                CLC
+                ADC     #$01
+                STA     COUNT
+                BNE     COUNTED
+                LDA     COUNT+1
+                CLC
+                ADC     #$01
+                STA     COUNT+1
+COUNTED:
+                LDA     COUNT
+                AND     #$0F
+                BNE     NOPRINT
+                JSR     PRINT
+NOPRINT:
+                LDA     COUNT+1
+                CMP     #>ROUNDS
+                BNE     ROUND
+                LDA     COUNT
+                CMP     #<ROUNDS
+                BNE     ROUND
+                JSR     PRINT
+                STP
+
+; A = next pseudo-random byte. SEED is SEED * 5 + $1D, SEED+1 adds $53 and
+; picks up SUM, so the sequence depends on every result so far.
+RANDOM:
+                LDA     SEED
+                ASL     A
+                ASL     A
+                CLC
+                ADC     SEED
+                CLC
+                ADC     #$1D
+                STA     SEED
+                LDA     SEED+1
+                CLC
+                ADC     #$53
+                EOR     SUM
+                STA     SEED+1
+                EOR     SEED
+                RTS
+
+; Folds A and the flags into SUM. A is lost.
+MIX:
+                PHP
+                CLC
+                ADC     SUM
+                STA     SUM
+                PLA
+                EOR     SUM
+                STA     SUM
+                RTS
+
+; Random flags (and carry for ADC/SBC) from SEED+1.
+SETFLAGS:
+                LDA     SEED+1
+                PHA
+                PLP
+                RTS
+
+; Random Y and X (0, 2, 4 or 6 for (PTRS,X)) and operands.
+OPERANDS:
+                JSR     RANDOM
+                TAY
+                JSR     RANDOM
+                STA     TMP
+                JSR     RANDOM
+                STA     ABSVAL
+                JSR     RANDOM
+                AND     #$06
+                TAX
+                RTS
+
+ALU:
+                JSR     OPERANDS
+                JSR     SETFLAGS
+                LDA     SUM
+                ORA     (PTRS,X)
+                JSR     MIX
+                LDA     SUM
+                ORA     TMP
+                JSR     MIX
+                LDA     SUM
+                ORA     #$21
+                JSR     MIX
+                LDA     SUM
+                ORA     ABSVAL
+                JSR     MIX
+                LDA     SUM
+                ORA     BUF+$80,Y      ; Crosses a page for Y >= $80
+                JSR     MIX
+
+                LDA     SUM
+                AND     (PTRS,X)
+                JSR     MIX
+                LDA     SUM
+                AND     TMP
+                JSR     MIX
+                LDA     SUM
+                AND     #$B6
+                JSR     MIX
+                LDA     SUM
+                AND     ABSVAL
+                JSR     MIX
+                LDA     SUM
+                AND     BUF,Y
+                JSR     MIX
+
+                LDA     SUM
+                EOR     (PTRS,X)
+                JSR     MIX
+                LDA     SUM
+                EOR     TMP
+                JSR     MIX
+                LDA     SUM
+                EOR     #$5A
+                JSR     MIX
+                LDA     SUM
+                EOR     ABSVAL
+                JSR     MIX
+                LDA     SUM
+                EOR     BUF+$80,Y
+                JSR     MIX
+
+                JSR     SETFLAGS
+                LDA     SUM
+                ADC     (PTRS,X)
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                ADC     TMP
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                ADC     #$7F
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                ADC     ABSVAL
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                ADC     BUF,Y
+                JSR     MIX
+
+                JSR     SETFLAGS
+                LDA     SUM
+                SBC     (PTRS,X)
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                SBC     TMP
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                SBC     #$80
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                SBC     ABSVAL
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                SBC     BUF+$80,Y
+                JSR     MIX
+
+                LDA     SUM
+                CMP     (PTRS,X)
+                JSR     MIX
+                LDA     SUM
+                CMP     TMP
+                JSR     MIX
+                LDA     SUM
+                CMP     #$40
+                JSR     MIX
+                LDA     SUM
+                CMP     ABSVAL
+                JSR     MIX
+                LDA     SUM
+                CMP     BUF,Y
+                JSR     MIX
+
+                LDA     (PTRS,X)
+                JSR     MIX
+                LDA     TMP
+                JSR     MIX
+                LDA     #$00
+                JSR     MIX
+                LDA     ABSVAL
+                JSR     MIX
+                LDA     BUF+$80,Y
+                JSR     MIX
+
+                LDA     SUM            ; Stores, (PTRS,X) with X=4 writes the ACIA's control
+                CPX     #$06           ; register and with X=6 the ROM, which ignores it.
+                BEQ     NOSTORE
+                CPX     #$04
+                BEQ     NOSTORE
+                STA     (PTRS,X)
+NOSTORE:        EOR     #$33
+                STA     TMP
+                EOR     #$66
+                STA     ABSVAL
+                EOR     #$99
+                STA     BUF,Y
+                RTS
+
+SHIFTS:
+                JSR     OPERANDS
+                JSR     SETFLAGS
+                ASL     TMP
+                PHP
+                LDA     TMP
+                JSR     MIX
+                PLA
+                JSR     MIX
+                JSR     SETFLAGS
+                ROL     TMP
+                PHP
+                LDA     TMP
+                JSR     MIX
+                PLA
+                JSR     MIX
+                JSR     SETFLAGS
+                ASL     ABSVAL
+                PHP
+                LDA     ABSVAL
+                JSR     MIX
+                PLA
+                JSR     MIX
+                JSR     SETFLAGS
+                ROL     ABSVAL
+                PHP
+                LDA     ABSVAL
+                JSR     MIX
+                PLA
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                ASL     A
+                JSR     MIX
+                JSR     SETFLAGS
+                LDA     SUM
+                ROL     A
+                JSR     MIX
+                RTS
+
+REGISTERS:
+                JSR     OPERANDS
+                LDX     #$C3
+                TXA
+                JSR     MIX
+                LDX     TMP
+                TXA
+                JSR     MIX
+                LDX     ABSVAL
+                TXA
+                JSR     MIX
+                LDY     #$3C
+                TYA
+                JSR     MIX
+                LDY     TMP
+                TYA
+                JSR     MIX
+                LDY     ABSVAL
+                TYA
+                JSR     MIX
+
+                LDX     SUM
+                LDY     SEED
+                STX     TMP
+                STY     ABSREG
+                LDA     TMP
+                JSR     MIX
+                LDA     ABSREG
+                JSR     MIX
+                STY     TMP
+                STX     ABSREG
+                LDA     TMP
+                JSR     MIX
+                LDA     ABSREG
+                JSR     MIX
+
+                LDX     SUM
+                CPX     #$80
+                JSR     MIX
+                CPX     TMP
+                JSR     MIX
+                CPX     ABSVAL
+                JSR     MIX
+                LDY     SEED+1
+                CPY     #$10
+                JSR     MIX
+                CPY     TMP
+                JSR     MIX
+                CPY     ABSVAL
+                JSR     MIX
+
+                LDA     SUM
+                BIT     TMP
+                JSR     MIX
+                LDA     SEED
+                BIT     ABSVAL
+                JSR     MIX
+
+                LDA     SUM
+                TAX
+                INX
+                TXA
+                JSR     MIX
+                LDX     SUM
+                DEX
+                TXA
+                JSR     MIX
+                LDA     SEED
+                TAY
+                INY
+                TYA
+                JSR     MIX
+                LDY     SEED
+                DEY
+                TYA
+                JSR     MIX
+                LDA     SUM
+                INC     A
+                JSR     MIX
+                LDA     SUM
+                DEC     A
+                JSR     MIX
+                NOP
+                .byte   $89, $EA       ; NOP # ($89 is BIT # on a real W65C02S)
+                LDA     SEED
+                JSR     MIX
+                RTS
+
+STACK:
+                JSR     RANDOM
+                PHA
+                JSR     RANDOM
+                PHA
+                PLA
+                JSR     MIX
+                PLA
+                JSR     MIX
+                LDA     SEED
+                PHA
+                PLP                    ; Random flags, D and I included
+                PHP
+                PLA
+                JSR     MIX
+
+                SEC                    ; Every flag instruction.
+                SED
+                SEI
+                PHP
+                PLA
+                JSR     MIX
+                LDA     #$40           ; V, for CLV to clear.
+                PHA
+                PLP
+                CLC
+                CLD
+                CLI                    ; Nothing raises IRQ in here, the block boundaries are all it changes.
+                CLV
+                PHP
+                PLA
+                JSR     MIX
+                SEI
+                RTS
+
+BRANCHES:
+                LDX     #$00           ; Counts branches not taken, with the flags from SEED+1.
+                JSR     RANDOM
+                JSR     SETFLAGS
+                BPL     B1
+                INX
+B1:             JSR     SETFLAGS
+                BMI     B2
+                INX
+B2:             JSR     SETFLAGS
+                BVC     B3
+                INX
+B3:             JSR     SETFLAGS
+                BVS     B4
+                INX
+B4:             JSR     SETFLAGS
+                BCC     B5
+                INX
+B5:             JSR     SETFLAGS
+                BCS     B6
+                INX
+B6:             JSR     SETFLAGS
+                BNE     B7
+                INX
+B7:             JSR     SETFLAGS
+                BEQ     B8
+                INX
+B8:             TXA
+                JSR     MIX
+                RTS
+
+JUMPS:
+                JSR     RANDOM         ; JMP (ind) to one of two places.
+                AND     #$01
+                BEQ     JUMP_ODD
+                LDA     #<JUMP_A
+                STA     VECTOR
+                LDA     #>JUMP_A
+                STA     VECTOR+1
+                JMP     (VECTOR)
+JUMP_ODD:
+                LDA     #<JUMP_B
+                STA     VECTOR
+                LDA     #>JUMP_B
+                STA     VECTOR+1
+                JMP     (VECTOR)
+JUMP_A:
+                LDA     #$A5
+                JSR     MIX
+                JMP     JUMP_RTI
+JUMP_B:
+                LDA     #$5A
+                JSR     MIX
+JUMP_RTI:
+                LDA     #>RETURNED     ; RTI to RETURNED with random flags.
+                PHA
+                LDA     #<RETURNED
+                PHA
+                LDA     SEED+1
+                PHA
+                RTI
+RETURNED:
+                PHP
+                PLA
+                JSR     MIX
+                SEI
+                RTS
+
+SELFMOD:
+                JSR     RANDOM         ; New immediate, every other round through the mirror.
+                STA     CODE+1
+                LDA     COUNT
+                AND     #$01
+                BEQ     SELFMOD_RUN
+                LDA     SEED
+                STA     CODEM+1
+SELFMOD_RUN:
+                JSR     CODE
+                JSR     MIX
+                RTS
+
+; Prints SUM in hex and a newline. High digit by counting down, the table for the rest.
+PRINT:
+                LDA     SUM
+                LDX     #$00
+PRINT_HIGH:     CMP     #$10
+                BCC     PRINT_LOW
+                SBC     #$10           ; C is set, so this takes $10
+                INX
+                JMP     PRINT_HIGH
+PRINT_LOW:      STA     TMP
+                TXA
+                TAY
+                LDA     HEX,Y
+                STA     ACIA_DATA
+                LDY     TMP
+                LDA     HEX,Y
+                STA     ACIA_DATA
+                LDA     #$0A
+                STA     ACIA_DATA
+                RTS
+
+HEX:            .text   "0123456789ABCDEF"
+
+; Copied to CODE, SELFMOD rewrites the immediate.
+RAMCODE:
+                LDA     #$00
+                EOR     SUM
+                RTS
+RAMCODE_END:
+
+  * = $FFFA
+
+                .word   RESET          ; NMI vector
+                .word   RESET          ; RESET vector
+                .word   RESET          ; IRQ
+.endlogical
@@ -0,0 +1,195 @@
+/* ya6502-difftest: runs a ROM every way this build can and checks they all agree.
+ *     Usage: ya6502-difftest <ROM file> [cycles] [cycles between checks]
+ *
+ * Each way gets a machine of its own: CPU_emulate a cycle at a time (the
+ * reference), CPU_run with the core this was built with, the JIT (x86-64
+ * Linux only) and, in builds with AOT_ROM set to the same ROM, the AOT.
+ * Every so many cycles they're stopped at the same instruction boundary and
+ * their registers, cycle and instruction counts, RAM and ACIA output have to
+ * match. The ACIA's input stays disconnected, so they all see the same input,
+ * and a ROM that waits for input (like wozmon) never gets past its input
+ * loop: tools/difftest.asm, the default for `make difftest`, is the one that
+ * runs every opcode.
+ *
+ * Prints a line for each check with the state they agreed on, so the output
+ * of a table build and a threaded build can be compared too, which is what
+ * `make difftest` does. Stops with 1 at the first difference.
+ */
+#include "machine.h"
+
+typedef struct Runner_s {
+    const char* name;
+    Machine* machine;
+    SerialOutput* output;
+    FILE* file;           /* Where its ACIA output goes */
+    u8  ram[MACHINE_RAM_SIZE];
+} Runner;
+
+static bool _Runner_create(Runner* runner, const char* name, MachineImage* image) {
+    runner->name = name;
+    runner->machine = Machine_create_from_image(image);
+    runner->file = tmpfile();
+    if (runner->machine == NULL || runner->file == NULL) {
+        return false;
+    }
+    runner->output = SerialOutput_create(runner->file, false);
+    if (runner->output == NULL) {
+        return false;
+    }
+    Machine_connect_acia(runner->machine, NULL, runner->output);
+    return true;
+}
+
+static void _Runner_destroy(Runner* runner) {
+    if (runner->machine != NULL) {
+        Machine_destroy(runner->machine);
+    }
+    if (runner->output != NULL) {
+        SerialOutput_destroy(runner->output);
+    }
+    if (runner->file != NULL) {
+        fclose(runner->file);
+    }
+}
+
+/* Runs to the first instruction boundary at or after cycle, where CPU_run and the others stop too */
+static void _Runner_run_to(Runner* runner, u64 cycle, bool emulate) {
+    CPU* cpu = &runner->machine->cpu;
+    if (emulate) {
+        while (cpu->is_running && (cpu->cycle_count < cycle || cpu->cycle != 0 || cpu->reset_delay != 0xFF)) {
+            Machine_emulate(runner->machine);
+        }
+        return;
+    }
+    while (cpu->is_running && cpu->cycle_count < cycle) {
+        Machine_run(runner->machine, cycle - cpu->cycle_count);
+    }
+}
+
+/* The output it wrote from offset on, at most size bytes. Returns how many there were */
+static u32 _Runner_read_output(Runner* runner, long offset, u8* bytes, u32 size) {
+    fflush(runner->file);
+    fseek(runner->file, offset, SEEK_SET);
+    u32 count = fread(bytes, 1, size, runner->file);
+    fseek(runner->file, 0, SEEK_END);
+    return count;
+}
+
+static void _Runner_print(Runner* runner) {
+    CPU* cpu = &runner->machine->cpu;
+    fflush(runner->file);
+    printf("    %-8s cycle %llu, %llu instructions, PC=%04X A=%02X X=%02X Y=%02X P=%02X SP=%02X, %s, %ld bytes out\n",
+           runner->name, cpu->cycle_count, cpu->instruction_count, cpu->r.PC, cpu->r.A, cpu->r.X, cpu->r.Y,
+           CPU_get_P(cpu), cpu->r.SP, cpu->is_running ? "running" : "stopped", ftell(runner->file));
+}
+
+/* Whether runner matches reference, printing both when it doesn't. Output is compared from checked on */
+static bool _Runner_matches(Runner* runner, Runner* reference, long checked) {
+    CPU* a = &reference->machine->cpu;
+    CPU* b = &runner->machine->cpu;
+    const char* difference = NULL;
+    if (a->cycle_count != b->cycle_count || a->instruction_count != b->instruction_count) {
+        difference = "counts";
+    } else if (a->r.PC != b->r.PC || a->r.A != b->r.A || a->r.X != b->r.X || a->r.Y != b->r.Y ||
+               CPU_get_P(a) != CPU_get_P(b) || a->r.SP != b->r.SP) {
+        difference = "registers";
+    } else if (a->is_running != b->is_running || (!a->is_running && a->stop_reason != b->stop_reason)) {
+        difference = "stop";
+    } else {
+        Machine_read_ram(runner->machine, runner->ram);
+        for (u32 i = 0; i < MACHINE_RAM_SIZE && difference == NULL; i++) {
+            if (runner->ram[i] != reference->ram[i]) {
+                printf("RAM at $%04X: %s has %02X, %s has %02X\n", i, reference->name, reference->ram[i], runner->name, runner->ram[i]);
+                difference = "RAM";
+            }
+        }
+    }
+    if (difference == NULL) {
+        u8 expected[4096];
+        u8 got[sizeof(expected)];
+        u32 count;
+        do {
+            count = _Runner_read_output(reference, checked, expected, sizeof(expected));
+            if (_Runner_read_output(runner, checked, got, sizeof(got)) != count || memcmp(expected, got, count) != 0) {
+                difference = "ACIA output";
+            }
+            checked += count;
+        } while (count == sizeof(expected) && difference == NULL);
+    }
+    if (difference != NULL) {
+        printf("%s and %s differ (%s):\n", reference->name, runner->name, difference);
+        _Runner_print(reference);
+        _Runner_print(runner);
+    }
+    return difference == NULL;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Not enough arguments!\n    Usage: ya6502-difftest <ROM file> [cycles] [cycles between checks]\n");
+        return 1;
+    }
+    u64 cycle_limit = argc > 2 ? strtoull(argv[2], NULL, 0) : 10000000;
+    u64 interval = argc > 3 ? strtoull(argv[3], NULL, 0) : 100000;
+    guarantee(interval > 0, "Cycles between checks can't be 0");
+    MachineImage* image = MachineImage_load(argv[1]);
+    guarantee(image != NULL, "Error reading file (does it exist? is it empty?)");
+
+    Runner runners[4] = {0};
+    u32 runner_count = 0;
+    guarantee(_Runner_create(&runners[runner_count++], "emulate", image), "Error creating the machines");
+    guarantee(_Runner_create(&runners[runner_count++], "run", image), "Error creating the machines");
+    guarantee(_Runner_create(&runners[runner_count], "jit", image), "Error creating the machines");
+    if (Machine_enable_jit(runners[runner_count].machine)) {
+        runner_count++;
+    } else {
+        _Runner_destroy(&runners[runner_count]);
+        runners[runner_count] = (Runner){0};
+        fprintf(stderr, "No JIT on this host, leaving it out\n");
+    }
+    #ifdef CPU_AOT
+    guarantee(_Runner_create(&runners[runner_count], "aot", image), "Error creating the machines");
+    if (Machine_enable_aot(runners[runner_count].machine, &aot_program)) {
+        runner_count++;
+    } else {
+        _Runner_destroy(&runners[runner_count]);
+        runners[runner_count] = (Runner){0};
+        fprintf(stderr, "The AOT build is of another ROM, leaving it out\n");
+    }
+    #endif
+    MachineImage_release(image);
+    #ifdef CPU_THREADED_CORE
+    fprintf(stderr, "Comparing %u ways of running %s, CPU_run is the threaded core\n", runner_count, argv[1]);
+    #else
+    fprintf(stderr, "Comparing %u ways of running %s, CPU_run is the table core\n", runner_count, argv[1]);
+    #endif
+
+    Runner* reference = &runners[0];
+    CPU* cpu = &reference->machine->cpu;
+    long checked = 0;
+    bool agree = true;
+    for (u64 cycle = interval; agree && cpu->is_running && cpu->cycle_count < cycle_limit; cycle += interval) {
+        for (u32 i = 0; i < runner_count; i++) {
+            _Runner_run_to(&runners[i], cycle, i == 0);
+        }
+        Machine_read_ram(reference->machine, reference->ram);
+        for (u32 i = 1; i < runner_count && agree; i++) {
+            agree = _Runner_matches(&runners[i], reference, checked);
+        }
+        fflush(reference->file);
+        checked = ftell(reference->file);
+        if (agree) {
+            printf("%12llu  %10llu  PC=%04X A=%02X X=%02X Y=%02X P=%02X SP=%02X  RAM %08X  %ld bytes out\n",
+                   cpu->cycle_count, cpu->instruction_count, cpu->r.PC, cpu->r.A, cpu->r.X, cpu->r.Y, CPU_get_P(cpu),
+                   cpu->r.SP, AOT_checksum(reference->ram, MACHINE_RAM_SIZE), checked);
+        }
+    }
+    if (agree && !cpu->is_running) {
+        printf("Stopped (reason %u)\n", cpu->stop_reason);
+    }
+
+    for (u32 i = 0; i < runner_count; i++) {
+        _Runner_destroy(&runners[i]);
+    }
+    return agree ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+/* ya6502-recompile: translates a ROM image into C for AOT_run.
+ *     Usage: ya6502-recompile <rom file> <output .c file>
+ *
+ * The ROM is loaded at $8000 like ya6502 does. Code is found by following
+ * control flow from the reset, NMI and IRQ vectors with the decode from
+ * opcodes.h, and each basic block becomes one C function that works on A/X/Y/SP
+ * and the flags in locals. Blocks end at branches, JMP, JSR, RTS, on the next
+ * block's start, or right before something left to the interpreter:
+ * JMP (ind) and RTI (their targets aren't known here), DBP, BRK, WAI, STP and
+ * illegal opcodes. They also end after anything that can make an interrupt
+ * due, since AOT_run only looks between blocks: CLI, PLP and accesses that
+ * can reach a device.
+ * The generated code has the same behaviour as the interpreter, quirks included.
+ */
+#include "cpu.h"
+#include "aot.h"
+#define _EMULATE_W65C02S // Same opcode set as cpu.c
+#include "opcodes.h"
+
+#define ROM_BASE 0x8000
+#define RAM_END  0x2000 /* $0000-$1FFF is RAM, everything else up to the ROM is I/O (see machine.h) */
+
+static u8 ROM[0x8000];
+static bool is_start[0x10000];  /* Decoded as an instruction */
+static bool is_leader[0x10000]; /* Starts a block */
+static u16  worklist[0x10000];
+static u32  worklist_size = 0;
+
+static const char* const mnemonics[256] = {
+    #define X(opcode, op, mode) [opcode] = #op,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) [opcode] = #mnemonic,
+    CPU_OTHER_OPCODES(X)
+    CPU_W65C02S_OPCODES(X)
+    #undef X
+};
+
+static const u8 addressing_mode[256] = {
+    #define X(opcode, op, mode) [opcode] = ADDR_##mode,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) [opcode] = ADDR_##mode,
+    CPU_OTHER_OPCODES(X)
+    CPU_W65C02S_OPCODES(X)
+    #undef X
+};
+
+static bool in_rom(u16 address) {
+    return address >= ROM_BASE;
+}
+
+static u8 rom_read(u16 address) {
+    return ROM[address - ROM_BASE];
+}
+
+static bool is_branch(u8 opcode) {
+    return (opcode & 0x1F) == 0x10;
+}
+
+/* Instructions the generated code doesn't do, the interpreter runs them */
+static bool is_interpreted(u8 opcode) {
+    return opcode_length[opcode] == 0 || opcode == 0x6C || opcode == 0x02 || opcode == 0x00 || opcode == 0x40 ||
+           opcode == 0xCB || opcode == 0xDB;
+}
+
+static bool ends_block(u8 opcode) {
+    return is_branch(opcode) || opcode == 0x4C || opcode == 0x20 || opcode == 0x60;
+}
+
+/* Whether an access goes to read_fn/write_fn, where a device can raise a line. Writes to the ROM do too */
+static bool reaches_device(u16 address, bool store) {
+    return (address >= RAM_END && !in_rom(address)) || (store && in_rom(address));
+}
+
+/* Whether an instruction can change which interrupts are due, same rule as _JIT_may_interrupt */
+static bool may_interrupt(u8 opcode, u16 operand) {
+    if (opcode == 0x58 || opcode == 0x28) { // CLI, PLP
+        return true;
+    }
+    const char* op = mnemonics[opcode];
+    bool store = !strcmp(op, "STA") || !strcmp(op, "STX") || !strcmp(op, "STY") || !strcmp(op, "ASL") || !strcmp(op, "ROL");
+    switch (addressing_mode[opcode]) {
+        case ADDR_ABS:   return reaches_device(operand, store);
+        case ADDR_ABS_Y: return reaches_device(operand, store) || reaches_device(operand + 0xFF, store);
+        case ADDR_X_IND: return true; // The pointer can point anywhere
+        default:         return false; // Zero page and stack are RAM
+    }
+}
+
+/* Same target as _CPU_branch_logic, which keeps the page of the next instruction */
+static u16 branch_target(u16 pc, u8 offset) {
+    u16 old_pc = pc + 2;
+    return ((old_pc + (i8)offset) & 0xFF) + (old_pc & 0xFF00);
+}
+
+static u16 operand_at(u16 pc, u8 length) {
+    return (length > 1 ? rom_read(pc + 1) : 0) | (length > 2 ? rom_read(pc + 2) << 8 : 0);
+}
+
+/* Whether the whole instruction is in the ROM, without wrapping around to $0000 */
+static bool fits_in_rom(u16 pc, u8 length) {
+    return in_rom(pc) && (u32)pc + length <= 0x10000;
+}
+
+static void add_leader(u16 address) {
+    if (in_rom(address) && !is_leader[address]) {
+        is_leader[address] = true;
+        worklist[worklist_size++] = address;
+    }
+}
+
+/* Follows straight-line code from a leader, adding the blocks it can go to */
+static void trace(u16 pc) {
+    bool first = true;
+    while (in_rom(pc)) {
+        if (is_start[pc]) {
+            // Already traced from here on. Code that runs into it joins there
+            if (!first) {
+                add_leader(pc);
+            }
+            return;
+        }
+        first = false;
+        is_start[pc] = true;
+        u8 opcode = rom_read(pc);
+        u8 length = opcode_length[opcode];
+        if (is_interpreted(opcode) || !fits_in_rom(pc, length)) {
+            if (opcode == 0x02) {
+                add_leader(pc + 1); // DBP carries on after printing
+            }
+            return;
+        }
+        u16 operand = operand_at(pc, length);
+        if (is_branch(opcode)) {
+            add_leader(pc + 2);
+            add_leader(branch_target(pc, operand));
+            return;
+        }
+        switch (opcode) {
+            case 0x4C: add_leader(operand);                      return; // JMP abs
+            case 0x20: add_leader(operand); add_leader(pc + 3);  return; // JSR, RTS comes back after it
+            case 0x60:                                           return; // RTS
+        }
+        if (may_interrupt(opcode, operand)) {
+            add_leader(pc + length); // Starts a block of its own, so AOT_run gets to look in between
+            return;
+        }
+        pc += length;
+    }
+}
+
+/* Cycles, the same ones the interpreter takes */
+static u8 instruction_cycles(u8 opcode) {
+    if (opcode_base_cycles[opcode]) {
+        bool rmw = !strcmp(mnemonics[opcode], "ASL") || !strcmp(mnemonics[opcode], "ROL");
+        return opcode_base_cycles[opcode] + (rmw ? 3 : 1);
+    }
+    if (is_branch(opcode)) {
+        return 3;
+    }
+    switch (opcode) {
+        case 0x4C: return 4; // JMP abs
+        case 0x20: return 6; // JSR
+        case 0x60: return 5; // RTS
+    }
+    return 2;
+}
+
+/* Writes the C for one instruction, the operand and address expressions come from its addressing mode */
+static void emit_instruction(FILE* out, u16 pc, u8 opcode, u16 operand) {
+    char value[48];   // Operand value
+    char address[48]; // Operand address, for stores and read-modify-write
+    const char* op = mnemonics[opcode];
+
+    fprintf(out, "    /* $%04X  %-4s", pc, op);
+    switch (addressing_mode[opcode]) {
+        case ADDR_IMM:   fprintf(out, "#$%02X", operand);      break;
+        case ADDR_ZPG:   fprintf(out, "$%02X", operand);       break;
+        case ADDR_ABS:   fprintf(out, "$%04X", operand);       break;
+        case ADDR_ABS_Y: fprintf(out, "$%04X,Y", operand);     break;
+        case ADDR_X_IND: fprintf(out, "($%02X,X)", operand);   break;
+        case ADDR_IND:   fprintf(out, "($%04X)", operand);     break;
+        case ADDR_ACC:   fprintf(out, "A");                    break;
+        case ADDR_REL:   fprintf(out, "$%04X", branch_target(pc, operand)); break;
+    }
+    fprintf(out, " */\n");
+
+    switch (addressing_mode[opcode]) {
+        case ADDR_IMM:
+            snprintf(value, sizeof(value), "0x%02X", operand & 0xFF);
+            address[0] = '\0';
+            break;
+        case ADDR_ZPG:
+        case ADDR_ABS:
+            snprintf(address, sizeof(address), "0x%04X", operand);
+            snprintf(value, sizeof(value), "READ(0x%04X)", operand);
+            break;
+        case ADDR_ABS_Y:
+            snprintf(address, sizeof(address), "(u16)(0x%04X + y)", operand);
+            snprintf(value, sizeof(value), "READ((u16)(0x%04X + y))", operand);
+            break;
+        case ADDR_X_IND: // Pointer bytes wrap around in the zero page
+            fprintf(out, "    ad = READ((u8)(0x%02X + x)); ad |= READ((u8)(0x%02X + x + 1)) << 8;\n", operand, operand);
+            snprintf(address, sizeof(address), "ad");
+            snprintf(value, sizeof(value), "READ(ad)");
+            break;
+        default:
+            value[0] = address[0] = '\0';
+            break;
+    }
+
+    if (opcode_base_cycles[opcode]) { // Addressed
+        if      (!strcmp(op, "LDA")) fprintf(out, "    a = %s; NZ(a);\n", value);
+        else if (!strcmp(op, "LDX")) fprintf(out, "    x = %s; NZ(x);\n", value);
+        else if (!strcmp(op, "LDY")) fprintf(out, "    y = %s; NZ(y);\n", value);
+        else if (!strcmp(op, "STA")) fprintf(out, "    WRITE(%s, a);\n", address);
+        else if (!strcmp(op, "STX")) fprintf(out, "    WRITE(%s, x);\n", address);
+        else if (!strcmp(op, "STY")) fprintf(out, "    WRITE(%s, y);\n", address);
+        else if (!strcmp(op, "AND")) fprintf(out, "    a &= %s; NZ(a);\n", value);
+        else if (!strcmp(op, "ORA")) fprintf(out, "    a |= %s; NZ(a);\n", value);
+        else if (!strcmp(op, "EOR")) fprintf(out, "    a ^= %s; NZ(a);\n", value);
+        else if (!strcmp(op, "ADC")) fprintf(out, "    a = a + %s + (p & FLAGS_CAR); NZ(a);\n", value);
+        else if (!strcmp(op, "SBC")) fprintf(out, "    a = a - %s - (1 - (p & FLAGS_CAR)); NZ(a);\n", value);
+        else if (!strcmp(op, "CMP")) fprintf(out, "    t = %s; COMPARE(a, t);\n", value);
+        else if (!strcmp(op, "CPX")) fprintf(out, "    t = %s; COMPARE(x, t);\n", value);
+        else if (!strcmp(op, "CPY")) fprintf(out, "    t = %s; COMPARE(y, t);\n", value);
+        else if (!strcmp(op, "BIT")) fprintf(out, "    t = %s; z = t & a; n = t; p = (p & ~FLAGS_OVR) | (t & FLAGS_OVR);\n", value);
+        else if (!strcmp(op, "ASL")) fprintf(out, "    t = %s; WRITE(%s, t); WRITE(%s, (u8)(t << 1));\n", value, address, address);
+        else if (!strcmp(op, "ROL")) {
+            fprintf(out, "    t = %s; WRITE(%s, t); c = p & FLAGS_CAR; p = (p & ~FLAGS_CAR) | (t >> 7); WRITE(%s, (u8)((t << 1) | c));\n",
+                    value, address, address);
+        }
+        return;
+    }
+
+    if (is_branch(opcode)) {
+        static const char* const conditions[] = {"n & FLAGS_NEG", "p & FLAGS_OVR", "p & FLAGS_CAR", "z == 0"};
+        const char* condition = conditions[(opcode & 0xC0) >> 6];
+        fprintf(out, "    cpu->r.PC = %s(%s) ? 0x%04X : 0x%04X;\n", (opcode & 0x20) ? "" : "!",
+                condition, branch_target(pc, operand), (u16)(pc + 2));
+        return;
+    }
+    switch (opcode) {
+        case 0x0A: case 0x2A:   fprintf(out, "    a <<= 1;\n"); break; // ROL A only shifts in the interpreter too
+        case 0x89: case 0xEA:   break;
+        case 0xAA:              fprintf(out, "    x = a; NZ(x);\n"); break;
+        case 0x8A:              fprintf(out, "    a = x; NZ(a);\n"); break;
+        case 0xA8:              fprintf(out, "    y = a; NZ(y);\n"); break;
+        case 0x98:              fprintf(out, "    a = y; NZ(a);\n"); break;
+        case 0xE8:              fprintf(out, "    x++; NZ(x);\n"); break;
+        case 0xCA:              fprintf(out, "    x--; NZ(x);\n"); break;
+        case 0xC8:              fprintf(out, "    y++; NZ(y);\n"); break;
+        case 0x88:              fprintf(out, "    y--; NZ(y);\n"); break;
+        case 0x1A:              fprintf(out, "    a++; NZ(a);\n"); break;
+        case 0x3A:              fprintf(out, "    a--; NZ(a);\n"); break;
+        case 0x48:              fprintf(out, "    WRITE(0x100 + sp--, a);\n"); break;
+        case 0x68:              fprintf(out, "    a = READ(0x100 + ++sp);\n"); break;
+        case 0x08:              fprintf(out, "    WRITE(0x100 + sp--, GET_P() | FLAGS_BRK);\n"); break;
+        case 0x28:              fprintf(out, "    t = READ(0x100 + ++sp) & ~FLAGS_BRK; SET_P(t);\n"); break;
+        case 0x4C:              fprintf(out, "    cpu->r.PC = 0x%04X;\n", operand); break;
+        case 0x20:
+            fprintf(out, "    WRITE(0x100 + sp--, 0x%02X); WRITE(0x100 + sp--, 0x%02X);\n", (u16)(pc + 2) >> 8, (pc + 2) & 0xFF);
+            fprintf(out, "    cpu->r.PC = 0x%04X;\n", operand);
+            break;
+        case 0x60:
+            fprintf(out, "    (void)READ(sp); ad = READ(0x100 + ++sp); ad |= READ(0x100 + ++sp) << 8;\n");
+            fprintf(out, "    cpu->r.PC = ad + 1;\n");
+            break;
+        default: { // Flag instructions, decoded like _CPU_flags_logic
+            u8 flag = instruction_flag_by_index[(opcode & 0xC0) >> 6];
+            fprintf(out, "    p = (p & ~0x%02X) | 0x%02X;\n", flag, (opcode & 0x20) ? flag : 0);
+            break;
+        }
+    }
+}
+
+/* Whether the generated code can do the instruction at pc */
+static bool is_compiled(u16 pc) {
+    u8 opcode = rom_read(pc);
+    return !is_interpreted(opcode) && fits_in_rom(pc, opcode_length[opcode]);
+}
+
+/* Writes the function for the block at leader, which has to start with a compiled instruction */
+static void emit_block(FILE* out, u16 leader, AOTBlock* block) {
+    u16 pc = leader;
+    u16 cycles = 0;
+    u16 instructions = 0;
+    bool jumped = false;
+
+    fprintf(out, "static void block_%04X(CPU* cpu) {\n    LOAD();\n", leader);
+    while (true) {
+        if ((pc != leader && is_leader[pc]) || !is_compiled(pc)) {
+            break;
+        }
+        u8 opcode = rom_read(pc);
+        u8 length = opcode_length[opcode];
+        emit_instruction(out, pc, opcode, operand_at(pc, length));
+        cycles += instruction_cycles(opcode);
+        instructions++;
+        pc += length;
+        if (ends_block(opcode)) {
+            jumped = true;
+            break;
+        }
+        if (!in_rom(pc)) {
+            break;
+        }
+    }
+    if (!jumped) {
+        fprintf(out, "    cpu->r.PC = 0x%04X;\n", pc);
+    }
+    fprintf(out, "    STORE();\n}\n\n");
+
+    block->pc = leader;
+    block->cycles = cycles;
+    block->instructions = instructions;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("Not enough arguments!\n    Usage: ya6502-recompile <rom file> <output .c file>\n");
+        return 1;
+    }
+    FILE* rom_file = fopen(argv[1], "rb");
+    guarantee(rom_file != NULL, "Error opening ROM (does it exist?)");
+    size_t read_bytes = fread(ROM, 1, sizeof(ROM), rom_file);
+    fclose(rom_file);
+    guarantee(read_bytes > 0, "Error reading ROM (is it empty?)");
+
+    // Interrupt vectors too, they don't hurt when nothing uses them
+    static const u16 vectors[] = {0xFFFC, 0xFFFA, 0xFFFE};
+    for (u32 i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        add_leader(rom_read(vectors[i]) | (rom_read(vectors[i] + 1) << 8));
+    }
+    while (worklist_size > 0) {
+        trace(worklist[--worklist_size]);
+    }
+
+    FILE* out = fopen(argv[2], "w");
+    guarantee(out != NULL, "Error opening output file");
+    fprintf(out, "/* Generated by ya6502-recompile from %s, do not edit */\n", argv[1]);
+    fprintf(out, "#include \"aot.h\"\n\n");
+    fprintf(out, "#define READ(address)        CPU_read(cpu, address)\n");
+    fprintf(out, "#define WRITE(address, data) CPU_write(cpu, address, data)\n");
+    fprintf(out, "#define NZ(value)            (n = z = (value))\n");
+    fprintf(out, "#define COMPARE(reg, value)  NZ((u8)(reg - value)); p = (p & ~FLAGS_CAR) | (reg >= value ? FLAGS_CAR : 0)\n");
+    fprintf(out, "#define GET_P()              ((p & ~(FLAGS_NEG | FLAGS_ZER)) | (n & FLAGS_NEG) | (z == 0 ? FLAGS_ZER : 0))\n");
+    fprintf(out, "#define SET_P(value)         (p = n = (value), z = ((value) & FLAGS_ZER) ? 0 : 1)\n");
+    fprintf(out, "#define LOAD()  u8 a = cpu->r.A, x = cpu->r.X, y = cpu->r.Y, sp = cpu->r.SP; \\\n");
+    fprintf(out, "                u8 p = cpu->r.P, n = cpu->flag_n_source, z = cpu->flag_z_source; \\\n");
+    fprintf(out, "                u8 t, c; u16 ad; (void)t; (void)c; (void)ad\n");
+    fprintf(out, "#define STORE() cpu->r.A = a; cpu->r.X = x; cpu->r.Y = y; cpu->r.SP = sp; \\\n");
+    fprintf(out, "                cpu->r.P = p; cpu->flag_n_source = n; cpu->flag_z_source = z\n\n");
+
+    static AOTBlock blocks[0x8000];
+    u32 block_count = 0;
+    for (u32 pc = ROM_BASE; pc < 0x10000; pc++) {
+        if (is_leader[pc] && is_compiled(pc)) {
+            emit_block(out, pc, &blocks[block_count++]);
+        }
+    }
+
+    fprintf(out, "static const AOTBlock blocks[] = {\n");
+    for (u32 i = 0; i < block_count; i++) {
+        fprintf(out, "    {0x%04X, %u, %u, block_%04X},\n", blocks[i].pc, blocks[i].cycles, blocks[i].instructions, blocks[i].pc);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "const AOTProgram aot_program = {0x%04X, 0x%X, 0x%08X, %u, blocks};\n",
+            ROM_BASE, (u32)sizeof(ROM), AOT_checksum(ROM, sizeof(ROM)), block_count);
+    fclose(out);
+
+    printf("%u blocks\n", block_count);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* ya6502-tracedump: turns a trace file written by Trace_dump into text.
+ *     Usage: ya6502-tracedump <trace file> [how many of the last records]
+ *
+ * One line per instruction, oldest first: the cycle it started on, its
+ * address, opcode and mnemonic, the registers before it ran and the
+ * effective address it used, if any.
+ */
+#include "trace.h"
+#define _EMULATE_W65C02S // Same opcode set as cpu.c
+#include "opcodes.h"
+
+static const char* const mnemonics[256] = {
+    #define X(opcode, op, mode) [opcode] = #op,
+    CPU_ADDRESSED_OPCODES(X)
+    #undef X
+    #define X(opcode, mnemonic, mode, handler) [opcode] = #mnemonic,
+    CPU_OTHER_OPCODES(X)
+    CPU_W65C02S_OPCODES(X)
+    #undef X
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Not enough arguments!\n    Usage: ya6502-tracedump <trace file> [how many of the last records]\n");
+        return 1;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    guarantee(file != NULL, "Error opening trace (does it exist?)");
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        printf("%s isn't a trace file\n", argv[1]);
+        return 1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        printf("%s is a version %u trace, this reads version %u\n", argv[1], header.version, TRACE_VERSION);
+        return 1;
+    }
+
+    u64 skip = 0;
+    if (argc > 2) {
+        u64 last = strtoull(argv[2], NULL, 0);
+        skip = last < header.record_count ? header.record_count - last : 0;
+    }
+    printf("%llu instructions traced, showing the last %llu\n", header.total_count, header.record_count - skip);
+    printf("       CYCLE    PC  OP         A   X   Y   P   SP   ADDRESS\n");
+    TraceRecord record;
+    for (u64 i = 0; i < header.record_count && fread(&record, sizeof(record), 1, file) == 1; i++) {
+        if (i < skip) {
+            continue;
+        }
+        u8 opcode = record.access >> 16;
+        const char* mnemonic = mnemonics[opcode] != NULL ? mnemonics[opcode] : "???";
+        printf("%12llu  %04X  %02X %-3s      %02X  %02X  %02X  %02X  %02X",
+               record.cycle_count, (u16)record.registers, opcode, mnemonic,
+               (u8)(record.registers >> 16), (u8)(record.registers >> 24), (u8)(record.registers >> 32),
+               (u8)(record.registers >> 40), (u8)(record.registers >> 48));
+        if ((record.access >> 24) & TRACE_HAS_ADDRESS) {
+            printf("   $%04X", (u16)record.access);
+        }
+        printf("\n");
+    }
+    fclose(file);
+    return 0;
+}